@@ -0,0 +1,489 @@
+#define __MIPS2C_C__
+
+// Ahead-of-time recompiler: translates the script code image to C.
+// Blocks are discovered from the entry points by following the direct branches, fall-throughs and return sites.
+// Each block becomes the function with the mipsvm_native_t signature, the table of all blocks is emitted at the end.
+// Generated file is compiled by the host and passed to mipsvm_set_natives, indirect jumps to the unknown
+// targets and everything not recompiled are executed by the interpreter.
+//
+// Build: cc -o mips2c mips2c.c mipsvm.c
+// Usage: mips2c <image.bin> <load address> <table name> [entry ...] > script.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mipsvm.h"
+#include "mipsvm_int.h"
+
+#define MAX_BLOCK_LEN 64    // instructions per function
+
+typedef struct
+{
+    uint32_t pc;
+    uint32_t len;
+} block_t;
+
+static uint8_t *image;
+static uint32_t image_base;
+static uint32_t image_size;
+
+static block_t *blocks;
+static uint32_t blocks_num;
+static uint32_t *queue;
+static uint32_t queue_num;
+static uint8_t *queued;     // per instruction of the image
+
+static bool r0_dirty;   // r0 was written by the last instruction
+
+static bool in_image(uint32_t pc)
+{
+    return pc % 4 == 0 && pc - image_base < image_size && image_size - (pc - image_base) >= 4;
+}
+
+static uint32_t instr_at(uint32_t pc)
+{
+    const uint8_t *p = image + (pc - image_base);
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int op_at(uint32_t pc, mipsvm_decoded_t *d)
+{
+    mipsvm_decode(instr_at(pc), d);
+    d->pc = pc;
+    return d->op;
+}
+
+static void push(uint32_t pc)
+{
+    if (! in_image(pc) || queued[(pc - image_base) / 4])
+        return;
+
+    queued[(pc - image_base) / 4] = 1;
+    queue[queue_num++] = pc;
+}
+
+static bool is_block_end(int op)
+{
+    return op == OP_reserved || op == OP_syscall || op == OP_break;
+}
+
+// direct target of the branch, or 1 if the target is not known statically
+static uint32_t branch_target(const mipsvm_decoded_t *d)
+{
+    switch (d->op)
+    {
+    case OP_jr: case OP_jalr:
+        return 1;
+
+    case OP_j: case OP_jal:
+        return ((d->pc + 4) & 0xF0000000) | d->imm;
+    }
+
+    return d->pc + 4 + d->imm;
+}
+
+// scans the block at pc and queues its successors
+static void discover(uint32_t pc)
+{
+    mipsvm_decoded_t d;
+    uint32_t len = 0;
+
+    while (len < MAX_BLOCK_LEN && in_image(pc + len * 4))
+    {
+        uint32_t a = pc + len * 4;
+        int op = op_at(a, &d);
+
+        if (mipsvm_is_branch(op))
+        {
+            mipsvm_decoded_t slot;
+            if (len + 2 > MAX_BLOCK_LEN || ! in_image(a + 4) || mipsvm_is_branch(op_at(a + 4, &slot)))
+                break;      // branch is left to the next block (or to the interpreter)
+
+            push(branch_target(&d));
+            if (op != OP_j && op != OP_jr)
+                push(a + 8);    // not taken or the return site
+            len += 2;
+            blocks[blocks_num++] = (block_t) { pc, len };
+            return;
+        }
+
+        len++;
+        if (is_block_end(op))
+        {
+            push(a + 4);    // host resumes the script there
+            blocks[blocks_num++] = (block_t) { pc, len };
+            return;
+        }
+    }
+
+    if (len)
+    {
+        push(pc + len * 4);
+        blocks[blocks_num++] = (block_t) { pc, len };
+    }
+}
+
+static const char *reg(int r)
+{
+    static char buf[4][8];
+    static int n;
+
+    if (r == 0)
+        return "0";
+
+    n = (n + 1) % 4;
+    snprintf(buf[n], sizeof(buf[n]), "r[%d]", r);
+    return buf[n];
+}
+
+// destination register, r0 is written as the interpreter does and cleared before the next instruction
+static const char *dst(int r)
+{
+    static char buf[8];
+
+    if (r == 0)
+        r0_dirty = 1;
+    snprintf(buf, sizeof(buf), "r[%d]", r);
+    return buf;
+}
+
+static void emit_fallback(uint32_t instr, const char *exit_pc, uint32_t idx)
+{
+    printf("    ctx->pc = %s;\n", exit_pc);
+    printf("    mipsvm_exec_instr(ctx, 0x%08Xu);\n", instr);
+    printf("    if (ctx->exception) return %u;\n", idx);
+    r0_dirty = 1;
+}
+
+static void emit_check(const char *exit_pc, uint32_t idx)
+{
+    printf("    if (ctx->exception) EXIT(%s, %u);\n", exit_pc, idx);
+}
+
+static void emit_raise(const char *rc, const char *cond, int code, const char *exit_pc, uint32_t idx)
+{
+    if (cond)
+        printf("    if (%s) { ", cond);
+    else
+        printf("    { ");
+    if (code >= 0)
+        printf("ctx->code = %d; ", code);
+    printf("ctx->exception = %s; EXIT(%s, %u); }\n", rc, exit_pc, idx);
+}
+
+// emits the non-branch instruction, exit_pc is ctx->pc after it (as the interpreter sets it on exception)
+static void emit_instr(const mipsvm_decoded_t *d, const char *exit_pc, uint32_t idx)
+{
+    char cond[128];
+    uint32_t instr = instr_at(d->pc);
+    uint32_t imm = d->imm;
+    const char *rs = reg(d->rs);
+    const char *rt = reg(d->rt);
+
+    if (r0_dirty)
+    {
+        printf("    r[0] = 0;\n");
+        r0_dirty = 0;
+    }
+
+    switch (d->op)
+    {
+    case OP_sll:
+        if (d->rd == 0 && d->rt == 0)
+            printf("    // nop\n");
+        else
+            printf("    %s = %s << %d;\n", dst(d->rd), rt, d->sa);
+        break;
+    case OP_srl:    printf("    %s = %s >> %d;\n", dst(d->rd), rt, d->sa); break;
+    case OP_sra:    printf("    %s = (int32_t)%s >> %d;\n", dst(d->rd), rt, d->sa); break;
+    case OP_sllv:   printf("    %s = %s << (%s & 0x1F);\n", dst(d->rd), rt, rs); break;
+    case OP_srlv:   printf("    %s = %s >> (%s & 0x1F);\n", dst(d->rd), rt, rs); break;
+    case OP_srav:   printf("    %s = (int32_t)%s >> (%s & 0x1F);\n", dst(d->rd), rt, rs); break;
+    case OP_addu:   printf("    %s = %s + %s;\n", dst(d->rd), rs, rt); break;
+    case OP_subu:   printf("    %s = %s - %s;\n", dst(d->rd), rs, rt); break;
+    case OP_and:    printf("    %s = %s & %s;\n", dst(d->rd), rs, rt); break;
+    case OP_or:     printf("    %s = %s | %s;\n", dst(d->rd), rs, rt); break;
+    case OP_xor:    printf("    %s = %s ^ %s;\n", dst(d->rd), rs, rt); break;
+    case OP_nor:    printf("    %s = ~(%s | %s);\n", dst(d->rd), rs, rt); break;
+    case OP_slt:    printf("    %s = (int32_t)%s < (int32_t)%s;\n", dst(d->rd), rs, rt); break;
+    case OP_sltu:   printf("    %s = %s < %s;\n", dst(d->rd), rs, rt); break;
+    case OP_movz:   printf("    if (%s == 0) %s = %s;\n", rt, dst(d->rd), rs); break;
+    case OP_movn:   printf("    if (%s != 0) %s = %s;\n", rt, dst(d->rd), rs); break;
+    case OP_mfhi:   printf("    %s = ctx->hi;\n", dst(d->rd)); break;
+    case OP_mflo:   printf("    %s = ctx->lo;\n", dst(d->rd)); break;
+    case OP_mthi:   printf("    ctx->hi = %s;\n", rs); break;
+    case OP_mtlo:   printf("    ctx->lo = %s;\n", rs); break;
+    case OP_mult:   printf("    ctx->acc = (int64_t)(int32_t)%s * (int32_t)%s;\n", rs, rt); break;
+    case OP_multu:  printf("    ctx->acc = (uint64_t)%s * %s;\n", rs, rt); break;
+    case OP_madd:   printf("    ctx->acc += (int64_t)(int32_t)%s * (int32_t)%s;\n", rs, rt); break;
+    case OP_maddu:  printf("    ctx->acc += (uint64_t)%s * %s;\n", rs, rt); break;
+    case OP_msub:   printf("    ctx->acc -= (int64_t)(int32_t)%s * (int32_t)%s;\n", rs, rt); break;
+    case OP_msubu:  printf("    ctx->acc -= (uint64_t)%s * %s;\n", rs, rt); break;
+    case OP_mul:    printf("    %s = (int32_t)%s * (int32_t)%s;\n", dst(d->rd), rs, rt); break;
+    case OP_seb:    printf("    %s = (int32_t)(int8_t)%s;\n", dst(d->rd), rt); break;
+    case OP_seh:    printf("    %s = (int32_t)(int16_t)%s;\n", dst(d->rd), rt); break;
+    case OP_addiu:  printf("    %s = %s + 0x%08Xu;\n", dst(d->rt), rs, imm); break;
+    case OP_andi:   printf("    %s = %s & 0x%08Xu;\n", dst(d->rt), rs, imm); break;
+    case OP_ori:    printf("    %s = %s | 0x%08Xu;\n", dst(d->rt), rs, imm); break;
+    case OP_xori:   printf("    %s = %s ^ 0x%08Xu;\n", dst(d->rt), rs, imm); break;
+    case OP_lui:    printf("    %s = 0x%08Xu;\n", dst(d->rt), imm); break;
+    case OP_slti:   printf("    %s = (int32_t)%s < %d;\n", dst(d->rt), rs, d->imm); break;
+    case OP_sltiu:  printf("    %s = %s < 0x%08Xu;\n", dst(d->rt), rs, imm); break;
+
+    case OP_add:
+    case OP_sub:
+    case OP_addi:
+    {
+        const char *b = d->op == OP_addi ? 0 : rt;
+        char bimm[16];
+        if (! b)
+        {
+            snprintf(bimm, sizeof(bimm), "0x%08Xu", imm);
+            b = bimm;
+        }
+
+        printf("    {\n");
+        printf("        uint32_t t = %s %c %s;\n", rs, d->op == OP_sub ? '-' : '+', b);
+        if (d->op == OP_sub)
+            printf("        if (((%s ^ %s) & (t ^ %s)) >> 31) ", rs, b, rs);
+        else
+            printf("        if (((t ^ %s) & (t ^ %s)) >> 31) ", rs, b);
+        printf("{ ctx->exception = MIPSVM_RC_INTEGER_OVERFLOW; EXIT(%s, %u); }\n", exit_pc, idx);
+        printf("        %s = t;\n", dst(d->op == OP_addi ? d->rt : d->rd));
+        printf("    }\n");
+        break;
+    }
+
+    case OP_lb:
+    case OP_lbu:
+    case OP_lh:
+    case OP_lhu:
+    case OP_lw:
+    {
+        static const char *fmt[] =
+        {
+            [OP_lb] = "(int32_t)(int8_t)mipsvm_readb", [OP_lbu] = "mipsvm_readb",
+            [OP_lh] = "(int32_t)(int16_t)mipsvm_readh", [OP_lhu] = "mipsvm_readh", [OP_lw] = "mipsvm_readw",
+        };
+        printf("    %s = %s(ctx, %s + 0x%08Xu);\n", dst(d->rt), fmt[d->op], rs, imm);
+        emit_check(exit_pc, idx);
+        break;
+    }
+
+    case OP_sb:
+    case OP_sh:
+    case OP_sw:
+    {
+        const char *fn = d->op == OP_sb ? "mipsvm_writeb" : d->op == OP_sh ? "mipsvm_writeh" : "mipsvm_writew";
+        printf("    %s(ctx, %s + 0x%08Xu, %s);\n", fn, rs, imm, rt);
+        emit_check(exit_pc, idx);
+        break;
+    }
+
+    case OP_teq: case OP_tge: case OP_tgeu: case OP_tlt: case OP_tltu: case OP_tne:
+    {
+        static const char *fmt[] =
+        {
+            [OP_teq] = "%s == %s", [OP_tge] = "(int32_t)%s >= (int32_t)%s", [OP_tgeu] = "%s >= %s",
+            [OP_tlt] = "(int32_t)%s < (int32_t)%s", [OP_tltu] = "%s < %s", [OP_tne] = "%s != %s",
+        };
+        snprintf(cond, sizeof(cond), fmt[d->op], rs, rt);
+        emit_raise("MIPSVM_RC_TRAP", cond, d->imm, exit_pc, idx);
+        break;
+    }
+
+    case OP_teqi: case OP_tgei: case OP_tgeiu: case OP_tlti: case OP_tltiu: case OP_tnei:
+    {
+        static const char *fmt[] =
+        {
+            [OP_teqi] = "%s == 0x%08Xu", [OP_tgei] = "(int32_t)%s >= (int32_t)0x%08Xu", [OP_tgeiu] = "%s >= 0x%08Xu",
+            [OP_tlti] = "(int32_t)%s < (int32_t)0x%08Xu", [OP_tltiu] = "%s < 0x%08Xu", [OP_tnei] = "%s != 0x%08Xu",
+        };
+        snprintf(cond, sizeof(cond), fmt[d->op], rs, imm);
+        emit_raise("MIPSVM_RC_TRAP", cond, -1, exit_pc, idx);
+        break;
+    }
+
+    case OP_syscall:    // via the VM, it may handle the host call without the exit
+        emit_fallback(instr, exit_pc, idx);
+        break;
+
+    case OP_break:
+        emit_raise("MIPSVM_RC_BREAK", 0, d->imm, exit_pc, idx);
+        break;
+
+    case OP_reserved:
+        emit_raise("MIPSVM_RC_RESERVED_INSTR", 0, -1, exit_pc, idx);
+        break;
+
+    default:    // div/divu, clz/clo, rotations, bit fields and unaligned access go via the interpreter
+        emit_fallback(instr, exit_pc, idx);
+        break;
+    }
+}
+
+// emits the branch, computing the address of the next instruction to "next"
+static void emit_branch(const mipsvm_decoded_t *d)
+{
+    static const char *fmt[] =
+    {
+        [OP_beq] = "%s == %s", [OP_bne] = "%s != %s",
+        [OP_bltz] = "(int32_t)%s < 0", [OP_bgez] = "(int32_t)%s >= 0",
+        [OP_bltzal] = "(int32_t)%s < 0", [OP_bgezal] = "(int32_t)%s >= 0",
+        [OP_bgtz] = "(int32_t)%s > 0", [OP_blez] = "(int32_t)%s <= 0",
+    };
+    char cond[64];
+    uint32_t ret = d->pc + 8;
+    uint32_t target = branch_target(d);
+
+    if (r0_dirty)
+    {
+        printf("    r[0] = 0;\n");
+        r0_dirty = 0;
+    }
+
+    switch (d->op)
+    {
+    case OP_j:
+        printf("    next = 0x%08Xu;\n", target);
+        break;
+
+    case OP_jal:
+        printf("    r[31] = 0x%08Xu;\n", ret);
+        printf("    next = 0x%08Xu;\n", target);
+        break;
+
+    case OP_jr:
+        printf("    next = %s;\n", reg(d->rs));
+        break;
+
+    case OP_jalr:   // link is written before rs is read
+        printf("    %s = 0x%08Xu;\n", dst(d->rd), ret);
+        printf("    next = %s;\n", reg(d->rs));
+        break;
+
+    case OP_bltzal:
+    case OP_bgezal:     // link only when taken
+        snprintf(cond, sizeof(cond), fmt[d->op], reg(d->rs));
+        printf("    if (%s) { r[31] = 0x%08Xu; next = 0x%08Xu; } else next = 0x%08Xu;\n", cond, ret, target, ret);
+        break;
+
+    default:
+        snprintf(cond, sizeof(cond), fmt[d->op], reg(d->rs), reg(d->rt));
+        printf("    next = (%s) ? 0x%08Xu : 0x%08Xu;\n", cond, target, ret);
+        break;
+    }
+}
+
+static void emit_block(const block_t *b)
+{
+    mipsvm_decoded_t d;
+    uint32_t pc = b->pc;
+    uint32_t end = b->pc + b->len * 4;
+
+    printf("static uint32_t blk_%08X(mipsvm_t *ctx)\n{\n", b->pc);
+    printf("    uint32_t *r = ctx->gpr;\n");
+    printf("    (void) r;\n");
+    r0_dirty = 0;
+
+    for (uint32_t i = 0; i < b->len; i++, pc += 4)
+    {
+        op_at(pc, &d);
+
+        if (mipsvm_is_branch(d.op))
+        {
+            mipsvm_decoded_t slot;
+            op_at(pc + 4, &slot);
+
+            printf("    uint32_t next;\n");
+            emit_branch(&d);
+            emit_instr(&slot, "next", i + 1);
+            printf("    ctx->pc = next;\n");
+            printf("    return %u;\n}\n\n", b->len);
+            return;
+        }
+
+        char exit_pc[16];
+        snprintf(exit_pc, sizeof(exit_pc), "0x%08Xu", pc + 4);
+        emit_instr(&d, exit_pc, i);
+    }
+
+    printf("    EXIT(0x%08Xu, %u);\n}\n\n", end, b->len);
+}
+
+static int cmp_blocks(const void *a, const void *b)
+{
+    uint32_t x = ((const block_t *) a)->pc;
+    uint32_t y = ((const block_t *) b)->pc;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s <image.bin> <load address> <table name> [entry ...]\n", argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (! f)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    image = malloc(size + 1);
+    image_size = size;
+    image_base = strtoul(argv[2], 0, 0);
+    if (! image || fread(image, 1, size, f) != (size_t) size)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    fclose(f);
+
+    uint32_t max = image_size / 4 + 1;
+    blocks = malloc(max * sizeof(*blocks));
+    queue = malloc(max * sizeof(*queue));
+    queued = calloc(max, 1);
+
+    if (argc == 4)
+        push(image_base);
+    for (int i = 4; i < argc; i++)
+        push(strtoul(argv[i], 0, 0));
+
+    for (uint32_t i = 0; i < queue_num; i++)
+        discover(queue[i]);
+
+    qsort(blocks, blocks_num, sizeof(*blocks), cmp_blocks);
+
+    printf("// generated by mips2c from %s, do not edit\n\n", argv[1]);
+    printf("#include <stdint.h>\n#include \"mipsvm.h\"\n\n");
+    printf("#define EXIT(addr, n) do { ctx->pc = (addr); return (n); } while (0)\n\n");
+
+    for (uint32_t i = 0; i < blocks_num; i++)
+        emit_block(&blocks[i]);
+
+    printf("const mipsvm_native_t %s[] =\n{\n", argv[3]);
+    for (uint32_t i = 0; i < blocks_num; i++)
+    {
+        mipsvm_decoded_t d;
+
+        // fuel classes of the instructions, so the block is charged by what it executes
+        printf("    { 0x%08Xu, %u, blk_%08X, (const uint8_t *) \"", blocks[i].pc, blocks[i].len, blocks[i].pc);
+        for (uint32_t j = 0; j < blocks[i].len; j++)
+            printf("\\%o", mipsvm_fuel_class(op_at(blocks[i].pc + j * 4, &d)));
+        printf("\" },\n");
+    }
+    printf("};\n\n");
+    printf("const uint32_t %s_num = %u;\n", argv[3], blocks_num);
+
+    return 0;
+}
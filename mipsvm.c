@@ -4,6 +4,46 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "mipsvm.h"
+#include "mipsvm_int.h"
+
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#define BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define NOINLINE
+#define BARRIER()
+#endif
+
+// execution counters, compiled out unless MIPSVM_STATS is defined
+#ifdef MIPSVM_STATS
+#define STAT(x) (x)
+#else
+#define STAT(x) ((void) 0)
+#endif
+
+// Sandbox access. Fault handler makes the page accessible and sets ctx->exception behind the compiler's back,
+// so the access is volatile and the exception is re-read after it.
+#define FLAT_LOAD(ctx, addr, type) \
+    do \
+    { \
+        type data = *(volatile type *)((ctx)->flat + (addr)); \
+        BARRIER(); \
+        return data; \
+    } while (0)
+
+#define FLAT_STORE(ctx, addr, type, data) \
+    do \
+    { \
+        *(volatile type *)((ctx)->flat + (addr)) = (data); \
+        BARRIER(); \
+    } while (0)
+
+// drops the page made accessible by the sandbox fault handler
+static inline void sandbox_release(mipsvm_t *ctx)
+{
+    if (ctx->sandbox && ctx->sandbox->scratch.used)
+        ctx->sandbox->release(ctx->sandbox);
+}
 
 static void schedule_abs_branch(mipsvm_t *ctx, uint32_t dst)
 {
@@ -17,773 +57,2608 @@ static void schedule_rel_branch(mipsvm_t *ctx, int32_t offset)
     ctx->branch_is_pending = 1;
 }
 
-static uint8_t readb(mipsvm_t *ctx, uint32_t addr)
+// guest call stack, tracked if set by the host
+static NOINLINE void call_enter(mipsvm_t *ctx, uint32_t ret)
 {
-    return ctx->iface.readb(addr);
+    mipsvm_callstack_t *cs = ctx->calls;
+
+    if (cs->depth < cs->size)
+        cs->ret[cs->depth] = ret;
+    cs->depth++;
 }
 
-static uint16_t readh(mipsvm_t *ctx, uint32_t addr)
+static NOINLINE void call_leave(mipsvm_t *ctx, uint32_t ret)
 {
-    if (addr % 2)
+    mipsvm_callstack_t *cs = ctx->calls;
+
+    if (cs->depth > cs->size)   // frame was not recorded
     {
-        ctx->exception = MIPSVM_RC_READ_ADDRESS_ERROR;
-        return 0;
+        cs->depth--;
+        return;
     }
-    return ctx->iface.readh(addr);
-}
 
-static uint32_t readw(mipsvm_t *ctx, uint32_t addr)
-{
-    if (addr % 4)
+    // frames skipped by longjmp and the like are dropped too. Returns to the unknown address are ignored
+    for (uint32_t i = cs->depth; i--; )
     {
-        ctx->exception = MIPSVM_RC_READ_ADDRESS_ERROR;
-        return 0;
+        if (cs->ret[i] == ret)
+        {
+            cs->depth = i;
+            return;
+        }
     }
+}
 
-    return ctx->iface.readw(addr);
+static NOINLINE const mipsvm_tlb_entry_t *tlb_refill(mipsvm_t *ctx, uint32_t page, mipsvm_tlb_entry_t *e)
+{
+    ctx->tstats.misses++;
+
+    e->page = page;
+    e->mem = 0;
+    e->writable = 0;
+    if (! ctx->tlb_refill(page, e))
+        e->mem = 0;     // not the plain memory, remembered as well
+
+    return e;
 }
 
-static void writeb(mipsvm_t *ctx, uint32_t addr, uint8_t data)
+// TLB entry of the page holding addr, refilled on miss
+static inline const mipsvm_tlb_entry_t *tlb_lookup(mipsvm_t *ctx, uint32_t addr)
 {
-    ctx->iface.writeb(addr, data);
+    uint32_t page = addr & -MIPSVM_PAGE_SIZE;
+    mipsvm_tlb_entry_t *e = &ctx->tlb[(addr >> MIPSVM_PAGE_BITS) & ctx->tlb_mask];
+
+    if (e->page != page)
+        return tlb_refill(ctx, page, e);
+
+    ctx->tstats.hits++;
+    return e;
 }
 
-static void writeh(mipsvm_t *ctx, uint32_t addr, uint16_t data)
+// region holding addr, if any. Regions are word-aligned, so the aligned access never crosses the region end
+static inline const mipsvm_region_t *find_region(const mipsvm_t *ctx, uint32_t addr)
 {
-    if (addr % 2)
+    for (uint32_t i = 0; i < ctx->regions_num; i++)
     {
-        ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
-        return;
+        const mipsvm_region_t *r = &ctx->regions[i];
+        if (addr - r->base < r->size)
+            return r;
     }
 
-    ctx->iface.writeh(addr, data);
+    return 0;
 }
 
-static void writew(mipsvm_t *ctx, uint32_t addr, uint32_t data)
+static uint8_t readb(mipsvm_t *ctx, uint32_t addr)
 {
-    if (addr % 4)
+    if (ctx->flat)
+        FLAT_LOAD(ctx, addr, uint8_t);
+
+    if (ctx->tlb)
     {
-        ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
-        return;
+        const mipsvm_tlb_entry_t *e = tlb_lookup(ctx, addr);
+        if (e->mem)
+            return e->mem[addr % MIPSVM_PAGE_SIZE];
     }
 
-    ctx->iface.writew(addr, data);
+    const mipsvm_region_t *r = find_region(ctx, addr);
+    if (r)
+        return r->mem[addr - r->base];
+
+    STAT(ctx->stats.callbacks++);
+    if (ctx->hook)
+        return ctx->hook->read(ctx->hook, addr, 1);
+    return ctx->iface.readb(addr);
 }
 
-static bool exec_special(mipsvm_t *ctx, uint32_t instr)
+static uint16_t readh(mipsvm_t *ctx, uint32_t addr)
 {
-    const int func = instr & 0x3F;
-    const int rs = (instr >> 21) & 0x1F;
-    const int rt = (instr >> 16) & 0x1F;
-    const int rd = (instr >> 11) & 0x1F;
-    const int aux = (instr >> 6) & 0x1F;
+    if (addr % 2)
+    {
+        ctx->exception = MIPSVM_RC_READ_ADDRESS_ERROR;
+        return 0;
+    }
 
-    if (rs == 0 && rt == 0 && aux == 0) // rs, rt, aux unused
+    if (ctx->flat)
+        FLAT_LOAD(ctx, addr, uint16_t);
+
+    if (ctx->tlb)
     {
-        switch (func)
+        const mipsvm_tlb_entry_t *e = tlb_lookup(ctx, addr);
+        if (e->mem)
         {
-        case 0x10:              // mfhi
-            ctx->gpr[rd] = ctx->hi;
-            return 1;
-
-        case 0x12:              // mflo
-            ctx->gpr[rd] = ctx->lo;
-            return 1;
+            uint16_t data;
+            memcpy(&data, e->mem + addr % MIPSVM_PAGE_SIZE, 2);
+            return data;
         }
     }
 
-    if (rt == 0 && rd == 0 && aux == 0)  // aux, rd, rt unused
+    const mipsvm_region_t *r = find_region(ctx, addr);
+    if (r)
     {
-        switch (func)
-        {
-        case 0x11:  // mthi
-            ctx->hi = ctx->gpr[rs];
-            return 1;
+        uint16_t data;
+        memcpy(&data, r->mem + (addr - r->base), 2);
+        return data;
+    }
 
-        case 0x13:  // mtlo
-            ctx->lo = ctx->gpr[rs];
-            return 1;
-        }
+    STAT(ctx->stats.callbacks++);
+    if (ctx->hook)
+        return ctx->hook->read(ctx->hook, addr, 2);
+    return ctx->iface.readh(addr);
+}
+
+static uint32_t readw(mipsvm_t *ctx, uint32_t addr)
+{
+    if (addr % 4)
+    {
+        ctx->exception = MIPSVM_RC_READ_ADDRESS_ERROR;
+        return 0;
     }
 
-    if (rt == 0 && rd == 0) // rt, rd are unused
+    if (ctx->flat)
+        FLAT_LOAD(ctx, addr, uint32_t);
+
+    if (ctx->tlb)
     {
-        switch (func)
+        const mipsvm_tlb_entry_t *e = tlb_lookup(ctx, addr);
+        if (e->mem)
         {
-        case 0x08:  // jr
-            schedule_abs_branch(ctx, ctx->gpr[rs]);
-            return 1;
+            uint32_t data;
+            memcpy(&data, e->mem + addr % MIPSVM_PAGE_SIZE, 4);
+            return data;
         }
     }
 
-    if (rd == 0 && aux == 0)    // rd, aux unused
+    const mipsvm_region_t *r = find_region(ctx, addr);
+    if (r)
     {
-        switch (func)
-        {
-        case 0x1A:  // div
-            ctx->lo = (int32_t) ctx->gpr[rs] / (int32_t) ctx->gpr[rt];
-            ctx->hi = (int32_t) ctx->gpr[rs] % (int32_t) ctx->gpr[rt];
-            return 1;
+        uint32_t data;
+        memcpy(&data, r->mem + (addr - r->base), 4);
+        return data;
+    }
 
-        case 0x1B:  // divu
-            ctx->lo = ctx->gpr[rs] / ctx->gpr[rt];
-            ctx->hi = ctx->gpr[rs] % ctx->gpr[rt];
-            return 1;
+    STAT(ctx->stats.callbacks++);
+    if (ctx->hook)
+        return ctx->hook->read(ctx->hook, addr, 4);
+    return ctx->iface.readw(addr);
+}
 
-        case 0x18:  // mult
-            ctx->acc = ((int64_t) (int32_t) ctx->gpr[rs]) * (int32_t) ctx->gpr[rt];
-            return 1;
+// Drops the blocks holding any word of addr..end. Block is cached in the slot of its pc and starts at most
+// MIPSVM_BLOCK_LEN - 1 words before the written one, so only these slots are looked at unless the range is large.
+static NOINLINE void invalidate_blocks(mipsvm_t *ctx, uint32_t addr, uint64_t end)
+{
+    uint64_t first = (addr & -4U) - (MIPSVM_BLOCK_LEN - 1) * 4ULL;
+    uint64_t slots = (end - first + 3) / 4;
 
-        case 0x19:  // multu
-            ctx->acc = (uint64_t) ctx->gpr[rs] * ctx->gpr[rt];
-            return 1;
-        }
+    if (first > addr)   // wrapped below 0
+    {
+        first = 0;
+        slots = (end + 3) / 4;
     }
 
-    if (aux == 0)  // aux unused
+    if (slots > ctx->blocks_mask)
     {
-        switch (func)
+        for (uint32_t i = 0; i <= ctx->blocks_mask; i++)
         {
-        case 0x0A:  // movz
-            if (ctx->gpr[rt] == 0)
-                ctx->gpr[rd] = ctx->gpr[rs];
-            return 1;
-
-        case 0x0B:  // movn
-            if (ctx->gpr[rt] != 0)
-                ctx->gpr[rd] = ctx->gpr[rs];
-            return 1;
-
-        case 0x2A:  // slt
-            ctx->gpr[rd] = (int32_t)ctx->gpr[rs] < (int32_t)ctx->gpr[rt];
-            return 1;
-
-        case 0x2B:  // sltu
-            ctx->gpr[rd] = ctx->gpr[rs] < ctx->gpr[rt];
-            return 1;
-
-        case 0x20:  // add (w overflow)
-            {
-                uint32_t tmp = ctx->gpr[rs] + ctx->gpr[rt];
-                if (((tmp ^ ctx->gpr[rs]) & (tmp ^ ctx->gpr[rt])) >> 31)
-                    ctx->exception = MIPSVM_RC_INTEGER_OVERFLOW;
-                else
-                    ctx->gpr[rd] = tmp;
-            }
-            return 1;
-
-        case 0x21:  // addu (wo overflow)
-            ctx->gpr[rd] = ctx->gpr[rs] + ctx->gpr[rt];
-            return 1;
-
-        case 0x24:  // and
-            ctx->gpr[rd] = ctx->gpr[rs] & ctx->gpr[rt];
-            return 1;
-
-        case 0x27:  // nor
-            ctx->gpr[rd] = ~(ctx->gpr[rs] | ctx->gpr[rt]);
-            return 1;
-
-        case 0x25:  // or
-            ctx->gpr[rd] = ctx->gpr[rs] | ctx->gpr[rt];
-            return 1;
-
-        case 0x04:  // sllv
-            ctx->gpr[rd] = ctx->gpr[rt] << (ctx->gpr[rs] & 0x1F);
-            return 1;
-
-        case 0x07:  // srav
-            ctx->gpr[rd] = (int32_t) ctx->gpr[rt] >> (ctx->gpr[rs] & 0x1F);
-            return 1;
-
-        case 0x06:  // srlv
-            ctx->gpr[rd] = ctx->gpr[rt] >> (ctx->gpr[rs] & 0x1F);
-            return 1;
-
-        case 0x22:  // sub (w overflow)
+            mipsvm_block_t *b = &ctx->blocks[i];
+            if (b->pc != MIPSVM_DECODED_FREE && b->pc < end && b->pc + b->len * 4ULL > addr)
             {
-                uint32_t tmp = ctx->gpr[rs] - ctx->gpr[rt];
-                if (((ctx->gpr[rs] ^ ctx->gpr[rt]) & (tmp ^ ctx->gpr[rs])) >> 31)
-                    ctx->exception = MIPSVM_RC_INTEGER_OVERFLOW;
-                else
-                    ctx->gpr[rd] = tmp;
+                b->pc = MIPSVM_DECODED_FREE;
+                ctx->bstats.invalidations++;
             }
-            return 1;
-
-        case 0x23:  // subu (w/o overflow)
-            ctx->gpr[rd] = ctx->gpr[rs] - ctx->gpr[rt];
-            return 1;
-
-        case 0x26:  // xor
-            ctx->gpr[rd] = ctx->gpr[rs] ^ ctx->gpr[rt];
-            return 1;
         }
+        return;
     }
 
-    if (rs == 0)    // rs unused
+    for (uint64_t pc = first; pc < end; pc += 4)
     {
-        switch (func)
+        mipsvm_block_t *b = &ctx->blocks[(pc >> 2) & ctx->blocks_mask];
+        if (b->pc == pc && pc + b->len * 4ULL > addr)
         {
-        case 0x00:  // sll
-            ctx->gpr[rd] = ctx->gpr[rt] << aux;
-            return 1;
-
-        case 0x02:  // srl
-            ctx->gpr[rd] = ctx->gpr[rt] >> aux;
-            return 1;
-
-        case 0x03:  // sra
-            ctx->gpr[rd] = (int32_t) ctx->gpr[rt] >> aux;
-            return 1;
+            b->pc = MIPSVM_DECODED_FREE;
+            ctx->bstats.invalidations++;
         }
     }
+}
 
-    if (rt == 0)    // rt unused
-    {
-        switch (func)
-        {
-        case 0x09:  // jalr
-            ctx->gpr[rd] = ctx->pc + 4;
-            schedule_abs_branch(ctx, rs ? ctx->gpr[rs] : 0);    // XXX: r0 should be always 0
-            return 1;
-        }
-    }
+// way holding the line of addr, if any
+static inline uint32_t *icache_find(mipsvm_icache_t *ic, uint32_t addr)
+{
+    uint32_t line = addr >> ic->line_bits << ic->line_bits;
+    uint32_t *tags = &ic->tags[((addr >> ic->line_bits) & ic->sets_mask) * ic->ways];
 
-    switch (func)
-    {
+    for (uint32_t w = 0; w < ic->ways; w++)
+        if (tags[w] == line)
+            return &tags[w];
 
-    case 0x0D:  // break
-        ctx->code = (instr << 6) >> 12;
-        ctx->exception = MIPSVM_RC_BREAK;
-        return 1;
+    return 0;
+}
 
-    case 0x02:
-        if (rs == 1)   // rotr
-        {
-            ctx->gpr[rd] = (ctx->gpr[rt] >> aux) | (ctx->gpr[rt] << (32 - aux));
-            return 1;
-        }
-        break;
+static void icache_invalidate(mipsvm_icache_t *ic, uint32_t addr)
+{
+    uint32_t *tag = icache_find(ic, addr);
+    if (tag)
+    {
+        *tag = MIPSVM_ICACHE_INVALID;
+        ic->stats.invalidations++;
+    }
+}
 
-    case 0x06:
-        if (aux == 1)  // rotrv
-        {
-            int s = ctx->gpr[rs] & 0x1F;
-            ctx->gpr[rd] = (ctx->gpr[rt] >> s) | (ctx->gpr[rt] << (32 - s));
-            return 1;
-        }
-        break;
+// drops the cached decodings of the word being written, marks its page dirty
+static void invalidate_code(mipsvm_t *ctx, uint32_t addr)
+{
+    uint32_t page = (addr - ctx->dirty_base) >> MIPSVM_PAGE_BITS;
+    if (page < ctx->dirty_pages)
+        ctx->dirty[page / 32] |= 1U << page % 32;
 
-    case 0x0C:  // syscall
-        ctx->code = (instr << 6) >> 12;
-        ctx->exception = MIPSVM_RC_SYSCALL;
-        return 1;
+    if (ctx->icache)
+        icache_invalidate(ctx->icache, addr);
 
-    case 0x34:  // teq
-        if (ctx->gpr[rs] == ctx->gpr[rt])
-        {
-            ctx->code = (instr >> 6) & 0x3FF;
-            ctx->exception = MIPSVM_RC_TRAP;
-        }
-        return 1;
+    if (ctx->dcache)
+    {
+        mipsvm_decoded_t *d = &ctx->dcache[(addr >> 2) & ctx->dcache_mask];
+        if (d->pc == (addr & -4U))
+            d->pc = MIPSVM_DECODED_FREE;
+    }
 
-    case 0x30:  // tge
-        if ((int32_t)ctx->gpr[rs] >= (int32_t)ctx->gpr[rt])
-        {
-            ctx->code = (instr >> 6) & 0x3FF;
-            ctx->exception = MIPSVM_RC_TRAP;
-        }
-        return 1;
+    if (addr - ctx->code_lo < ctx->code_hi - ctx->code_lo)  // within the code range covered by blocks
+        invalidate_blocks(ctx, addr, (addr & -4U) + 4);
+}
 
-    case 0x31:  // tgeu
-        if (ctx->gpr[rs] >= ctx->gpr[rt])
-        {
-            ctx->code = (instr >> 6) & 0x3FF;
-            ctx->exception = MIPSVM_RC_TRAP;
-        }
-        return 1;
+#ifdef MIPSVM_JIT
+// invalidate_code for the sandbox stores compiled inline
+void mipsvm_jit_invalidate(mipsvm_t *ctx, uint32_t addr)
+{
+    invalidate_code(ctx, addr);
+}
+#endif
 
-    case 0x32:  // tlt
-        if ((int32_t)ctx->gpr[rs] < (int32_t)ctx->gpr[rt])
-        {
-            ctx->code = (instr >> 6) & 0x3FF;
-            ctx->exception = MIPSVM_RC_TRAP;
-        }
-        return 1;
+// drops the cached code of the range
+static void drop_code(mipsvm_t *ctx, uint32_t addr, uint32_t size)
+{
+    uint64_t end = (uint64_t) addr + size;
 
-    case 0x33:  // tltu
-        if (ctx->gpr[rs] < ctx->gpr[rt])
-        {
-            ctx->code = (instr >> 6) & 0x3FF;
-            ctx->exception = MIPSVM_RC_TRAP;
-        }
-        return 1;
+    mipsvm_invalidate_icache(ctx, addr, size);
 
-    case 0x36:  // tltu
-        if (ctx->gpr[rs] != ctx->gpr[rt])
+    if (ctx->dcache && size / 4 > ctx->dcache_mask)
+        mipsvm_flush_decode_cache(ctx);
+    else if (ctx->dcache)
+    {
+        for (uint64_t pc = addr & -4U; pc < end; pc += 4)
         {
-            ctx->code = (instr >> 6) & 0x3FF;
-            ctx->exception = MIPSVM_RC_TRAP;
+            mipsvm_decoded_t *d = &ctx->dcache[(pc >> 2) & ctx->dcache_mask];
+            if (d->pc == pc)
+                d->pc = MIPSVM_DECODED_FREE;
         }
-        return 1;
     }
 
-    return 0;
+    if (addr < ctx->code_hi && end > ctx->code_lo)  // within the code range covered by blocks
+        invalidate_blocks(ctx, addr, end);
 }
 
-static bool exec_special2(mipsvm_t *ctx, uint32_t instr)
+// invalidate_code for every word of the range written by the host
+void mipsvm_invalidate_range(mipsvm_t *ctx, uint32_t addr, uint32_t size)
 {
-    const int func = instr & 0x3F;
-    const int rs = (instr >> 21) & 0x1F;
-    const int rt = (instr >> 16) & 0x1F;
-    const int rd = (instr >> 11) & 0x1F;
-    const int aux = (instr >> 6) & 0x1F;
+    uint64_t end = (uint64_t) addr + size;
 
-    if (rd == 0 && aux == 0)
+    for (uint64_t page = addr & -MIPSVM_PAGE_SIZE; page < end; page += MIPSVM_PAGE_SIZE)
     {
-        switch (instr)
-        {
-        case 0x00:  // madd
-            ctx->acc += ((int64_t) (int32_t) ctx->gpr[rs]) * (int32_t) ctx->gpr[rt];
-            return 1;
-
-        case 0x01:  // maddu
-            ctx->acc += (uint64_t) ctx->gpr[rs] * ctx->gpr[rt];
-            return 1;
+        uint32_t i = ((uint32_t) page - ctx->dirty_base) >> MIPSVM_PAGE_BITS;
+        if (i < ctx->dirty_pages)
+            ctx->dirty[i / 32] |= 1U << i % 32;
+    }
 
-        case 0x04:  // msub
-            ctx->acc -= ((int64_t) (int32_t) ctx->gpr[rs]) * (int32_t) ctx->gpr[rt];
-            return 1;
+    drop_code(ctx, addr, size);
+}
 
-        case 0x05:  // msubu
-            ctx->acc -= (uint64_t) ctx->gpr[rs] * ctx->gpr[rt];
-            return 1;
-        }
-    }
+// host memory holding addr, up to the end of its page or region. Returns the bytes available there, 0 if addr is not
+// the plain memory, or is read-only and the writable access is asked
+static uint32_t host_chunk(mipsvm_t *ctx, uint32_t addr, bool writable, uint8_t **mem)
+{
+    uint32_t page_left = MIPSVM_PAGE_SIZE - addr % MIPSVM_PAGE_SIZE;
 
-    if (aux == 0)
+    if (ctx->flat)
     {
-        switch (func)
+        // mapped sandbox segments only, the latest mapping wins as in the fault handler
+        const mipsvm_sandbox_t *sb = ctx->sandbox;
+        for (uint32_t i = sb->segments_num; i-- > 0; )
         {
-        case 0x02:  // mul
-            ctx->gpr[rd] = (int32_t)ctx->gpr[rs] * (int32_t)ctx->gpr[rt];
-            return 1;
-
-        // NOTE: no reason to call native hardware clz, we are VM and slow anyway
-        case 0x20:  // clz
-            if (! ctx->gpr[rs])
-                ctx->gpr[rd] = 32;
-            else
+            if (addr - sb->segments[i].addr < sb->segments[i].size)
             {
-                int i = 0;
-                for (uint32_t tmp = ctx->gpr[rs]; ! (tmp & 0x80000000); tmp <<= 1, i++);
-                ctx->gpr[rd] = i;
+                if (writable && ! sb->segments[i].writable)
+                    return 0;
+                *mem = ctx->flat + addr;
+                return page_left;
             }
-            return 1;
+        }
+        return 0;
+    }
 
-        case 0x21:  // clo
-            if (ctx->gpr[rs] == 0xFFFFFFFF)
-                ctx->gpr[rd] = 32;
-            else
-            {
-                int i = 0;
-                for (uint32_t tmp = ctx->gpr[rs]; tmp & 0x80000000; tmp <<= 1, i++);
-                ctx->gpr[rd] = i;
-            }
-            return 1;
+    if (ctx->tlb)
+    {
+        const mipsvm_tlb_entry_t *e = tlb_lookup(ctx, addr);
+        if (e->mem)
+        {
+            if (writable && ! e->writable)
+                return 0;
+            *mem = e->mem + addr % MIPSVM_PAGE_SIZE;
+            return page_left;
         }
     }
 
-    return 0;
+    const mipsvm_region_t *r = find_region(ctx, addr);
+    if (! r || (writable && ! r->writable))
+        return 0;
+
+    *mem = r->mem + (addr - r->base);
+    return r->size - (addr - r->base);
 }
 
-static bool exec_special3(mipsvm_t *ctx, uint32_t instr)
+static void writeb(mipsvm_t *ctx, uint32_t addr, uint8_t data)
 {
-    const int rs = (instr >> 21) & 0x1F;
-    const int rt = (instr >> 16) & 0x1F;
-    const int rd = (instr >> 11) & 0x1F;
-    const int aux = (instr >> 6) & 0x1F;
-    const int func = instr & 0x3F;
+    if (ctx->flat)
+    {
+        invalidate_code(ctx, addr);
+        FLAT_STORE(ctx, addr, uint8_t, data);
+        return;
+    }
 
-    if (rs == 0 && (func == 0x20))    // bshfl ? wtf name
+    if (ctx->tlb)
     {
-        switch (aux)
+        const mipsvm_tlb_entry_t *e = tlb_lookup(ctx, addr);
+        if (e->mem)
         {
-        case 0x10:  // seb
-            ctx->gpr[rd] = (int32_t)(int8_t) ctx->gpr[rt];
-            return 1;
-
-        case 0x18: // seh
-            ctx->gpr[rd] = (int32_t)(int16_t) ctx->gpr[rt];
-            return 1;
-
-        case 0x02:  // wsbh
+            if (! e->writable)
             {
-                uint32_t tmp = ctx->gpr[rt];
-                tmp = ((tmp & 0x00FF0000) << 8) | ((tmp & 0xFF000000) >> 8 ) | ((tmp & 0x000000FF) << 8) | ((tmp & 0x0000FF00) >> 8);
-                ctx->gpr[rd] = tmp;
+                ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
+                return;
             }
-            return 1;
+
+            invalidate_code(ctx, addr);
+            e->mem[addr % MIPSVM_PAGE_SIZE] = data;
+            return;
         }
     }
 
-    if (func == 0x00)   //ext
+    const mipsvm_region_t *r = find_region(ctx, addr);
+    if (r && ! r->writable)
     {
-        uint32_t src = ctx->gpr[rs];
-        src <<= 32 - aux - rd - 1;      // remove msbits
-        src >>= 32 - rd - 1;            // remove lsbits and right-align
-        ctx->gpr[rt] = src;
-        return 1;
+        ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
+        return;
     }
 
-    if (func == 0x04)   // ins
+    invalidate_code(ctx, addr);
+    if (r)
+        r->mem[addr - r->base] = data;
+    else
     {
-        int lsb = aux;
-        int msb = rd;
-
-        uint32_t src = ctx->gpr[rs];
-        src <<= 32 - (msb - lsb + 1);   // clear src msbits
-        src >>= 32 - (msb + 1);         // align
-
-        uint32_t mask = 0xFFFFFFFF;
-        mask <<= 32 - (msb - lsb + 1);   // clear mask msbits
-        mask >>= 32 - (msb + 1);         // align
-
-        ctx->gpr[rt] = (ctx->gpr[rt] & ~mask) | src;
-        return 1;
+        STAT(ctx->stats.callbacks++);
+        if (ctx->hook)
+            ctx->hook->write(ctx->hook, addr, data, 1);
+        else
+            ctx->iface.writeb(addr, data);
     }
-
-    return 0;
 }
 
-static bool exec_jtype(mipsvm_t *ctx, uint32_t instr)
+static void writeh(mipsvm_t *ctx, uint32_t addr, uint16_t data)
 {
-    uint32_t targ = (instr << 8) >> 6;
-
-    switch (instr >> 26)
+    if (addr % 2)
     {
-    case 0x02:  // j
-        schedule_abs_branch(ctx, (ctx->pc & 0xF0000000) | targ);
-        return 1;
-
-    case 0x03:  // jal
-        ctx->gpr[31] = ctx->pc + 4;
-        schedule_abs_branch(ctx, (ctx->pc & 0xF0000000) | targ);
-        return 1;
+        ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
+        return;
     }
-    return 0;
-}
 
-static bool exec_itype(mipsvm_t *ctx, uint32_t instr)
-{
-    const int opcode = instr >> 26;
-    const int rs = (instr >> 21) & 0x1F;
-    const int rt = (instr >> 16) & 0x1F;
-    const uint32_t imm_ze = (instr & 0xFFFF);
-    const int32_t imm_se = (int16_t)(instr & 0xFFFF);
+    if (ctx->flat)
+    {
+        invalidate_code(ctx, addr);
+        FLAT_STORE(ctx, addr, uint16_t, data);
+        return;
+    }
 
-    if (opcode == 1)    // regimm
+    if (ctx->tlb)
     {
-        switch (rt)
+        const mipsvm_tlb_entry_t *e = tlb_lookup(ctx, addr);
+        if (e->mem)
         {
-        case 0x0: // bltz
-            if ((int32_t)ctx->gpr[rs] < 0)
-                schedule_rel_branch(ctx, imm_se << 2);
-            return 1;
-
-        case 0x01:  // bgez
-            if ((int32_t)ctx->gpr[rs] >= 0)
-                schedule_rel_branch(ctx, imm_se << 2);
-            return 1;
-
-        case 0x10: // bltzal
-            if ((int32_t)ctx->gpr[rs] < 0)
-            {
-                ctx->gpr[31] = ctx->pc + 4;
-                schedule_rel_branch(ctx, imm_se << 2);
-            }
-            return 1;
-
-        case 0x11: // bgezal
-            if ((int32_t)ctx->gpr[rs] >= 0)
+            if (! e->writable)
             {
-                ctx->gpr[31] = ctx->pc + 4;
-                schedule_rel_branch(ctx, imm_se << 2);
+                ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
+                return;
             }
-            return 1;
-
-        case 0x0C:  // teqi
-            if (ctx->gpr[rs] == (uint32_t)imm_se)
-                ctx->exception = MIPSVM_RC_TRAP;
-            return 1;
-
-        case 0x08:  // tgei
-            if ((int32_t)ctx->gpr[rs] >= imm_se)
-                ctx->exception = MIPSVM_RC_TRAP;
-            return 1;
-
-        case 0x09:  // tgeiu
-            if (ctx->gpr[rs] >= (uint32_t)imm_se)
-                ctx->exception = MIPSVM_RC_TRAP;
-            return 1;
-
-        case 0x0A:  // tlti
-            if ((int32_t)ctx->gpr[rs] < imm_se)
-                ctx->exception = MIPSVM_RC_TRAP;
-            return 1;
 
-        case 0x0B:  // tltiu
-            if (ctx->gpr[rs] < (uint32_t)imm_se)
-                ctx->exception = MIPSVM_RC_TRAP;
-            return 1;
-
-        case 0x0E:  // tnei
-            if (ctx->gpr[rs] != (uint32_t)imm_se)
-                ctx->exception = MIPSVM_RC_TRAP;
-            return 1;
+            invalidate_code(ctx, addr);
+            memcpy(e->mem + addr % MIPSVM_PAGE_SIZE, &data, 2);
+            return;
         }
     }
 
-    if (rt == 0)
+    const mipsvm_region_t *r = find_region(ctx, addr);
+    if (r && ! r->writable)
     {
-        switch (opcode)
-        {
-        case 0x07:  // bgtz
-            if ((int32_t)ctx->gpr[rs] > 0)
-                schedule_rel_branch(ctx, imm_se << 2);
-            return 1;
-
-        case 0x06:  // blez
-            if ((int32_t)ctx->gpr[rs] <= 0)
-                schedule_rel_branch(ctx, imm_se << 2);
-            return 1;
-        }
+        ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
+        return;
     }
 
-    switch (opcode)
+    invalidate_code(ctx, addr);
+    if (r)
+        memcpy(r->mem + (addr - r->base), &data, 2);
+    else
     {
-    case 0x08:  // addi (w ovf)
-        {
-            uint32_t tmp = ctx->gpr[rs] + imm_se;
-            if (((tmp ^ ctx->gpr[rs]) & (tmp ^ imm_se)) >> 31)
-                ctx->exception = MIPSVM_RC_INTEGER_OVERFLOW;
-            else
-                ctx->gpr[rt] = tmp;
-        }
-        return 1;
+        STAT(ctx->stats.callbacks++);
+        if (ctx->hook)
+            ctx->hook->write(ctx->hook, addr, data, 2);
+        else
+            ctx->iface.writeh(addr, data);
+    }
+}
 
-    case 0x09:  // addiu (wo ovf)
-        ctx->gpr[rt] = ctx->gpr[rs] + imm_se;
+static void writew(mipsvm_t *ctx, uint32_t addr, uint32_t data)
+{
+    if (addr % 4)
+    {
+        ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
+        return;
+    }
+
+    if (ctx->flat)
+    {
+        invalidate_code(ctx, addr);
+        FLAT_STORE(ctx, addr, uint32_t, data);
+        return;
+    }
+
+    if (ctx->tlb)
+    {
+        const mipsvm_tlb_entry_t *e = tlb_lookup(ctx, addr);
+        if (e->mem)
+        {
+            if (! e->writable)
+            {
+                ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
+                return;
+            }
+
+            invalidate_code(ctx, addr);
+            memcpy(e->mem + addr % MIPSVM_PAGE_SIZE, &data, 4);
+            return;
+        }
+    }
+
+    const mipsvm_region_t *r = find_region(ctx, addr);
+    if (r && ! r->writable)
+    {
+        ctx->exception = MIPSVM_RC_WRITE_ADDRESS_ERROR;
+        return;
+    }
+
+    invalidate_code(ctx, addr);
+    if (r)
+        memcpy(r->mem + (addr - r->base), &data, 4);
+    else
+    {
+        STAT(ctx->stats.callbacks++);
+        if (ctx->hook)
+            ctx->hook->write(ctx->hook, addr, data, 4);
+        else
+            ctx->iface.writew(addr, data);
+    }
+}
+
+static void trap(mipsvm_t *ctx, const mipsvm_decoded_t *d, bool cond)
+{
+    if (cond)
+    {
+        ctx->code = d->imm;
+        ctx->exception = MIPSVM_RC_TRAP;
+    }
+}
+
+static void trap_imm(mipsvm_t *ctx, bool cond)
+{
+    if (cond)
+        ctx->exception = MIPSVM_RC_TRAP;
+}
+
+static void op_reserved(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    (void) d;
+    ctx->exception = MIPSVM_RC_RESERVED_INSTR;
+}
+
+/* special */
+
+static void op_mfhi(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->hi;
+}
+
+static void op_mflo(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->lo;
+}
+
+static void op_mthi(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->hi = ctx->gpr[d->rs];
+}
+
+static void op_mtlo(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->lo = ctx->gpr[d->rs];
+}
+
+static void op_jr(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    schedule_abs_branch(ctx, ctx->gpr[d->rs]);
+    if (ctx->calls && d->rs == 31)
+        call_leave(ctx, ctx->branch_pc);
+}
+
+static void op_div(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->lo = (int32_t) ctx->gpr[d->rs] / (int32_t) ctx->gpr[d->rt];
+    ctx->hi = (int32_t) ctx->gpr[d->rs] % (int32_t) ctx->gpr[d->rt];
+}
+
+static void op_divu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->lo = ctx->gpr[d->rs] / ctx->gpr[d->rt];
+    ctx->hi = ctx->gpr[d->rs] % ctx->gpr[d->rt];
+}
+
+static void op_mult(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->acc = ((int64_t) (int32_t) ctx->gpr[d->rs]) * (int32_t) ctx->gpr[d->rt];
+}
+
+static void op_multu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->acc = (uint64_t) ctx->gpr[d->rs] * ctx->gpr[d->rt];
+}
+
+static void op_movz(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if (ctx->gpr[d->rt] == 0)
+        ctx->gpr[d->rd] = ctx->gpr[d->rs];
+}
+
+static void op_movn(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if (ctx->gpr[d->rt] != 0)
+        ctx->gpr[d->rd] = ctx->gpr[d->rs];
+}
+
+static void op_slt(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = (int32_t)ctx->gpr[d->rs] < (int32_t)ctx->gpr[d->rt];
+}
+
+static void op_sltu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rs] < ctx->gpr[d->rt];
+}
+
+static void op_add(mipsvm_t *ctx, const mipsvm_decoded_t *d)    // w overflow
+{
+    uint32_t tmp = ctx->gpr[d->rs] + ctx->gpr[d->rt];
+    if (((tmp ^ ctx->gpr[d->rs]) & (tmp ^ ctx->gpr[d->rt])) >> 31)
+        ctx->exception = MIPSVM_RC_INTEGER_OVERFLOW;
+    else
+        ctx->gpr[d->rd] = tmp;
+}
+
+static void op_addu(mipsvm_t *ctx, const mipsvm_decoded_t *d)   // wo overflow
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rs] + ctx->gpr[d->rt];
+}
+
+static void op_and(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rs] & ctx->gpr[d->rt];
+}
+
+static void op_nor(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ~(ctx->gpr[d->rs] | ctx->gpr[d->rt]);
+}
+
+static void op_or(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rs] | ctx->gpr[d->rt];
+}
+
+static void op_sllv(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rt] << (ctx->gpr[d->rs] & 0x1F);
+}
+
+static void op_srav(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = (int32_t) ctx->gpr[d->rt] >> (ctx->gpr[d->rs] & 0x1F);
+}
+
+static void op_srlv(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rt] >> (ctx->gpr[d->rs] & 0x1F);
+}
+
+static void op_sub(mipsvm_t *ctx, const mipsvm_decoded_t *d)    // w overflow
+{
+    uint32_t tmp = ctx->gpr[d->rs] - ctx->gpr[d->rt];
+    if (((ctx->gpr[d->rs] ^ ctx->gpr[d->rt]) & (tmp ^ ctx->gpr[d->rs])) >> 31)
+        ctx->exception = MIPSVM_RC_INTEGER_OVERFLOW;
+    else
+        ctx->gpr[d->rd] = tmp;
+}
+
+static void op_subu(mipsvm_t *ctx, const mipsvm_decoded_t *d)   // w/o overflow
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rs] - ctx->gpr[d->rt];
+}
+
+static void op_xor(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rs] ^ ctx->gpr[d->rt];
+}
+
+static void op_sll(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rt] << d->sa;
+}
+
+static void op_srl(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->gpr[d->rt] >> d->sa;
+}
+
+static void op_sra(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = (int32_t) ctx->gpr[d->rt] >> d->sa;
+}
+
+static void op_jalr(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = ctx->pc + 4;
+    schedule_abs_branch(ctx, d->rs ? ctx->gpr[d->rs] : 0);    // XXX: r0 should be always 0
+    if (ctx->calls && d->rd)
+        call_enter(ctx, ctx->pc + 4);
+}
+
+static void op_break(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->code = d->imm;
+    ctx->exception = MIPSVM_RC_BREAK;
+}
+
+static void op_rotr(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = (ctx->gpr[d->rt] >> d->sa) | (ctx->gpr[d->rt] << (32 - d->sa));
+}
+
+static void op_rotrv(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    int s = ctx->gpr[d->rs] & 0x1F;
+    ctx->gpr[d->rd] = (ctx->gpr[d->rt] >> s) | (ctx->gpr[d->rt] << (32 - s));
+}
+
+static void op_syscall(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    uint32_t code = d->imm;
+    ctx->code = code;
+
+    // pc is already past the syscall, so the handler returns to the next instruction just like the host would
+    if (ctx->hook && ctx->hook->syscall)
+    {
+        if (ctx->hook->syscall(ctx->hook, code))
+            return;
+    }
+    else if (code < ctx->syscalls_num && ctx->syscalls[code] && ctx->syscalls[code](ctx, ctx->syscalls_user))
+    {
+        return;
+    }
+    ctx->exception = MIPSVM_RC_SYSCALL;
+}
+
+static void op_teq(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap(ctx, d, ctx->gpr[d->rs] == ctx->gpr[d->rt]);
+}
+
+static void op_tge(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap(ctx, d, (int32_t)ctx->gpr[d->rs] >= (int32_t)ctx->gpr[d->rt]);
+}
+
+static void op_tgeu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap(ctx, d, ctx->gpr[d->rs] >= ctx->gpr[d->rt]);
+}
+
+static void op_tlt(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap(ctx, d, (int32_t)ctx->gpr[d->rs] < (int32_t)ctx->gpr[d->rt]);
+}
+
+static void op_tltu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap(ctx, d, ctx->gpr[d->rs] < ctx->gpr[d->rt]);
+}
+
+static void op_tne(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap(ctx, d, ctx->gpr[d->rs] != ctx->gpr[d->rt]);
+}
+
+/* special2 */
+
+static void op_madd(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->acc += ((int64_t) (int32_t) ctx->gpr[d->rs]) * (int32_t) ctx->gpr[d->rt];
+}
+
+static void op_maddu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->acc += (uint64_t) ctx->gpr[d->rs] * ctx->gpr[d->rt];
+}
+
+static void op_msub(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->acc -= ((int64_t) (int32_t) ctx->gpr[d->rs]) * (int32_t) ctx->gpr[d->rt];
+}
+
+static void op_msubu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->acc -= (uint64_t) ctx->gpr[d->rs] * ctx->gpr[d->rt];
+}
+
+static void op_mul(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = (int32_t)ctx->gpr[d->rs] * (int32_t)ctx->gpr[d->rt];
+}
+
+// NOTE: no reason to call native hardware clz, we are VM and slow anyway
+static void op_clz(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if (! ctx->gpr[d->rs])
+        ctx->gpr[d->rd] = 32;
+    else
+    {
+        int i = 0;
+        for (uint32_t tmp = ctx->gpr[d->rs]; ! (tmp & 0x80000000); tmp <<= 1, i++);
+        ctx->gpr[d->rd] = i;
+    }
+}
+
+static void op_clo(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if (ctx->gpr[d->rs] == 0xFFFFFFFF)
+        ctx->gpr[d->rd] = 32;
+    else
+    {
+        int i = 0;
+        for (uint32_t tmp = ctx->gpr[d->rs]; tmp & 0x80000000; tmp <<= 1, i++);
+        ctx->gpr[d->rd] = i;
+    }
+}
+
+/* special3 */
+
+static void op_seb(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = (int32_t)(int8_t) ctx->gpr[d->rt];
+}
+
+static void op_seh(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rd] = (int32_t)(int16_t) ctx->gpr[d->rt];
+}
+
+static void op_wsbh(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    uint32_t tmp = ctx->gpr[d->rt];
+    tmp = ((tmp & 0x00FF0000) << 8) | ((tmp & 0xFF000000) >> 8 ) | ((tmp & 0x000000FF) << 8) | ((tmp & 0x0000FF00) >> 8);
+    ctx->gpr[d->rd] = tmp;
+}
+
+static void op_ext(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    uint32_t src = ctx->gpr[d->rs];
+    src <<= 32 - d->sa - d->rd - 1;     // remove msbits
+    src >>= 32 - d->rd - 1;             // remove lsbits and right-align
+    ctx->gpr[d->rt] = src;
+}
+
+static void op_ins(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    int lsb = d->sa;
+    int msb = d->rd;
+
+    uint32_t src = ctx->gpr[d->rs];
+    src <<= 32 - (msb - lsb + 1);   // clear src msbits
+    src >>= 32 - (msb + 1);         // align
+
+    uint32_t mask = 0xFFFFFFFF;
+    mask <<= 32 - (msb - lsb + 1);   // clear mask msbits
+    mask >>= 32 - (msb + 1);         // align
+
+    ctx->gpr[d->rt] = (ctx->gpr[d->rt] & ~mask) | src;
+}
+
+/* jtype */
+
+static void op_j(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    schedule_abs_branch(ctx, (ctx->pc & 0xF0000000) | d->imm);
+}
+
+static void op_jal(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[31] = ctx->pc + 4;
+    schedule_abs_branch(ctx, (ctx->pc & 0xF0000000) | d->imm);
+    if (ctx->calls)
+        call_enter(ctx, ctx->pc + 4);
+}
+
+/* regimm */
+
+static void op_bltz(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if ((int32_t)ctx->gpr[d->rs] < 0)
+        schedule_rel_branch(ctx, d->imm);
+}
+
+static void op_bgez(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if ((int32_t)ctx->gpr[d->rs] >= 0)
+        schedule_rel_branch(ctx, d->imm);
+}
+
+static void op_bltzal(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if ((int32_t)ctx->gpr[d->rs] < 0)
+    {
+        ctx->gpr[31] = ctx->pc + 4;
+        schedule_rel_branch(ctx, d->imm);
+        if (ctx->calls)
+            call_enter(ctx, ctx->pc + 4);
+    }
+}
+
+static void op_bgezal(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if ((int32_t)ctx->gpr[d->rs] >= 0)
+    {
+        ctx->gpr[31] = ctx->pc + 4;
+        schedule_rel_branch(ctx, d->imm);
+        if (ctx->calls)
+            call_enter(ctx, ctx->pc + 4);
+    }
+}
+
+static void op_teqi(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap_imm(ctx, ctx->gpr[d->rs] == (uint32_t)d->imm);
+}
+
+static void op_tgei(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap_imm(ctx, (int32_t)ctx->gpr[d->rs] >= d->imm);
+}
+
+static void op_tgeiu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap_imm(ctx, ctx->gpr[d->rs] >= (uint32_t)d->imm);
+}
+
+static void op_tlti(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap_imm(ctx, (int32_t)ctx->gpr[d->rs] < d->imm);
+}
+
+static void op_tltiu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap_imm(ctx, ctx->gpr[d->rs] < (uint32_t)d->imm);
+}
+
+static void op_tnei(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    trap_imm(ctx, ctx->gpr[d->rs] != (uint32_t)d->imm);
+}
+
+/* itype */
+
+static void op_bgtz(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if ((int32_t)ctx->gpr[d->rs] > 0)
+        schedule_rel_branch(ctx, d->imm);
+}
+
+static void op_blez(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if ((int32_t)ctx->gpr[d->rs] <= 0)
+        schedule_rel_branch(ctx, d->imm);
+}
+
+static void op_addi(mipsvm_t *ctx, const mipsvm_decoded_t *d)   // w ovf
+{
+    uint32_t tmp = ctx->gpr[d->rs] + d->imm;
+    if (((tmp ^ ctx->gpr[d->rs]) & (tmp ^ d->imm)) >> 31)
+        ctx->exception = MIPSVM_RC_INTEGER_OVERFLOW;
+    else
+        ctx->gpr[d->rt] = tmp;
+}
+
+static void op_addiu(mipsvm_t *ctx, const mipsvm_decoded_t *d)  // wo ovf
+{
+    ctx->gpr[d->rt] = ctx->gpr[d->rs] + d->imm;
+}
+
+static void op_andi(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = ctx->gpr[d->rs] & d->imm;
+}
+
+static void op_beq(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if (ctx->gpr[d->rs] == ctx->gpr[d->rt])
+        schedule_rel_branch(ctx, d->imm);
+}
+
+static void op_bne(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    if (ctx->gpr[d->rs] != ctx->gpr[d->rt])
+        schedule_rel_branch(ctx, d->imm);
+}
+
+static void op_lb(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = (int32_t)(int8_t)readb(ctx, ctx->gpr[d->rs] + d->imm);
+}
+
+static void op_lbu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = readb(ctx, ctx->gpr[d->rs] + d->imm);
+}
+
+static void op_lh(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = (int32_t)(int16_t)readh(ctx, ctx->gpr[d->rs] + d->imm);
+}
+
+static void op_lhu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = readh(ctx, ctx->gpr[d->rs] + d->imm);
+}
+
+static void op_lui(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = d->imm;
+}
+
+static void op_lw(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = readw(ctx, ctx->gpr[d->rs] + d->imm);
+}
+
+static void op_lwl(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    // little-endian mode
+    uint32_t addr = ctx->gpr[d->rs] + d->imm;
+    uint32_t offset = addr & 0x03;
+    uint32_t word = readw(ctx, addr & -4U);
+    uint32_t reg = ctx->gpr[d->rt];
+
+    reg &= 0x00FFFFFF >> (offset * 8);    // 0x00FFFFFF, 0x0000FFFF, 0x000000FF, 0x00000000
+    word <<= 24 - (offset * 8);           // 24, 16, 8, 0
+    ctx->gpr[d->rt] = reg | word;
+}
+
+static void op_lwr(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    // little-endian mode
+    uint32_t addr = ctx->gpr[d->rs] + d->imm;
+    uint32_t offset = addr & 0x03;
+    uint32_t word = readw(ctx, addr & -4U);
+    uint32_t reg = ctx->gpr[d->rt];
+
+    reg &= ~(0xFFFFFFFF >> (offset * 8));    // ~0xFFFFFFFF, ~0x00FFFFFF, ~0x0000FFFF, ~0x000000FF
+    word >>= offset * 8;           // 0, 8, 16, 24
+    ctx->gpr[d->rt] = reg | word;
+}
+
+static void op_ori(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = ctx->gpr[d->rs] | d->imm;
+}
+
+static void op_sb(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    writeb(ctx, ctx->gpr[d->rs] + d->imm, ctx->gpr[d->rt]);
+}
+
+static void op_slti(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = (int32_t) ctx->gpr[d->rs] < d->imm;
+}
+
+static void op_sltiu(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = ctx->gpr[d->rs] < (uint32_t)d->imm;
+}
+
+static void op_sh(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    writeh(ctx, ctx->gpr[d->rs] + d->imm, ctx->gpr[d->rt]);
+}
+
+static void op_sw(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    writew(ctx, ctx->gpr[d->rs] + d->imm, ctx->gpr[d->rt]);
+}
+
+static void op_swl(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    // little-endian mode
+    uint32_t addr = ctx->gpr[d->rs] + d->imm;
+    uint32_t base = addr & -4U;
+    uint32_t offset = addr & 0x03;
+    uint32_t reg = ctx->gpr[d->rt];
+    if (offset == 0)
+    {
+        writeb(ctx, base, reg >> 24);
+    }
+    else if (offset == 1)
+    {
+        writeh(ctx, base, reg >> 16);
+    }
+    else if (offset == 2)
+    {
+        writeh(ctx, base, reg >> 8);
+        writeb(ctx, base + 2, reg >> 24);
+    }
+    else
+    {
+        writew(ctx, base, reg);
+    }
+}
+
+static void op_swr(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    // little-endian mode
+    uint32_t addr = ctx->gpr[d->rs] + d->imm;
+    uint32_t base = addr & -4U;
+    uint32_t offset = addr & 0x03;
+    uint32_t reg = ctx->gpr[d->rt];
+    if (offset == 0)
+    {
+        writew(ctx, base, reg); // hgfe
+    }
+    else if (offset == 1)
+    {
+        writeb(ctx, base + 1, reg); // h
+        writeh(ctx, base + 2, reg >> 8); // gf
+    }
+    else if (offset == 2)
+    {
+        writeh(ctx, base + 2, reg); // hg
+    }
+    else
+    {
+        writeb(ctx, base + 3, reg); // h
+    }
+}
+
+static void op_xori(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    ctx->gpr[d->rt] = ctx->gpr[d->rs] ^ d->imm;
+}
+
+#define OP_HANDLER(name) op_##name,
+const mipsvm_handler_t mipsvm_handlers[OPS_NUM] = { OPS(OP_HANDLER) };
+
+static int decode_special(uint32_t instr)
+{
+    const int func = instr & 0x3F;
+    const int rs = (instr >> 21) & 0x1F;
+    const int rt = (instr >> 16) & 0x1F;
+    const int rd = (instr >> 11) & 0x1F;
+    const int aux = (instr >> 6) & 0x1F;
+
+    if (rs == 0 && rt == 0 && aux == 0) // rs, rt, aux unused
+    {
+        switch (func)
+        {
+        case 0x10: return OP_mfhi;
+        case 0x12: return OP_mflo;
+        }
+    }
+
+    if (rt == 0 && rd == 0 && aux == 0)  // aux, rd, rt unused
+    {
+        switch (func)
+        {
+        case 0x11: return OP_mthi;
+        case 0x13: return OP_mtlo;
+        }
+    }
+
+    if (rt == 0 && rd == 0) // rt, rd are unused
+    {
+        switch (func)
+        {
+        case 0x08: return OP_jr;
+        }
+    }
+
+    if (rd == 0 && aux == 0)    // rd, aux unused
+    {
+        switch (func)
+        {
+        case 0x1A: return OP_div;
+        case 0x1B: return OP_divu;
+        case 0x18: return OP_mult;
+        case 0x19: return OP_multu;
+        }
+    }
+
+    if (aux == 0)  // aux unused
+    {
+        switch (func)
+        {
+        case 0x0A: return OP_movz;
+        case 0x0B: return OP_movn;
+        case 0x2A: return OP_slt;
+        case 0x2B: return OP_sltu;
+        case 0x20: return OP_add;
+        case 0x21: return OP_addu;
+        case 0x24: return OP_and;
+        case 0x27: return OP_nor;
+        case 0x25: return OP_or;
+        case 0x04: return OP_sllv;
+        case 0x07: return OP_srav;
+        case 0x06: return OP_srlv;
+        case 0x22: return OP_sub;
+        case 0x23: return OP_subu;
+        case 0x26: return OP_xor;
+        }
+    }
+
+    if (rs == 0)    // rs unused
+    {
+        switch (func)
+        {
+        case 0x00: return OP_sll;
+        case 0x02: return OP_srl;
+        case 0x03: return OP_sra;
+        }
+    }
+
+    if (rt == 0)    // rt unused
+    {
+        switch (func)
+        {
+        case 0x09: return OP_jalr;
+        }
+    }
+
+    switch (func)
+    {
+    case 0x0D: return OP_break;
+
+    case 0x02:
+        if (rs == 1)   // rotr
+            return OP_rotr;
+        break;
+
+    case 0x06:
+        if (aux == 1)  // rotrv
+            return OP_rotrv;
+        break;
+
+    case 0x0C: return OP_syscall;
+    case 0x34: return OP_teq;
+    case 0x30: return OP_tge;
+    case 0x31: return OP_tgeu;
+    case 0x32: return OP_tlt;
+    case 0x33: return OP_tltu;
+    case 0x36: return OP_tne;
+    }
+
+    return OP_reserved;
+}
+
+static int decode_special2(uint32_t instr)
+{
+    const int func = instr & 0x3F;
+    const int rd = (instr >> 11) & 0x1F;
+    const int aux = (instr >> 6) & 0x1F;
+
+    if (rd == 0 && aux == 0)
+    {
+        switch (func)
+        {
+        case 0x00: return OP_madd;
+        case 0x01: return OP_maddu;
+        case 0x04: return OP_msub;
+        case 0x05: return OP_msubu;
+        }
+    }
+
+    if (aux == 0)
+    {
+        switch (func)
+        {
+        case 0x02: return OP_mul;
+        case 0x20: return OP_clz;
+        case 0x21: return OP_clo;
+        }
+    }
+
+    return OP_reserved;
+}
+
+static int decode_special3(uint32_t instr)
+{
+    const int rs = (instr >> 21) & 0x1F;
+    const int aux = (instr >> 6) & 0x1F;
+    const int func = instr & 0x3F;
+
+    if (rs == 0 && (func == 0x20))    // bshfl ? wtf name
+    {
+        switch (aux)
+        {
+        case 0x10: return OP_seb;
+        case 0x18: return OP_seh;
+        case 0x02: return OP_wsbh;
+        }
+    }
+
+    if (func == 0x00)
+        return OP_ext;
+
+    if (func == 0x04)
+        return OP_ins;
+
+    return OP_reserved;
+}
+
+static int decode_jtype(uint32_t instr)
+{
+    switch (instr >> 26)
+    {
+    case 0x02: return OP_j;
+    case 0x03: return OP_jal;
+    }
+    return OP_reserved;
+}
+
+static int decode_itype(uint32_t instr)
+{
+    const int opcode = instr >> 26;
+    const int rs = (instr >> 21) & 0x1F;
+    const int rt = (instr >> 16) & 0x1F;
+
+    if (opcode == 1)    // regimm
+    {
+        switch (rt)
+        {
+        case 0x00: return OP_bltz;
+        case 0x01: return OP_bgez;
+        case 0x10: return OP_bltzal;
+        case 0x11: return OP_bgezal;
+        case 0x0C: return OP_teqi;
+        case 0x08: return OP_tgei;
+        case 0x09: return OP_tgeiu;
+        case 0x0A: return OP_tlti;
+        case 0x0B: return OP_tltiu;
+        case 0x0E: return OP_tnei;
+        }
+    }
+
+    if (rt == 0)
+    {
+        switch (opcode)
+        {
+        case 0x07: return OP_bgtz;
+        case 0x06: return OP_blez;
+        }
+    }
+
+    switch (opcode)
+    {
+    case 0x08: return OP_addi;
+    case 0x09: return OP_addiu;
+    case 0x0C: return OP_andi;
+    case 0x04: return OP_beq;
+    case 0x05: return OP_bne;
+    case 0x20: return OP_lb;
+    case 0x24: return OP_lbu;
+    case 0x21: return OP_lh;
+    case 0x25: return OP_lhu;
+
+    case 0x0F:
+        if (rs == 0)    // lui
+            return OP_lui;
+        break;
+
+    case 0x23: return OP_lw;
+    case 0x22: return OP_lwl;
+    case 0x26: return OP_lwr;
+    case 0x0D: return OP_ori;
+    case 0x28: return OP_sb;
+    case 0x0A: return OP_slti;
+    case 0x0B: return OP_sltiu;
+    case 0x29: return OP_sh;
+    case 0x2B: return OP_sw;
+    case 0x2A: return OP_swl;
+    case 0x2E: return OP_swr;
+    case 0x0E: return OP_xori;
+
+    case 0x30:  // ll
+        break;
+
+    case 0x38:  // sc
+        break;
+    }
+
+    return OP_reserved;
+}
+
+void mipsvm_decode(uint32_t instr, mipsvm_decoded_t *d)
+{
+    uint32_t opcode = instr >> 26;  // 6 top bits is the opcode
+    int op = OP_reserved;
+
+    if (opcode == 0x00)
+        op = decode_special(instr);
+    else if (opcode == 0x1C)
+        op = decode_special2(instr);
+    else if (opcode == 0x1F)
+        op = decode_special3(instr);
+    else if ((opcode & 0x3E) == 0x02)
+        op = decode_jtype(instr);
+    else if ((opcode & 0x3C) != 0x10)
+        op = decode_itype(instr);
+
+    d->op = op;
+    d->rs = (instr >> 21) & 0x1F;
+    d->rt = (instr >> 16) & 0x1F;
+    d->rd = (instr >> 11) & 0x1F;
+    d->sa = (instr >> 6) & 0x1F;
+
+    // immediate is stored in the form consumed by the handler
+    switch (op)
+    {
+    case OP_andi:
+    case OP_ori:
+    case OP_xori:
+        d->imm = instr & 0xFFFF;    // zero-extended
+        break;
+
+    case OP_lui:
+        d->imm = (instr & 0xFFFF) << 16;
+        break;
+
+    case OP_bltz: case OP_bgez: case OP_bltzal: case OP_bgezal:
+    case OP_bgtz: case OP_blez: case OP_beq: case OP_bne:
+        d->imm = (int16_t)(instr & 0xFFFF) << 2;    // branch offset
+        break;
+
+    case OP_j:
+    case OP_jal:
+        d->imm = (instr << 8) >> 6;     // target within the current 256MB region
+        break;
+
+    case OP_break:
+    case OP_syscall:
+        d->imm = (instr << 6) >> 12;    // code
+        break;
+
+    case OP_teq: case OP_tge: case OP_tgeu: case OP_tlt: case OP_tltu: case OP_tne:
+        d->imm = (instr >> 6) & 0x3FF;  // code
+        break;
+
+    default:
+        d->imm = (int16_t)(instr & 0xFFFF); // sign-extended
+        break;
+    }
+}
+
+bool mipsvm_is_branch(int op)
+{
+    switch (op)
+    {
+    case OP_jr: case OP_jalr: case OP_j: case OP_jal:
+    case OP_bltz: case OP_bgez: case OP_bltzal: case OP_bgezal:
+    case OP_bgtz: case OP_blez: case OP_beq: case OP_bne:
         return 1;
+    }
+    return 0;
+}
+
+#ifdef MIPSVM_STATS
+// counts the instruction just executed by the handler, unless it raised the exception
+static void count_op(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    mipsvm_stats_t *s = &ctx->stats;
+
+    if (ctx->exception)
+    {
+        s->after_branch = 0;
+        return;
+    }
+
+    s->ops[d->op]++;
+    if (s->after_branch)
+        s->delay_slots++;
+
+    s->after_branch = mipsvm_is_branch(d->op);
+    if (s->after_branch)
+    {
+        if (ctx->branch_is_pending)
+            s->taken++;
+        else
+            s->not_taken++;
+    }
+}
+
+#define COUNT_OP(ctx, d) count_op(ctx, d)
+#else
+#define COUNT_OP(ctx, d) ((void) 0)
+#endif
+
+// Fuel. Block engine charges the whole block on entry (its cost is summed once translated), so the hot loop pays per
+// block. Interpreter engines run as many instructions as the fuel is enough for and charge them at once, unless the
+// weights differ and every instruction is charged. Script stops once the fuel is spent, the instruction costing more
+// than the rest of the fuel is executed and takes the rest. MIPSVM_FUEL_UNLIMITED is never charged, so it stays
+// unlimited.
+
+// instruction class per handler, the rest are MIPSVM_FUEL_ALU
+static const uint8_t fuel_classes[OPS_NUM] =
+{
+    [OP_mult] = MIPSVM_FUEL_MUL, [OP_multu] = MIPSVM_FUEL_MUL, [OP_madd] = MIPSVM_FUEL_MUL,
+    [OP_maddu] = MIPSVM_FUEL_MUL, [OP_msub] = MIPSVM_FUEL_MUL, [OP_msubu] = MIPSVM_FUEL_MUL, [OP_mul] = MIPSVM_FUEL_MUL,
+    [OP_div] = MIPSVM_FUEL_DIV, [OP_divu] = MIPSVM_FUEL_DIV,
+    [OP_lb] = MIPSVM_FUEL_LOAD, [OP_lbu] = MIPSVM_FUEL_LOAD, [OP_lh] = MIPSVM_FUEL_LOAD, [OP_lhu] = MIPSVM_FUEL_LOAD,
+    [OP_lw] = MIPSVM_FUEL_LOAD, [OP_lwl] = MIPSVM_FUEL_LOAD, [OP_lwr] = MIPSVM_FUEL_LOAD,
+    [OP_sb] = MIPSVM_FUEL_STORE, [OP_sh] = MIPSVM_FUEL_STORE, [OP_sw] = MIPSVM_FUEL_STORE, [OP_swl] = MIPSVM_FUEL_STORE,
+    [OP_swr] = MIPSVM_FUEL_STORE,
+    [OP_jr] = MIPSVM_FUEL_BRANCH, [OP_jalr] = MIPSVM_FUEL_BRANCH, [OP_j] = MIPSVM_FUEL_BRANCH,
+    [OP_jal] = MIPSVM_FUEL_BRANCH, [OP_bltz] = MIPSVM_FUEL_BRANCH, [OP_bgez] = MIPSVM_FUEL_BRANCH,
+    [OP_bltzal] = MIPSVM_FUEL_BRANCH, [OP_bgezal] = MIPSVM_FUEL_BRANCH, [OP_bgtz] = MIPSVM_FUEL_BRANCH,
+    [OP_blez] = MIPSVM_FUEL_BRANCH, [OP_beq] = MIPSVM_FUEL_BRANCH, [OP_bne] = MIPSVM_FUEL_BRANCH,
+    [OP_syscall] = MIPSVM_FUEL_SYSTEM, [OP_break] = MIPSVM_FUEL_SYSTEM, [OP_teq] = MIPSVM_FUEL_SYSTEM,
+    [OP_tge] = MIPSVM_FUEL_SYSTEM, [OP_tgeu] = MIPSVM_FUEL_SYSTEM, [OP_tlt] = MIPSVM_FUEL_SYSTEM,
+    [OP_tltu] = MIPSVM_FUEL_SYSTEM, [OP_tne] = MIPSVM_FUEL_SYSTEM, [OP_teqi] = MIPSVM_FUEL_SYSTEM,
+    [OP_tgei] = MIPSVM_FUEL_SYSTEM, [OP_tgeiu] = MIPSVM_FUEL_SYSTEM, [OP_tlti] = MIPSVM_FUEL_SYSTEM,
+    [OP_tltiu] = MIPSVM_FUEL_SYSTEM, [OP_tnei] = MIPSVM_FUEL_SYSTEM,
+};
+
+// for mips2c, recompiled blocks are charged by the same classes
+uint8_t mipsvm_fuel_class(int op)
+{
+    return fuel_classes[op];
+}
+
+static inline uint32_t op_cost(const mipsvm_t *ctx, int op)
+{
+    return ctx->fuel_weights[fuel_classes[op]];
+}
+
+static inline bool metered(const mipsvm_t *ctx)
+{
+    return ctx->fuel != MIPSVM_FUEL_UNLIMITED;
+}
+
+static inline void charge(mipsvm_t *ctx, uint64_t cost)
+{
+    if (metered(ctx))
+        ctx->fuel -= cost < ctx->fuel ? cost : ctx->fuel;
+}
+
+// script is stopped at the instruction boundary, so it resumes once the fuel is added
+static inline bool out_of_fuel(mipsvm_t *ctx)
+{
+    if (ctx->fuel)
+        return 0;
+    ctx->exception = MIPSVM_RC_OUT_OF_FUEL;
+    return 1;
+}
+
+// charges the retired instruction, false once the fuel is spent
+static inline bool spend(mipsvm_t *ctx, const mipsvm_decoded_t *d)
+{
+    charge(ctx, op_cost(ctx, d->op));
+    return ! out_of_fuel(ctx);
+}
+
+static NOINLINE uint8_t *icache_fill(mipsvm_t *ctx, mipsvm_icache_t *ic, uint32_t pc)
+{
+    uint32_t size = 1U << ic->line_bits;
+    uint32_t line = pc >> ic->line_bits << ic->line_bits;
+    uint32_t set = (pc >> ic->line_bits) & ic->sets_mask;
+    uint32_t way = ic->victim++ % ic->ways;
+    uint32_t idx = set * ic->ways + way;
+    uint8_t *data = ic->data + (idx << ic->line_bits);
+
+    ic->stats.misses++;
+
+    if (ctx->iface.readline && ! ctx->hook)
+    {
+        STAT(ctx->stats.callbacks++);
+        ctx->iface.readline(line, data, size);
+    }
+    else
+    {
+        for (uint32_t i = 0; i < size; i += 4)
+        {
+            STAT(ctx->stats.callbacks++);
+            uint32_t w = ctx->hook ? ctx->hook->read(ctx->hook, line + i, 4) : ctx->iface.readw(line + i);
+            memcpy(data + i, &w, 4);
+        }
+    }
+
+    ic->tags[idx] = line;
+    return data;
+}
+
+// reads the instruction word, via the fetch cache if any
+static inline uint32_t fetch_word(mipsvm_t *ctx, uint32_t pc)
+{
+    mipsvm_icache_t *ic = ctx->icache;
+
+    if (! ic || pc % 4 || ctx->flat)
+        return readw(ctx, pc);
+
+    // lines are filled via the callbacks, code in the host memory is read in place
+    if (ctx->tlb)
+    {
+        const mipsvm_tlb_entry_t *e = tlb_lookup(ctx, pc);
+        if (e->mem)
+        {
+            uint32_t instr;
+            memcpy(&instr, e->mem + pc % MIPSVM_PAGE_SIZE, 4);
+            return instr;
+        }
+    }
+
+    const mipsvm_region_t *r = find_region(ctx, pc);
+    if (r)
+    {
+        uint32_t instr;
+        memcpy(&instr, r->mem + (pc - r->base), 4);
+        return instr;
+    }
+
+    uint8_t *data;
+    uint32_t *tag = icache_find(ic, pc);
+    if (tag)
+    {
+        ic->stats.hits++;
+        data = ic->data + ((uint32_t) (tag - ic->tags) << ic->line_bits);
+    }
+    else
+    {
+        data = icache_fill(ctx, ic, pc);
+    }
+
+    uint32_t instr;
+    memcpy(&instr, data + (pc & ((1U << ic->line_bits) - 1)), 4);
+    return instr;
+}
+
+// decodes the instruction at pc, filling the decode cache entry if any
+static NOINLINE const mipsvm_decoded_t *fetch_slow(mipsvm_t *ctx, uint32_t pc, mipsvm_decoded_t *tmp)
+{
+    mipsvm_decoded_t *d = tmp;
+
+    if (ctx->dcache)
+        d = &ctx->dcache[(pc >> 2) & ctx->dcache_mask];
+
+    uint32_t instr = fetch_word(ctx, pc);
+    if (ctx->exception)     // failed fetch is never cached
+        d = tmp;
+
+    mipsvm_decode(instr, d);
+    d->pc = pc;
+    return d;
+}
+
+// returns the decoded instruction at pc, from the decode cache if possible
+static inline const mipsvm_decoded_t *fetch(mipsvm_t *ctx, uint32_t pc, mipsvm_decoded_t *tmp)
+{
+    if (ctx->dcache)
+    {
+        const mipsvm_decoded_t *d = &ctx->dcache[(pc >> 2) & ctx->dcache_mask];
+        if (d->pc == pc && d->pc != MIPSVM_DECODED_FREE)
+            return d;
+    }
+
+    return fetch_slow(ctx, pc, tmp);
+}
+
+// fetches the instruction at *pc and moves *pc to the next one, taking the pending branch if any
+static inline const mipsvm_decoded_t *next_instr(mipsvm_t *ctx, uint32_t *pc, mipsvm_decoded_t *tmp)
+{
+    const mipsvm_decoded_t *d = fetch(ctx, *pc, tmp);
+
+    if (! ctx->branch_is_pending)
+    {
+        *pc += 4;
+    }
+    else
+    {
+        ctx->branch_is_pending = 0;
+        *pc = ctx->branch_pc;
+    }
+
+    return d;
+}
+
+// Interpreter keeps pc in the local and stores it to ctx only for the handlers that read it: branches and links, and
+// the syscall, whose host handler may also move it. Branch in the delay slot sees the pending target as pc, so the
+// handlers can't use d->pc instead.
+static inline bool reads_pc(int op)
+{
+    return op == OP_syscall || (mipsvm_is_branch(op) && op != OP_jr);
+}
+
+mipsvm_rc_t mipsvm_exec(mipsvm_t *ctx)
+{
+    mipsvm_decoded_t tmp;
+
+    sandbox_release(ctx);
+    mipsvm_sandbox_enter(ctx);
+
+    // initial state before each instruction
+    ctx->gpr[0] = 0;    // r0 always == 0
+    ctx->exception = 0; // clean previous exception if any
+
+    if (! out_of_fuel(ctx))
+    {
+        const mipsvm_decoded_t *d = next_instr(ctx, &ctx->pc, &tmp);
+        mipsvm_handlers[d->op](ctx, d);
+        COUNT_OP(ctx, d);
+        if (! ctx->exception)
+            charge(ctx, op_cost(ctx, d->op));
+    }
+
+    mipsvm_sandbox_leave(ctx);
+    sandbox_release(ctx);
+    STAT(ctx->stats.rc[ctx->exception]++);
+    return ctx->exception;
+}
+
+#ifdef MIPSVM_THREADED
+
+// Threaded engine. Handlers are inlined into the single function, each one dispatches the next instruction by itself.
+// With GCC/Clang dispatch is the computed goto via the table of labels indexed by the handler index.
+// Other compilers get the portable switch.
+
+#ifdef __GNUC__
+#define OP_LABEL(name) &&L_##name,
+#define OP_CASE(name) L_##name:
+#define DISPATCH() goto *labels[d->op]
+#else
+#define OP_CASE(name) case OP_##name:
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() \
+    do \
+    { \
+        ctx->gpr[0] = 0; \
+        if (ctx->exception) \
+            goto done; \
+        n++; \
+        if ((weighted && ! spend(ctx, d)) || n == max_instr) \
+            goto done; \
+        d = next_instr(ctx, &pc, &tmp); \
+        DISPATCH(); \
+    } while (0)
+
+#define OP_BODY(name) \
+    OP_CASE(name) \
+    if (reads_pc(OP_##name)) \
+        ctx->pc = pc; \
+    op_##name(ctx, d); \
+    if (reads_pc(OP_##name)) \
+        pc = ctx->pc; \
+    COUNT_OP(ctx, d); \
+    NEXT();
+
+static uint32_t run_instrs(mipsvm_t *ctx, uint32_t max_instr, bool weighted)
+{
+#ifdef __GNUC__
+    static const void * const labels[OPS_NUM] = { OPS(OP_LABEL) };
+#endif
+    mipsvm_decoded_t tmp;
+    const mipsvm_decoded_t *d;
+    uint32_t pc = ctx->pc;
+    uint32_t n = 0;
+
+    if (! max_instr)
+        goto done;
+
+    ctx->gpr[0] = 0;    // r0 always == 0
+    d = next_instr(ctx, &pc, &tmp);
+    DISPATCH();
+
+#ifdef __GNUC__
+    OPS(OP_BODY)
+#else
+dispatch:
+    switch (d->op)
+    {
+    OPS(OP_BODY)
+    }
+#endif
+
+done:
+    ctx->pc = pc;
+    return n;
+}
+
+#else
+
+static uint32_t run_instrs(mipsvm_t *ctx, uint32_t max_instr, bool weighted)
+{
+    mipsvm_decoded_t tmp;
+    uint32_t pc = ctx->pc;
+    uint32_t n = 0;
+
+    while (n < max_instr)
+    {
+        ctx->gpr[0] = 0;    // r0 always == 0
+        const mipsvm_decoded_t *d = next_instr(ctx, &pc, &tmp);
+        if (reads_pc(d->op))
+        {
+            ctx->pc = pc;
+            mipsvm_handlers[d->op](ctx, d);
+            pc = ctx->pc;
+        }
+        else
+        {
+            mipsvm_handlers[d->op](ctx, d);
+        }
+        COUNT_OP(ctx, d);
+        if (ctx->exception)
+            break;
+        n++;
+        if (weighted && ! spend(ctx, d))
+            break;
+    }
+
+    ctx->pc = pc;
+    return n;
+}
+
+#endif
+
+// interpreter engine, equal weights are charged once for all the instructions run
+static uint32_t run_metered(mipsvm_t *ctx, uint32_t max_instr)
+{
+    uint32_t weight = ctx->fuel_weight;
+
+    if (out_of_fuel(ctx))
+        return 0;
+    if (! metered(ctx))
+        return run_instrs(ctx, max_instr, 0);
+    if (! weight)
+        return run_instrs(ctx, max_instr, 1);
+
+    uint64_t limit = ctx->fuel / weight + (ctx->fuel % weight != 0);
+    uint32_t n = run_instrs(ctx, limit < max_instr ? limit : max_instr, 0);
+
+    charge(ctx, (uint64_t) n * weight);
+    if (! ctx->exception)
+        out_of_fuel(ctx);
+    return n;
+}
+
+// Block engine. Block is the straight-line run of the decoded instructions, ending with the branch and its delay slot.
+// Branch and delay slot are executed as a pair, the pending branch is never visible outside of the block.
+// Blocks are linked to their successors, so the hot loop runs from block to block without the cache lookups.
+
+// instructions always raising the exception end the block. Syscall does not, the VM may handle it
+static bool is_block_end(int op)
+{
+    return op == OP_reserved || op == OP_break;
+}
+
+static bool decode_at(mipsvm_t *ctx, uint32_t pc, mipsvm_decoded_t *d)
+{
+    uint32_t instr = fetch_word(ctx, pc);
+    if (ctx->exception)
+    {
+        ctx->exception = 0;
+        sandbox_release(ctx);   // faulted page must fault again when actually executed
+        return 0;
+    }
+
+    mipsvm_decode(instr, d);
+    d->pc = pc;
+    return 1;
+}
+
+// recompiled block starting at pc, if any
+static const mipsvm_native_t *find_native(const mipsvm_t *ctx, uint32_t pc)
+{
+    uint32_t lo = 0;
+    uint32_t hi = ctx->natives_num;
+
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (ctx->natives[mid].pc < pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (lo < ctx->natives_num && ctx->natives[lo].pc == pc) ? &ctx->natives[lo] : 0;
+}
+
+// extends the code range covered by blocks
+static void cover_code(mipsvm_t *ctx, uint32_t pc, uint32_t end)
+{
+    if (ctx->code_lo == ctx->code_hi)   // first block
+    {
+        ctx->code_lo = pc;
+        ctx->code_hi = end;
+    }
+    else
+    {
+        if (pc < ctx->code_lo)
+            ctx->code_lo = pc;
+        if (end > ctx->code_hi)
+            ctx->code_hi = end;
+    }
+}
+
+static uint16_t block_cost(const mipsvm_t *ctx, const mipsvm_block_t *b)
+{
+    uint32_t cost = 0;
+
+    for (uint32_t i = 0; i < b->len; i++)
+        cost += op_cost(ctx, b->ops[i].op);
+    return cost;
+}
+
+// block is charged on entry, instructions it did not retire (exception, code modified) are given back
+static void refund(mipsvm_t *ctx, const mipsvm_block_t *b, uint32_t retired)
+{
+    for (uint32_t i = retired; i < b->len; i++)
+        ctx->fuel += op_cost(ctx, b->ops[i].op);
+}
+
+// recompiled block is longer than the interpreter one, it is charged by its own instructions from the first one given
+static uint32_t native_cost(const mipsvm_t *ctx, const mipsvm_native_t *aot, uint32_t from)
+{
+    uint32_t cost = 0;
+
+    for (uint32_t i = from; i < aot->len; i++)
+        cost += ctx->fuel_weights[aot->classes[i]];
+    return cost;
+}
+
+static void find_aot(mipsvm_t *ctx, mipsvm_block_t *b)
+{
+    b->aot = find_native(ctx, b->pc);
+    b->aot_cost = b->aot ? native_cost(ctx, b->aot, 0) : 0;
+}
+
+static NOINLINE mipsvm_block_t *translate(mipsvm_t *ctx, uint32_t pc)
+{
+    mipsvm_block_t *b = &ctx->blocks[(pc >> 2) & ctx->blocks_mask];
+    uint32_t len = 0;
+
+    b->pc = MIPSVM_DECODED_FREE;
+    b->has_branch = 0;
+    b->link[0] = 0;
+    b->link[1] = 0;
+    b->native = 0;
+    b->hits = 0;
 
-    case 0x0C:  // andi
-        ctx->gpr[rt] = ctx->gpr[rs] & imm_ze;
-        return 1;
+    while (len < MIPSVM_BLOCK_LEN)
+    {
+        mipsvm_decoded_t *d = &b->ops[len];
+        if (! decode_at(ctx, pc + len * 4, d))
+            break;
 
-    case 0x04:  // beq
-        if (ctx->gpr[rs] == ctx->gpr[rt])
-            schedule_rel_branch(ctx, imm_se << 2);
-        return 1;
+        if (mipsvm_is_branch(d->op))
+        {
+            // branch is folded with its delay slot. Branch in the delay slot is left for the single-step path
+            if (len + 2 > MIPSVM_BLOCK_LEN || ! decode_at(ctx, pc + len * 4 + 4, d + 1) || mipsvm_is_branch(d[1].op))
+                break;
+            len += 2;
+            b->has_branch = 1;
+            break;
+        }
 
-    case 0x05:  // bne
-        if (ctx->gpr[rs] != ctx->gpr[rt])
-            schedule_rel_branch(ctx, imm_se << 2);
-        return 1;
+        len++;
+        if (is_block_end(d->op))
+            break;
+    }
 
-    case 0x20:  // lb
-        ctx->gpr[rt] = (int32_t)(int8_t)readb(ctx, ctx->gpr[rs] + imm_se);
-        return 1;
+    if (! len)
+        return 0;
 
-    case 0x24:  // lbu
-        ctx->gpr[rt] = readb(ctx, ctx->gpr[rs] + imm_se);
-        return 1;
+    b->pc = pc;
+    b->len = len;
+    b->cost = block_cost(ctx, b);
+    find_aot(ctx, b);
 
-    case 0x21:  // lh
-        ctx->gpr[rt] = (int32_t)(int16_t)readh(ctx, ctx->gpr[rs] + imm_se);
-        return 1;
+    cover_code(ctx, pc, pc + len * 4);
+    return b;
+}
 
-    case 0x25:  // lhu
-        ctx->gpr[rt] = readh(ctx, ctx->gpr[rs] + imm_se);
-        return 1;
+static inline void exec_single(mipsvm_t *ctx)
+{
+    mipsvm_decoded_t tmp;
 
-    case 0x0F:
-        if (rs == 0)    // lui
-        {
-            ctx->gpr[rt] = imm_ze << 16;
-            return 1;
-        }
-        break;
+    ctx->gpr[0] = 0;    // r0 always == 0
+    const mipsvm_decoded_t *d = next_instr(ctx, &ctx->pc, &tmp);
+    mipsvm_handlers[d->op](ctx, d);
+    COUNT_OP(ctx, d);
+    if (! ctx->exception)
+        charge(ctx, op_cost(ctx, d->op));
+}
 
-    case 0x23:  // lw
-        ctx->gpr[rt] = readw(ctx, ctx->gpr[rs] + imm_se);
-        return 1;
+static uint32_t run_blocks(mipsvm_t *ctx, uint32_t max_instr)
+{
+    mipsvm_block_t *prev = 0;
+    uint32_t n = 0;
+
+    while (n < max_instr && ! out_of_fuel(ctx))
+    {
+        uint32_t pc = ctx->pc;
+        mipsvm_block_t *b = 0;
 
-    case 0x22:  // lwl
+        if (ctx->branch_is_pending || pc % 4)   // pending branch left by the single-step path or misaligned fetch
         {
-            // little-endian mode
-            uint32_t addr = ctx->gpr[rs] + imm_se;
-            uint32_t offset = addr & 0x03;
-            uint32_t word = readw(ctx, addr & -4U);
-            uint32_t reg = ctx->gpr[rt];
+            exec_single(ctx);
+            if (ctx->exception)
+                break;
+            n++;
+            prev = 0;
+            continue;
+        }
 
-            reg &= 0x00FFFFFF >> (offset * 8);    // 0x00FFFFFF, 0x0000FFFF, 0x000000FF, 0x00000000
-            word <<= 24 - (offset * 8);           // 24, 16, 8, 0
-            ctx->gpr[rt] = reg | word;
+        if (prev)
+        {
+            b = prev->link[pc != prev->pc + prev->len * 4];
+            if (b && b->pc == pc)
+                ctx->bstats.chained++;
+            else
+                b = 0;
         }
-        return 1;
 
-    case 0x26:  // lwr
+        if (! b)
         {
-            // little-endian mode
-            uint32_t addr = ctx->gpr[rs] + imm_se;
-            uint32_t offset = addr & 0x03;
-            uint32_t word = readw(ctx, addr & -4U);
-            uint32_t reg = ctx->gpr[rt];
+            b = &ctx->blocks[(pc >> 2) & ctx->blocks_mask];
+            if (b->pc == pc)
+            {
+                ctx->bstats.hits++;
+            }
+            else
+            {
+                ctx->bstats.misses++;
+                b = translate(ctx, pc);
+            }
 
-            reg &= ~(0xFFFFFFFF >> (offset * 8));    // ~0xFFFFFFFF, ~0x00FFFFFF, ~0x0000FFFF, ~0x000000FF
-            word >>= offset * 8;           // 0, 8, 16, 24
-            ctx->gpr[rt] = reg | word;
+            if (prev && b)
+                prev->link[pc != prev->pc + prev->len * 4] = b;
         }
-        return 1;
 
-    case 0x0D:  //ori
-        ctx->gpr[rt] = ctx->gpr[rs] | imm_ze;
-        return 1;
+        if (b && b->cost > ctx->fuel)   // rest of the fuel is spent instruction by instruction
+            b = 0;
 
-    case 0x28:  // sb
-        writeb(ctx, ctx->gpr[rs] + imm_se, ctx->gpr[rt]);
-        return 1;
+#ifndef MIPSVM_STATS    // instrumented build counts every instruction, recompiled and compiled blocks are not entered
+        // recompiled ahead of time, interpreted while the call stack is tracked (natives do not report calls)
+        if (b && b->aot && ! ctx->calls && b->aot->len <= max_instr - n && b->aot_cost <= ctx->fuel)
+        {
+            bool charged = metered(ctx);
+            if (charged)
+                ctx->fuel -= b->aot_cost;
+            ctx->gpr[0] = 0;
+            uint32_t retired = b->aot->fn(ctx);
+            n += retired;
+            if (charged && retired < b->aot->len)
+                ctx->fuel += native_cost(ctx, b->aot, retired);
+            if (ctx->exception)
+                break;
+            prev = b;
+            continue;
+        }
+#endif
 
-    case 0x0A:  // slti
-        ctx->gpr[rt] = (int32_t) ctx->gpr[rs] < imm_se;
-        return 1;
+        if (! b || b->len > max_instr - n)
+        {
+            exec_single(ctx);
+            if (ctx->exception)
+                break;
+            n++;
+            prev = 0;
+            continue;
+        }
 
-    case 0x0B:  // sltiu
-        ctx->gpr[rt] = ctx->gpr[rs] < (uint32_t)imm_se;
-        return 1;
+        b->hits++;
+        bool charged = metered(ctx);
+        if (charged)
+            ctx->fuel -= b->cost;
 
-    case 0x29:  // sh
-        writeh(ctx, ctx->gpr[rs] + imm_se, ctx->gpr[rt]);
-        return 1;
+#if defined(MIPSVM_JIT) && ! defined(MIPSVM_STATS)
+        if (ctx->jit && b->hits == MIPSVM_JIT_HOT)
+            mipsvm_jit_compile(ctx, b);
+#endif
 
-    case 0x2B:  // sw
-        writew(ctx, ctx->gpr[rs] + imm_se, ctx->gpr[rt]);
-        return 1;
+        const mipsvm_decoded_t *d = b->ops;
+        const mipsvm_decoded_t *body_end = d + b->len - (b->has_branch ? 2 : 0);
 
-    case 0x2A:  // swl
+        if (b->native)
         {
-            // little-endian mode
-            uint32_t addr = ctx->gpr[rs] + imm_se;
-            uint32_t base = addr & -4U;
-            uint32_t offset = addr & 0x03;
-            uint32_t reg = ctx->gpr[rt];
-            if (offset == 0)
-            {
-                writeb(ctx, base, reg >> 24);
-            }
-            else if (offset == 1)
-            {
-                writeh(ctx, base, reg >> 16);
-            }
-            else if (offset == 2)
-            {
-                writeh(ctx, base, reg >> 8);
-                writeb(ctx, base + 2, reg >> 24);
-            }
-            else
+            d += b->native(ctx);
+        }
+        else
+        {
+            for (; d < body_end; d++)
             {
-                writew(ctx, base, reg);
+                ctx->gpr[0] = 0;    // r0 always == 0
+                if (d->op == OP_syscall)
+                    ctx->pc = d->pc + 4;    // inline handler sees pc as in the single-step path
+                mipsvm_handlers[d->op](ctx, d);
+                COUNT_OP(ctx, d);
+                if (ctx->exception || b->pc != pc)  // exception or the block was modified by itself
+                    break;
             }
         }
-        return 1;
 
-    case 0x2E:  // swr
+        if (d < body_end)
         {
-            // little-endian mode
-            uint32_t addr = ctx->gpr[rs] + imm_se;
-            uint32_t base = addr & -4U;
-            uint32_t offset = addr & 0x03;
-            uint32_t reg = ctx->gpr[rt];
-            if (offset == 0)
+            ctx->pc = d->pc + 4;
+            if (ctx->exception)
             {
-                writew(ctx, base, reg); // hgfe
+                if (charged)
+                    refund(ctx, b, d - b->ops);
+                n += d - b->ops;
+                break;
             }
-            else if (offset == 1)
+            if (charged)
+                refund(ctx, b, d - b->ops + 1);
+            n += d - b->ops + 1;
+            prev = 0;
+            continue;
+        }
+
+        if (b->has_branch)
+        {
+            ctx->gpr[0] = 0;
+            ctx->pc = d->pc + 4;
+            mipsvm_handlers[d->op](ctx, d);    // branches never raise the exception
+            COUNT_OP(ctx, d);
+
+            d++;
+            if (ctx->branch_is_pending)
             {
-                writeb(ctx, base + 1, reg); // h
-                writeh(ctx, base + 2, reg >> 8); // gf
+                ctx->branch_is_pending = 0;
+                ctx->pc = ctx->branch_pc;
             }
-            else if (offset == 2)
+            else
             {
-                writeh(ctx, base + 2, reg); // hg
+                ctx->pc = d->pc + 4;
             }
-            else
+
+            ctx->gpr[0] = 0;
+            mipsvm_handlers[d->op](ctx, d);
+            COUNT_OP(ctx, d);
+            if (ctx->exception)
             {
-                writeb(ctx, base + 3, reg); // h
+                if (charged)
+                    refund(ctx, b, b->len - 1);
+                n += b->len - 1;
+                break;
             }
         }
-        return 1;
+        else
+        {
+            ctx->pc = d[-1].pc + 4;
+        }
 
-    case 0x0E:  // xori
-        ctx->gpr[rt] = ctx->gpr[rs] ^ imm_ze;
-        return 1;
+        n += b->len;
+        prev = b;
+    }
 
-    case 0x30:  // ll
-        break;
+    return n;
+}
 
-    case 0x38:  // sc
-        break;
+mipsvm_rc_t mipsvm_run(mipsvm_t *ctx, uint32_t max_instr, uint32_t *retired)
+{
+    ctx->exception = 0; // clean previous exception if any, engine leaves on the first new one
+    sandbox_release(ctx);
+    mipsvm_sandbox_enter(ctx);
+
+    uint32_t n = ctx->blocks ? run_blocks(ctx, max_instr) : run_metered(ctx, max_instr);
+    mipsvm_sandbox_leave(ctx);
+    sandbox_release(ctx);
+
+    if (retired)
+        *retired = n;
+
+    STAT(ctx->stats.rc[ctx->exception]++);
+    return ctx->exception;
+}
+
+void mipsvm_init(mipsvm_t *ctx, const mipsvm_iface_t *iface, uint32_t reset_pc)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->iface = *iface;
+    ctx->pc = reset_pc;
+    ctx->fuel = MIPSVM_FUEL_UNLIMITED;
+    memset(ctx->fuel_weights, 1, sizeof(ctx->fuel_weights));
+    ctx->fuel_weight = 1;
+}
+
+uint32_t mipsvm_get_callcode(const mipsvm_t *ctx)
+{
+    return ctx->code;
+}
+
+void mipsvm_set_regions(mipsvm_t *ctx, const mipsvm_region_t *regions, uint32_t n_regions)
+{
+    ctx->regions = regions;
+    ctx->regions_num = n_regions;
+
+    // code may be seen differently now
+    mipsvm_flush_decode_cache(ctx);
+    mipsvm_flush_block_cache(ctx);
+}
+
+void mipsvm_set_tlb(mipsvm_t *ctx, mipsvm_tlb_entry_t *entries, uint32_t n_entries, mipsvm_tlb_refill_t refill)
+{
+    ctx->tlb = entries;
+    ctx->tlb_mask = n_entries - 1;
+    ctx->tlb_refill = refill;
+    mipsvm_flush_tlb(ctx);
+}
+
+// host page tables changed, code may be seen differently now
+void mipsvm_flush_tlb(mipsvm_t *ctx)
+{
+    if (! ctx->tlb)
+        return;
+
+    for (uint32_t i = 0; i <= ctx->tlb_mask; i++)
+        ctx->tlb[i].page = MIPSVM_TLB_INVALID;
+
+    mipsvm_flush_decode_cache(ctx);
+    mipsvm_flush_block_cache(ctx);
+    mipsvm_flush_icache(ctx);
+}
+
+void mipsvm_flush_tlb_page(mipsvm_t *ctx, uint32_t addr)
+{
+    if (! ctx->tlb)
+        return;
+
+    mipsvm_tlb_entry_t *e = &ctx->tlb[(addr >> MIPSVM_PAGE_BITS) & ctx->tlb_mask];
+    if (e->page == (addr & -MIPSVM_PAGE_SIZE))
+        e->page = MIPSVM_TLB_INVALID;
+
+    drop_code(ctx, addr & -MIPSVM_PAGE_SIZE, MIPSVM_PAGE_SIZE);
+}
+
+void mipsvm_set_icache(mipsvm_t *ctx, mipsvm_icache_t *ic, uint32_t *tags, uint8_t *data,
+                       uint32_t line_size, uint32_t n_sets, uint32_t n_ways)
+{
+    memset(ic, 0, sizeof(*ic));
+    ic->tags = tags;
+    ic->data = data;
+    ic->sets_mask = n_sets - 1;
+    ic->ways = n_ways;
+    while ((1U << ic->line_bits) < line_size)
+        ic->line_bits++;
+
+    ctx->icache = ic;
+    mipsvm_flush_icache(ctx);
+}
+
+void mipsvm_flush_icache(mipsvm_t *ctx)
+{
+    mipsvm_icache_t *ic = ctx->icache;
+    if (! ic)
+        return;
+
+    for (uint32_t i = 0; i < (ic->sets_mask + 1) * ic->ways; i++)
+        ic->tags[i] = MIPSVM_ICACHE_INVALID;
+    ic->victim = 0;
+}
+
+// host modified the code media
+void mipsvm_invalidate_icache(mipsvm_t *ctx, uint32_t addr, uint32_t size)
+{
+    mipsvm_icache_t *ic = ctx->icache;
+    if (! ic || ! size)
+        return;
+
+    uint32_t first = addr >> ic->line_bits;
+    uint32_t last = (addr + size - 1) >> ic->line_bits;
+    for (uint32_t line = first; line <= last; line++)
+        icache_invalidate(ic, line << ic->line_bits);
+}
+
+void mipsvm_set_decode_cache(mipsvm_t *ctx, mipsvm_decoded_t *entries, uint32_t n_entries)
+{
+    ctx->dcache = entries;
+    ctx->dcache_mask = n_entries - 1;
+    mipsvm_flush_decode_cache(ctx);
+}
+
+void mipsvm_flush_decode_cache(mipsvm_t *ctx)
+{
+    if (! ctx->dcache)
+        return;
+
+    for (uint32_t i = 0; i <= ctx->dcache_mask; i++)
+        ctx->dcache[i].pc = MIPSVM_DECODED_FREE;
+}
+
+void mipsvm_set_block_cache(mipsvm_t *ctx, mipsvm_block_t *blocks, uint32_t n_blocks)
+{
+    ctx->blocks = blocks;
+    ctx->blocks_mask = n_blocks - 1;
+    mipsvm_flush_block_cache(ctx);
+}
+
+// sets the block cache already holding the blocks, e.g. translated by the other process. Host pointers are dropped
+void mipsvm_attach_block_cache(mipsvm_t *ctx, mipsvm_block_t *blocks, uint32_t n_blocks)
+{
+    ctx->blocks = blocks;
+    ctx->blocks_mask = n_blocks - 1;
+    ctx->code_lo = 0;
+    ctx->code_hi = 0;
+
+    for (uint32_t i = 0; i < n_blocks; i++)
+    {
+        mipsvm_block_t *b = &blocks[i];
+
+        b->link[0] = 0;
+        b->link[1] = 0;
+        b->native = 0;
+        b->aot = 0;
+        if (((b->pc >> 2) & ctx->blocks_mask) != i)   // never found by the lookup, nor by the invalidation
+            b->pc = MIPSVM_DECODED_FREE;
+        if (b->pc == MIPSVM_DECODED_FREE)
+            continue;
+
+        find_aot(ctx, b);
+        b->cost = block_cost(ctx, b);
+#ifdef MIPSVM_JIT
+        if (b->hits >= MIPSVM_JIT_HOT)  // hot block is compiled once executed again
+            b->hits = MIPSVM_JIT_HOT - 1;
+#endif
+
+        cover_code(ctx, b->pc, b->pc + b->len * 4);
     }
+}
 
-    return 0;
+void mipsvm_flush_block_cache(mipsvm_t *ctx)
+{
+    ctx->code_lo = 0;
+    ctx->code_hi = 0;
+
+    if (! ctx->blocks)
+        return;
+
+    for (uint32_t i = 0; i <= ctx->blocks_mask; i++)
+        ctx->blocks[i].pc = MIPSVM_DECODED_FREE;
 }
 
-mipsvm_rc_t mipsvm_exec(mipsvm_t *ctx)
+// tracks the script calls (jal, jalr, bal) and returns (jr ra) in the host-provided stack, 0 to stop
+void mipsvm_set_callstack(mipsvm_t *ctx, mipsvm_callstack_t *cs)
 {
-    // initial state before each instruction
-    ctx->gpr[0] = 0;    // r0 always == 0
-    ctx->exception = 0; // clean previous exception if any
+    ctx->calls = cs;
+}
 
-    uint32_t instr = readw(ctx, ctx->pc);
-    if (! ctx->branch_is_pending)
+// routes the iface callbacks via the hook (record/replay), 0 to restore
+void mipsvm_set_iface_hook(mipsvm_t *ctx, mipsvm_iface_hook_t *hook)
+{
+    ctx->hook = hook;
+}
+
+// script stops with MIPSVM_RC_OUT_OF_FUEL once the fuel is spent. Default is MIPSVM_FUEL_UNLIMITED
+void mipsvm_set_fuel(mipsvm_t *ctx, uint64_t fuel)
+{
+    ctx->fuel = fuel;
+}
+
+uint64_t mipsvm_get_fuel(const mipsvm_t *ctx)
+{
+    return ctx->fuel;
+}
+
+// fuel charged per instruction class, MIPSVM_FUEL_CLASSES entries. Default is 1 for all, so the fuel is instructions
+void mipsvm_set_fuel_weights(mipsvm_t *ctx, const uint8_t *weights)
+{
+    memcpy(ctx->fuel_weights, weights, sizeof(ctx->fuel_weights));
+
+    ctx->fuel_weight = weights[0];
+    for (uint32_t i = 1; i < MIPSVM_FUEL_CLASSES; i++)
     {
-        ctx->pc += 4;
+        if (weights[i] != weights[0])
+            ctx->fuel_weight = 0;
     }
-    else
+
+    for (uint32_t i = 0; ctx->blocks && i <= ctx->blocks_mask; i++)
     {
-        ctx->branch_is_pending = 0;
-        ctx->pc = ctx->branch_pc;
+        if (ctx->blocks[i].pc != MIPSVM_DECODED_FREE)
+        {
+            ctx->blocks[i].cost = block_cost(ctx, &ctx->blocks[i]);
+            find_aot(ctx, &ctx->blocks[i]);
+        }
     }
+}
 
-    uint32_t opcode = instr >> 26;  // 6 top bits is the opcode
+// syscalls with the handler in the table (n entries, indexed by the code) are handled without leaving the VM.
+// Handlers must not change pc. 0 to stop
+void mipsvm_set_syscalls(mipsvm_t *ctx, const mipsvm_syscall_t *table, uint32_t n, void *user)
+{
+    ctx->syscalls = table;
+    ctx->syscalls_num = table ? n : 0;
+    ctx->syscalls_user = user;
+}
+
+// tracks the script stores to the pages of the range, bitmap holds size / MIPSVM_PAGE_SIZE bits. Range is page-aligned
+void mipsvm_set_dirty_map(mipsvm_t *ctx, uint32_t *bitmap, uint32_t base, uint32_t size)
+{
+    ctx->dirty = bitmap;
+    ctx->dirty_base = base;
+    ctx->dirty_pages = bitmap ? size >> MIPSVM_PAGE_BITS : 0;
+    if (bitmap)
+        memset(bitmap, 0, (ctx->dirty_pages + 31) / 32 * 4);
+}
 
-    bool was_decoded = 0;
+#ifdef MIPSVM_STATS
+typedef char ops_fit_stats[OPS_NUM <= MIPSVM_STATS_OPS ? 1 : -1];
 
-    if (opcode == 0x00)
-        was_decoded = exec_special(ctx, instr);
-    else if (opcode == 0x1C)
-        was_decoded = exec_special2(ctx, instr);
-    else if (opcode == 0x1F)
-        was_decoded = exec_special3(ctx, instr);
-    else if ((opcode & 0x3E) == 0x02)
-        was_decoded = exec_jtype(ctx, instr);
-    else if ((opcode & 0x3C) != 0x10)
-        was_decoded = exec_itype(ctx, instr);
+#define OP_NAME(name) #name,
+static const char *const op_names[OPS_NUM] = { OPS(OP_NAME) };
 
-    if (ctx->exception)
-        return ctx->exception;
+// copies the counters, memory accesses are summed from the load/store instructions
+void mipsvm_get_stats(const mipsvm_t *ctx, mipsvm_stats_t *stats)
+{
+    const uint64_t *ops = ctx->stats.ops;
+
+    *stats = ctx->stats;
+    stats->loads[0] = ops[OP_lb] + ops[OP_lbu];
+    stats->loads[1] = ops[OP_lh] + ops[OP_lhu];
+    stats->loads[2] = ops[OP_lw] + ops[OP_lwl] + ops[OP_lwr];
+    stats->stores[0] = ops[OP_sb];
+    stats->stores[1] = ops[OP_sh];
+    stats->stores[2] = ops[OP_sw] + ops[OP_swl] + ops[OP_swr];
+}
 
-    return was_decoded ? MIPSVM_RC_OK : MIPSVM_RC_RESERVED_INSTR;
+void mipsvm_reset_stats(mipsvm_t *ctx)
+{
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
 }
 
-void mipsvm_init(mipsvm_t *ctx, const mipsvm_iface_t *iface, uint32_t reset_pc)
+// mnemonic of the handler index, 0 if out of range
+const char *mipsvm_op_name(uint32_t op)
 {
-    memset(ctx, 0, sizeof(ctx));
-    ctx->iface = *iface;
-    ctx->pc = reset_pc;
+    return op < OPS_NUM ? op_names[op] : 0;
 }
+#endif
 
-uint32_t mipsvm_get_callcode(const mipsvm_t *ctx)
+void mipsvm_set_natives(mipsvm_t *ctx, const mipsvm_native_t *table, uint32_t n)
 {
-    return ctx->code;
+    ctx->natives = table;
+    ctx->natives_num = n;
+    mipsvm_flush_block_cache(ctx);
+}
+
+// memory access as seen by the script. Exception is reported via ctx->exception
+uint8_t mipsvm_readb(mipsvm_t *ctx, uint32_t addr)
+{
+    mipsvm_sandbox_enter(ctx);
+    uint8_t data = readb(ctx, addr);
+    mipsvm_sandbox_leave(ctx);
+    return data;
+}
+
+uint16_t mipsvm_readh(mipsvm_t *ctx, uint32_t addr)
+{
+    mipsvm_sandbox_enter(ctx);
+    uint16_t data = readh(ctx, addr);
+    mipsvm_sandbox_leave(ctx);
+    return data;
+}
+
+uint32_t mipsvm_readw(mipsvm_t *ctx, uint32_t addr)
+{
+    mipsvm_sandbox_enter(ctx);
+    uint32_t data = readw(ctx, addr);
+    mipsvm_sandbox_leave(ctx);
+    return data;
+}
+
+void mipsvm_writeb(mipsvm_t *ctx, uint32_t addr, uint8_t data)
+{
+    mipsvm_sandbox_enter(ctx);
+    writeb(ctx, addr, data);
+    mipsvm_sandbox_leave(ctx);
+}
+
+void mipsvm_writeh(mipsvm_t *ctx, uint32_t addr, uint16_t data)
+{
+    mipsvm_sandbox_enter(ctx);
+    writeh(ctx, addr, data);
+    mipsvm_sandbox_leave(ctx);
+}
+
+void mipsvm_writew(mipsvm_t *ctx, uint32_t addr, uint32_t data)
+{
+    mipsvm_sandbox_enter(ctx);
+    writew(ctx, addr, data);
+    mipsvm_sandbox_leave(ctx);
+}
+
+// script stores to addr are not refused as the read-only memory (callbacks decide by themselves)
+bool mipsvm_is_writable(mipsvm_t *ctx, uint32_t addr)
+{
+    uint8_t *mem;
+    return host_chunk(ctx, addr, 1, &mem) || ! host_chunk(ctx, addr, 0, &mem);
+}
+
+// host spans of the guest range, so the host call accesses its arguments in place. Fails if any part of the range is
+// not the plain memory (callbacks), is read-only when writable, or takes more than max spans. Spans stay valid until
+// the memory setup changes or the VM runs. Writable range is treated as written: cached code is dropped and pages
+// are marked dirty now, so the host must not write it after the VM runs again
+bool mipsvm_get_spans(mipsvm_t *ctx, uint32_t addr, uint32_t size, bool writable, mipsvm_span_t *spans, uint32_t max,
+                      uint32_t *n)
+{
+    uint32_t count = 0;
+
+    if ((uint64_t) addr + size > 0x100000000ULL)
+        return 0;
+
+    for (uint32_t a = addr, left = size; left; )
+    {
+        uint8_t *mem;
+        uint32_t len = host_chunk(ctx, a, writable, &mem);
+        if (! len)
+            return 0;
+        if (len > left)
+            len = left;
+
+        // adjacent pages and regions backed by the contiguous host memory are merged
+        if (count && spans[count - 1].mem + spans[count - 1].size == mem)
+            spans[count - 1].size += len;
+        else if (count == max)
+            return 0;
+        else
+        {
+            spans[count].mem = mem;
+            spans[count].size = len;
+            count++;
+        }
+
+        a += len;
+        left -= len;
+    }
+
+    if (writable && size)
+        mipsvm_invalidate_range(ctx, addr, size);
+
+    *n = count;
+    return 1;
+}
+
+// host pointer of the guest range if it is the single span, 0 otherwise (see mipsvm_get_spans)
+void *mipsvm_get_buffer(mipsvm_t *ctx, uint32_t addr, uint32_t size, bool writable)
+{
+    mipsvm_span_t span;
+    uint32_t n;
+
+    if (! size || ! mipsvm_get_spans(ctx, addr, size, writable, &span, 1, &n))
+        return 0;
+    return span.mem;
+}
+
+// zero-terminated string of the script in place, its length is stored to len. Returns 0 if the terminator is not
+// found within max bytes of the contiguous host memory
+const char *mipsvm_get_string(mipsvm_t *ctx, uint32_t addr, uint32_t max, uint32_t *len)
+{
+    uint8_t *str = 0;
+    uint32_t done = 0;
+
+    while (done < max)
+    {
+        uint8_t *mem;
+        uint32_t n = host_chunk(ctx, addr + done, 0, &mem);
+        if (! n || (str && mem != str + done))
+            return 0;
+        if (n > max - done)
+            n = max - done;
+
+        if (! str)
+            str = mem;
+
+        const uint8_t *end = memchr(mem, 0, n);
+        if (end)
+        {
+            *len = done + (end - mem);
+            return (const char *) str;
+        }
+
+        done += n;
+    }
+
+    return 0;
+}
+
+// copies the zero-terminated string of the script to buf of size bytes, from any memory including callbacks. Result is
+// always terminated if size is not 0, returns false if the string is cut or not readable. Address error of the
+// unreadable string is reported via ctx->exception, as for mipsvm_readb
+bool mipsvm_copy_string(mipsvm_t *ctx, uint32_t addr, char *buf, uint32_t size, uint32_t *len)
+{
+    mipsvm_rc_t exception = ctx->exception;
+    uint32_t done = 0;
+    bool found = 0;
+
+    if (! size)
+        return 0;
+
+    ctx->exception = 0;
+    while (! found && ! ctx->exception && done < size - 1)
+    {
+        uint8_t *mem;
+        uint32_t n = host_chunk(ctx, addr + done, 0, &mem);
+        if (n)
+        {
+            if (n > size - 1 - done)
+                n = size - 1 - done;
+
+            const uint8_t *end = memchr(mem, 0, n);
+            uint32_t copy = end ? (uint32_t) (end - mem) : n;
+            memcpy(buf + done, mem, copy);
+            done += copy;
+            found = end;
+            continue;
+        }
+
+        // not the plain memory, read as the script does
+        uint8_t c = mipsvm_readb(ctx, addr + done);
+        found = ! c;
+        if (c)
+            buf[done++] = c;
+    }
+
+    // string of size - 1 characters fits as well
+    if (! found && ! ctx->exception)
+        found = ! mipsvm_readb(ctx, addr + done);
+
+    if (ctx->exception)
+    {
+        // sandbox page mapped by the fault is not read any further
+        sandbox_release(ctx);
+        found = 0;
+    }
+    else
+        ctx->exception = exception;
+
+    buf[done] = 0;
+    if (len)
+        *len = done;
+    return found;
+}
+
+// executes the instruction word as if it was just fetched, i.e. ctx->pc points to the next instruction
+void mipsvm_exec_instr(mipsvm_t *ctx, uint32_t instr)
+{
+    mipsvm_decoded_t d;
+
+    mipsvm_decode(instr, &d);
+    d.pc = ctx->pc - 4;
+    mipsvm_sandbox_enter(ctx);
+    mipsvm_handlers[d.op](ctx, &d);
+    mipsvm_sandbox_leave(ctx);
 }
@@ -2,6 +2,9 @@
 #define __MIPSVM_H__
 // public
 
+#include <stdint.h>
+#include <stdbool.h>
+
 typedef enum
 {
     MIPSVM_RC_OK,
@@ -12,6 +15,7 @@ typedef enum
     MIPSVM_RC_BREAK,
     MIPSVM_RC_SYSCALL,
     MIPSVM_RC_TRAP,
+    MIPSVM_RC_OUT_OF_FUEL,      // not an exception, script resumes once the fuel is added
 } mipsvm_rc_t;
 
 typedef struct
@@ -22,11 +26,187 @@ typedef struct
     void (*writew)(uint32_t addr, uint32_t data);
     void (*writeb)(uint32_t addr, uint8_t data);
     void (*writeh)(uint32_t addr, uint16_t data);
+    void (*readline)(uint32_t addr, uint8_t *buf, uint32_t len);    // optional bulk read of the aligned code line
 } mipsvm_iface_t;
 
+// replaces the iface callbacks, e.g. to record or replay them. size is 1, 2 or 4.
+// syscall, if set, replaces the syscall handlers (see mipsvm_set_syscalls), returns false to leave the VM
+typedef struct mipsvm_iface_hook
+{
+    uint32_t (*read)(struct mipsvm_iface_hook *hook, uint32_t addr, uint32_t size);
+    void (*write)(struct mipsvm_iface_hook *hook, uint32_t addr, uint32_t data, uint32_t size);
+    bool (*syscall)(struct mipsvm_iface_hook *hook, uint32_t code);
+} mipsvm_iface_hook_t;
+
+// guest address range backed by the host memory, accessed without the iface callbacks
+typedef struct
+{
+    uint32_t base;      // guest address, multiple of 4
+    uint32_t size;      // bytes, multiple of 4
+    uint8_t *mem;       // host memory, guest (little-endian) byte order
+    bool writable;      // script stores to the read-only region raise MIPSVM_RC_WRITE_ADDRESS_ERROR
+} mipsvm_region_t;
+
+// host memory of the part of the guest range, see mipsvm_get_spans
+typedef struct
+{
+    uint8_t *mem;
+    uint32_t size;
+} mipsvm_span_t;
+
+// software TLB, maps the guest page to the host memory
+#define MIPSVM_PAGE_BITS 12
+#define MIPSVM_PAGE_SIZE (1U << MIPSVM_PAGE_BITS)
+
+typedef struct
+{
+    uint32_t page;      // guest address of the page, MIPSVM_TLB_INVALID for the empty entry
+    uint8_t *mem;       // host memory of the page, 0 if the page is accessed via the regions/callbacks
+    bool writable;      // script stores to the read-only page raise MIPSVM_RC_WRITE_ADDRESS_ERROR
+} mipsvm_tlb_entry_t;
+
+#define MIPSVM_TLB_INVALID 1    // never matches the page address
+
+// called on the TLB miss, fills mem and writable of the entry. Returns false if the page is not the plain memory
+typedef bool (*mipsvm_tlb_refill_t)(uint32_t page, mipsvm_tlb_entry_t *e);
+
 typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+} mipsvm_tlb_stats_t;
+
+// instruction fetch cache, set-associative, lines are filled from the media via the iface
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;
+} mipsvm_icache_stats_t;
+
+typedef struct
+{
+    uint32_t *tags;         // line address per way, MIPSVM_ICACHE_INVALID for the empty one. sets * ways entries
+    uint8_t *data;          // sets * ways * line_size bytes
+    uint32_t line_bits;
+    uint32_t sets_mask;
+    uint32_t ways;
+    uint32_t victim;        // round-robin replacement
+    mipsvm_icache_stats_t stats;
+} mipsvm_icache_t;
+
+#define MIPSVM_ICACHE_INVALID 1     // never matches the line address
+
+// decode cache entry
+typedef struct
+{
+    uint32_t pc;        // address of the decoded instruction, MIPSVM_DECODED_FREE for the empty entry
+    uint8_t op;         // handler index
+    uint8_t rs;
+    uint8_t rt;
+    uint8_t rd;
+    uint8_t sa;
+    int32_t imm;        // immediate extended as required by the handler, branch offset, jump target or exception code
+} mipsvm_decoded_t;
+
+#define MIPSVM_DECODED_FREE 1   // never matches the word-aligned pc
+
+// max instructions in the translated block
+#ifndef MIPSVM_BLOCK_LEN
+#define MIPSVM_BLOCK_LEN 16
+#endif
+
+struct mipsvm;
+
+// block recompiled ahead of time by the mips2c tool
+typedef struct
+{
+    uint32_t pc;                // address of the first instruction
+    uint32_t len;               // max instructions executed
+    uint32_t (*fn)(struct mipsvm *ctx);     // runs the block, sets pc to the next one, returns the retired instructions
+    const uint8_t *classes;     // fuel class of every instruction (mipsvm_fuel_class_t), len entries
+} mipsvm_native_t;
+
+// block cache entry
+typedef struct mipsvm_block mipsvm_block_t;
+struct mipsvm_block
+{
+    uint32_t pc;                // address of the first instruction, MIPSVM_DECODED_FREE for the empty block
+    uint8_t len;                // number of instructions
+    uint8_t has_branch;         // block ends with the branch and its delay slot
+    uint16_t cost;              // fuel charged on entry
+    uint16_t aot_cost;          // fuel charged on entry of the recompiled block
+    uint32_t hits;              // times the block was executed
+    mipsvm_block_t *link[2];    // last seen successors: [0] - fall-through, [1] - branch target
+    uint32_t (*native)(struct mipsvm *ctx);   // jit-compiled body, returns the index of the instruction it stopped at
+    const mipsvm_native_t *aot;     // recompiled block at the same pc, if any
+    mipsvm_decoded_t ops[MIPSVM_BLOCK_LEN];
+};
+
+typedef struct
+{
+    uint64_t hits;              // block found in cache
+    uint64_t chained;           // block entered via the link from the previous one, no lookup
+    uint64_t misses;            // block translated
+    uint64_t invalidations;     // block dropped by the store to its code
+} mipsvm_block_stats_t;
+
+// guest call stack rebuilt from the calls and returns
+typedef struct
+{
+    uint32_t *ret;              // return addresses, outermost first
+    uint32_t size;
+    uint32_t depth;             // may exceed size, deeper calls are counted but not recorded
+} mipsvm_callstack_t;
+
+// host call handled inside the VM, arguments are in gpr[4..7] (a0-a3), results go to gpr[2..3] (v0/v1).
+// Returns false to leave the VM with MIPSVM_RC_SYSCALL as if there was no handler (blocking calls, etc)
+typedef bool (*mipsvm_syscall_t)(struct mipsvm *ctx, void *user);
+
+// fuel weights are set per instruction class
+typedef enum
+{
+    MIPSVM_FUEL_ALU,
+    MIPSVM_FUEL_MUL,            // mult, madd, mul, etc
+    MIPSVM_FUEL_DIV,
+    MIPSVM_FUEL_LOAD,
+    MIPSVM_FUEL_STORE,
+    MIPSVM_FUEL_BRANCH,         // branches and jumps
+    MIPSVM_FUEL_SYSTEM,         // syscall, break, traps
+    MIPSVM_FUEL_CLASSES,
+} mipsvm_fuel_class_t;
+
+#define MIPSVM_FUEL_UNLIMITED UINT64_MAX
+
+#ifdef MIPSVM_STATS
+// execution counters, compiled in with MIPSVM_STATS
+#define MIPSVM_STATS_OPS 128
+
+typedef struct
+{
+    uint64_t ops[MIPSVM_STATS_OPS];     // instructions retired per handler, see mipsvm_op_name
+    uint64_t taken;             // branches and jumps
+    uint64_t not_taken;
+    uint64_t delay_slots;       // retired delay slot instructions
+    uint64_t loads[3];          // script loads by width: byte, halfword, word (lwl/lwr included)
+    uint64_t stores[3];
+    uint64_t rc[MIPSVM_RC_OUT_OF_FUEL + 1];     // mipsvm_exec/mipsvm_run results per mipsvm_rc_t
+    uint64_t callbacks;         // iface calls
+    bool after_branch;          // next instruction is the delay slot
+} mipsvm_stats_t;
+#endif
+
+typedef struct mipsvm
 {
     mipsvm_iface_t iface;
+    uint8_t *flat;              // sandbox base, all memory is accessed directly if set
+    struct mipsvm_sandbox *sandbox;     // see mipsvm_sandbox.h
+    const mipsvm_region_t *regions;
+    uint32_t regions_num;
+    mipsvm_tlb_entry_t *tlb;
+    uint32_t tlb_mask;
+    mipsvm_tlb_refill_t tlb_refill;
+    mipsvm_tlb_stats_t tstats;
     uint32_t pc;
     uint32_t branch_pc;
     uint32_t code;
@@ -42,10 +222,84 @@ typedef struct
         };
     };
     uint32_t gpr[32];
+    mipsvm_icache_t *icache;
+    mipsvm_decoded_t *dcache;
+    uint32_t dcache_mask;
+    mipsvm_block_t *blocks;
+    uint32_t blocks_mask;
+    uint32_t code_lo;           // code range covered by the blocks
+    uint32_t code_hi;
+    mipsvm_block_stats_t bstats;
+    struct mipsvm_jit *jit;     // see mipsvm_jit.h
+    const mipsvm_native_t *natives;     // sorted by pc
+    uint32_t natives_num;
+    uint32_t *dirty;            // bitmap of the pages written since the last checkpoint
+    uint32_t dirty_base;
+    uint32_t dirty_pages;
+    mipsvm_callstack_t *calls;
+    mipsvm_iface_hook_t *hook;
+    uint64_t fuel;
+    uint8_t fuel_weights[MIPSVM_FUEL_CLASSES];
+    uint8_t fuel_weight;        // all the weights if equal, 0 if they differ
+    const mipsvm_syscall_t *syscalls;   // indexed by the syscall code
+    uint32_t syscalls_num;
+    void *syscalls_user;
+#ifdef MIPSVM_STATS
+    mipsvm_stats_t stats;
+#endif
 } mipsvm_t;
 
+// checkpoint stream, returns false on the IO error
+typedef bool (*mipsvm_io_t)(void *user, void *data, uint32_t size);
+
 void mipsvm_init(mipsvm_t *ctx, const mipsvm_iface_t *iface, uint32_t reset_pc);
 mipsvm_rc_t mipsvm_exec(mipsvm_t *ctx);
+mipsvm_rc_t mipsvm_run(mipsvm_t *ctx, uint32_t max_instr, uint32_t *retired);
 uint32_t mipsvm_get_callcode(const mipsvm_t *ctx);
+void mipsvm_set_regions(mipsvm_t *ctx, const mipsvm_region_t *regions, uint32_t n_regions);
+void mipsvm_set_tlb(mipsvm_t *ctx, mipsvm_tlb_entry_t *entries, uint32_t n_entries, mipsvm_tlb_refill_t refill);
+void mipsvm_flush_tlb(mipsvm_t *ctx);
+void mipsvm_flush_tlb_page(mipsvm_t *ctx, uint32_t addr);
+void mipsvm_set_icache(mipsvm_t *ctx, mipsvm_icache_t *ic, uint32_t *tags, uint8_t *data,
+                       uint32_t line_size, uint32_t n_sets, uint32_t n_ways);
+void mipsvm_flush_icache(mipsvm_t *ctx);
+void mipsvm_invalidate_icache(mipsvm_t *ctx, uint32_t addr, uint32_t size);
+void mipsvm_set_decode_cache(mipsvm_t *ctx, mipsvm_decoded_t *entries, uint32_t n_entries);
+void mipsvm_flush_decode_cache(mipsvm_t *ctx);
+void mipsvm_set_block_cache(mipsvm_t *ctx, mipsvm_block_t *blocks, uint32_t n_blocks);
+void mipsvm_flush_block_cache(mipsvm_t *ctx);
+void mipsvm_attach_block_cache(mipsvm_t *ctx, mipsvm_block_t *blocks, uint32_t n_blocks);
+void mipsvm_set_dirty_map(mipsvm_t *ctx, uint32_t *bitmap, uint32_t base, uint32_t size);
+void mipsvm_invalidate_range(mipsvm_t *ctx, uint32_t addr, uint32_t size);
+void mipsvm_set_callstack(mipsvm_t *ctx, mipsvm_callstack_t *cs);
+void mipsvm_set_iface_hook(mipsvm_t *ctx, mipsvm_iface_hook_t *hook);
+void mipsvm_set_fuel(mipsvm_t *ctx, uint64_t fuel);
+uint64_t mipsvm_get_fuel(const mipsvm_t *ctx);
+void mipsvm_set_fuel_weights(mipsvm_t *ctx, const uint8_t *weights);
+void mipsvm_set_syscalls(mipsvm_t *ctx, const mipsvm_syscall_t *table, uint32_t n, void *user);
+
+#ifdef MIPSVM_STATS
+void mipsvm_get_stats(const mipsvm_t *ctx, mipsvm_stats_t *stats);
+void mipsvm_reset_stats(mipsvm_t *ctx);
+const char *mipsvm_op_name(uint32_t op);
+#endif
+
+void mipsvm_set_natives(mipsvm_t *ctx, const mipsvm_native_t *table, uint32_t n);
+
+uint8_t mipsvm_readb(mipsvm_t *ctx, uint32_t addr);
+uint16_t mipsvm_readh(mipsvm_t *ctx, uint32_t addr);
+uint32_t mipsvm_readw(mipsvm_t *ctx, uint32_t addr);
+void mipsvm_writeb(mipsvm_t *ctx, uint32_t addr, uint8_t data);
+void mipsvm_writeh(mipsvm_t *ctx, uint32_t addr, uint16_t data);
+void mipsvm_writew(mipsvm_t *ctx, uint32_t addr, uint32_t data);
+bool mipsvm_is_writable(mipsvm_t *ctx, uint32_t addr);
+void mipsvm_exec_instr(mipsvm_t *ctx, uint32_t instr);
+
+// guest buffers of the host calls, accessed in place
+bool mipsvm_get_spans(mipsvm_t *ctx, uint32_t addr, uint32_t size, bool writable, mipsvm_span_t *spans, uint32_t max,
+                      uint32_t *n);
+void *mipsvm_get_buffer(mipsvm_t *ctx, uint32_t addr, uint32_t size, bool writable);
+const char *mipsvm_get_string(mipsvm_t *ctx, uint32_t addr, uint32_t max, uint32_t *len);
+bool mipsvm_copy_string(mipsvm_t *ctx, uint32_t addr, char *buf, uint32_t size, uint32_t *len);
 
 #endif
@@ -0,0 +1,546 @@
+#define __MIPSVM_BENCH_C__
+
+// Benchmark. Guest workloads are embedded pre-assembled (MIPS32r2, little-endian), so no cross toolchain is needed.
+// Every workload runs through every engine compiled in and every memory mode, one JSON object per line is printed:
+//   {"workload", "engine", "memory", "instrs", "seconds", "mips", "syscalls", "ns_per_syscall", "instance_bytes", "checksum", "ok"}
+// instance_bytes is the VM state and the caches of the engine, guest memory is not included. Results of the engines are
+// checked against each other (instructions retired and v0), the exit code is 1 on the mismatch.
+//
+// Build: cc -O2 -o mipsvm_bench mipsvm_bench.c mipsvm.c
+//        cc -O2 -DMIPSVM_THREADED -o mipsvm_bench mipsvm_bench.c mipsvm.c
+//        cc -O2 -DMIPSVM_JIT -o mipsvm_bench mipsvm_bench.c mipsvm.c mipsvm_jit.c
+//        cc -O2 -DMIPSVM_BENCH_SANDBOX -o mipsvm_bench mipsvm_bench.c mipsvm.c mipsvm_sandbox.c
+//        AOT engine, the workloads are recompiled by mips2c first ("dump" writes <workload>.bin):
+//          mipsvm_bench dump && for w in int_loop memcpy branchy muldiv unaligned pingpong; do
+//              mips2c $w.bin 0x1000 ${w}_natives 0x1000 > bench_$w.c; done
+//          cc -O2 -DMIPSVM_BENCH_AOT -o mipsvm_bench mipsvm_bench.c mipsvm.c bench_*.c
+// Usage: mipsvm_bench [scale] [workload]
+//        mipsvm_bench dump
+//
+// Workloads take the iterations in a0 and the buffers in a1/a2, return the result in v0 via 'syscall 1'.
+// 'syscall 2' is the host call round-trip, host adds a0 to v0.
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "mipsvm.h"
+#ifdef MIPSVM_JIT
+#include "mipsvm_jit.h"
+#endif
+#ifdef MIPSVM_BENCH_SANDBOX
+#include "mipsvm_sandbox.h"
+#endif
+
+#define MEM_SIZE 0x20000
+#define CODE_BASE 0x1000
+#define BUF_A 0x10000
+#define BUF_B 0x14000
+
+#define DCACHE_ENTRIES 1024
+#define BLOCKS 256
+#define TLB_ENTRIES 64
+#define ICACHE_LINE 32
+#define ICACHE_SETS 64
+#define ICACHE_WAYS 2
+#define JIT_SIZE (1 << 20)
+
+#define SYSCALL_EXIT 1
+#define SYSCALL_PING 2
+
+static const uint32_t int_loop_code[] =
+{
+    0x24020000,     //    li v0, 0
+    0x3C081234,     //    lui t0, 0x1234
+    0x35085678,     //    ori t0, t0, 0x5678
+    0x01044821,     // 1: addu t1, t0, a0
+    0x00491026,     //    xor v0, v0, t1
+    0x000250C0,     //    sll t2, v0, 3
+    0x00025F42,     //    srl t3, v0, 29
+    0x014B1025,     //    or v0, t2, t3
+    0x0128602B,     //    sltu t4, t1, t0
+    0x004C1021,     //    addu v0, v0, t4
+    0x01024023,     //    subu t0, t0, v0
+    0x2484FFFF,     //    addiu a0, a0, -1
+    0x1480FFF6,     //    bnez a0, 1b
+    0x310D00FF,     //    andi t5, t0, 0xff
+    0x0000004C,     //    syscall 1
+};
+
+static const uint32_t memcpy_code[] =
+{
+    0x24020000,     //    li v0, 0
+    0x00A04025,     // 1: move t0, a1
+    0x00C04825,     //    move t1, a2
+    0x24AA4000,     //    addiu t2, a1, 0x4000
+    0x8D0B0000,     // 2: lw t3, 0(t0)
+    0x8D0C0004,     //    lw t4, 4(t0)
+    0x8D0D0008,     //    lw t5, 8(t0)
+    0x8D0E000C,     //    lw t6, 12(t0)
+    0xAD2B0000,     //    sw t3, 0(t1)
+    0xAD2C0004,     //    sw t4, 4(t1)
+    0xAD2D0008,     //    sw t5, 8(t1)
+    0xAD2E000C,     //    sw t6, 12(t1)
+    0x25080010,     //    addiu t0, t0, 16
+    0x150AFFF6,     //    bne t0, t2, 2b
+    0x25290010,     //    addiu t1, t1, 16
+    0x8D2BFFFC,     //    lw t3, -4(t1)
+    0xACA40000,     //    sw a0, 0(a1)
+    0x2484FFFF,     //    addiu a0, a0, -1
+    0x1480FFEE,     //    bnez a0, 1b
+    0x004B1021,     //    addu v0, v0, t3
+    0x0000004C,     //    syscall 1
+};
+
+static const uint32_t branchy_code[] =
+{
+    0x24020000,     //    li v0, 0
+    0x3C0892D6,     //    lui t0, 0x92D6
+    0x35088CA2,     //    ori t0, t0, 0x8CA2
+    0x00084B40,     // 1: sll t1, t0, 13
+    0x01094026,     //    xor t0, t0, t1
+    0x00084C42,     //    srl t1, t0, 17
+    0x01094026,     //    xor t0, t0, t1
+    0x00084940,     //    sll t1, t0, 5
+    0x01094026,     //    xor t0, t0, t1
+    0x310A0001,     //    andi t2, t0, 1
+    0x11400002,     //    beqz t2, 2f
+    0x310B0002,     //    andi t3, t0, 2
+    0x24420003,     //    addiu v0, v0, 3
+    0x11600002,     // 2: beqz t3, 3f
+    0x310C0004,     //    andi t4, t0, 4
+    0x38420055,     //    xori v0, v0, 0x55
+    0x15800002,     // 3: bnez t4, 4f
+    0x00000000,     //    nop
+    0x00021040,     //    sll v0, v0, 1
+    0x05000002,     // 4: bltz t0, 5f
+    0x00000000,     //    nop
+    0x2442FFFF,     //    addiu v0, v0, -1
+    0x2484FFFF,     // 5: addiu a0, a0, -1
+    0x1480FFEB,     //    bnez a0, 1b
+    0x00000000,     //    nop
+    0x0000004C,     //    syscall 1
+};
+
+static const uint32_t muldiv_code[] =
+{
+    0x24020001,     //    li v0, 1
+    0x3C089E37,     //    lui t0, 0x9E37
+    0x350879B9,     //    ori t0, t0, 0x79B9
+    0x01040019,     // 1: multu t0, a0
+    0x00004812,     //    mflo t1
+    0x00005010,     //    mfhi t2
+    0x012A0018,     //    mult t1, t2
+    0x00005812,     //    mflo t3
+    0x71096002,     //    mul t4, t0, t1
+    0x718A0000,     //    madd t4, t2
+    0x00006812,     //    mflo t5
+    0x348E0001,     //    ori t6, a0, 1
+    0x01AE001B,     //    divu zero, t5, t6
+    0x00007812,     //    mflo t7
+    0x016E001A,     //    div zero, t3, t6
+    0x0000C010,     //    mfhi t8
+    0x004F1021,     //    addu v0, v0, t7
+    0x00581026,     //    xor v0, v0, t8
+    0x2484FFFF,     //    addiu a0, a0, -1
+    0x1480FFEF,     //    bnez a0, 1b
+    0x010C4021,     //    addu t0, t0, t4
+    0x0000004C,     //    syscall 1
+};
+
+static const uint32_t unaligned_code[] =
+{
+    0x24020000,     //    li v0, 0
+    0x30880FF3,     // 1: andi t0, a0, 0xff3
+    0x01054021,     //    addu t0, t0, a1
+    0x89090004,     //    lwl t1, 4(t0)
+    0x99090001,     //    lwr t1, 1(t0)
+    0x890A0006,     //    lwl t2, 6(t0)
+    0x990A0003,     //    lwr t2, 3(t0)
+    0x00491021,     //    addu v0, v0, t1
+    0x004A1026,     //    xor v0, v0, t2
+    0xA9021005,     //    swl v0, 0x1005(t0)
+    0xB9021002,     //    swr v0, 0x1002(t0)
+    0x2484FFFF,     //    addiu a0, a0, -1
+    0x1480FFF4,     //    bnez a0, 1b
+    0x00000000,     //    nop
+    0x0000004C,     //    syscall 1
+};
+
+static const uint32_t pingpong_code[] =
+{
+    0x24020000,     //    li v0, 0
+    0x0000008C,     // 1: syscall 2
+    0x2484FFFF,     //    addiu a0, a0, -1
+    0x1480FFFD,     //    bnez a0, 1b
+    0x00000000,     //    nop
+    0x0000004C,     //    syscall 1
+};
+
+typedef struct
+{
+    const char *name;
+    const uint32_t *code;
+    uint32_t size;
+    uint32_t iters;
+#ifdef MIPSVM_BENCH_AOT
+    const mipsvm_native_t *natives;
+    const uint32_t *natives_num;
+#endif
+} workload_t;
+
+#ifdef MIPSVM_BENCH_AOT
+#define NATIVES(name) extern const mipsvm_native_t name##_natives[]; extern const uint32_t name##_natives_num;
+NATIVES(int_loop)
+NATIVES(memcpy)
+NATIVES(branchy)
+NATIVES(muldiv)
+NATIVES(unaligned)
+NATIVES(pingpong)
+
+#define WORKLOAD(name, iters) { #name, name##_code, sizeof(name##_code), iters, name##_natives, &name##_natives_num }
+#else
+#define WORKLOAD(name, iters) { #name, name##_code, sizeof(name##_code), iters }
+#endif
+
+static const workload_t workloads[] =
+{
+    WORKLOAD(int_loop, 2000000),
+    WORKLOAD(memcpy, 2000),
+    WORKLOAD(branchy, 1000000),
+    WORKLOAD(muldiv, 1000000),
+    WORKLOAD(unaligned, 2000000),
+    WORKLOAD(pingpong, 1000000),
+};
+
+typedef enum
+{
+    ENGINE_EXEC,        // mipsvm_exec per instruction
+    ENGINE_RUN,         // mipsvm_run, no caches
+    ENGINE_DCACHE,      // mipsvm_run with the decode cache, threaded if compiled with MIPSVM_THREADED
+    ENGINE_BLOCKS,      // block cache
+#ifdef MIPSVM_BENCH_AOT
+    ENGINE_AOT,         // block cache with the mips2c natives
+#endif
+#ifdef MIPSVM_JIT
+    ENGINE_JIT,
+#endif
+    ENGINES_NUM,
+} engine_t;
+
+static const char *const engine_names[] =
+{
+    "exec",
+    "run",
+#ifdef MIPSVM_THREADED
+    "threaded",
+#else
+    "dcache",
+#endif
+    "blocks",
+#ifdef MIPSVM_BENCH_AOT
+    "aot",
+#endif
+#ifdef MIPSVM_JIT
+    "jit",
+#endif
+};
+
+typedef enum
+{
+    MEMORY_CALLBACKS,   // every access via the iface
+    MEMORY_REGIONS,
+    MEMORY_TLB,
+    MEMORY_ICACHE,      // callbacks behind the instruction cache
+#ifdef MIPSVM_BENCH_SANDBOX
+    MEMORY_SANDBOX,
+#endif
+    MEMORIES_NUM,
+} memory_t;
+
+static const char *const memory_names[] =
+{
+    "callbacks",
+    "regions",
+    "tlb",
+    "icache",
+#ifdef MIPSVM_BENCH_SANDBOX
+    "sandbox",
+#endif
+};
+
+typedef struct
+{
+    uint64_t instrs;
+    uint64_t syscalls;
+    double seconds;
+    uint32_t instance_bytes;
+    uint32_t checksum;
+    bool ok;
+} result_t;
+
+static uint8_t mem[MEM_SIZE];
+
+static uint32_t readw(uint32_t addr)
+{
+    const uint8_t *p = &mem[addr % MEM_SIZE];
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint16_t readh(uint32_t addr)
+{
+    const uint8_t *p = &mem[addr % MEM_SIZE];
+    return p[0] | p[1] << 8;
+}
+
+static uint8_t readb(uint32_t addr)
+{
+    return mem[addr % MEM_SIZE];
+}
+
+static void writew(uint32_t addr, uint32_t data)
+{
+    uint8_t *p = &mem[addr % MEM_SIZE];
+    p[0] = data;
+    p[1] = data >> 8;
+    p[2] = data >> 16;
+    p[3] = data >> 24;
+}
+
+static void writeh(uint32_t addr, uint16_t data)
+{
+    uint8_t *p = &mem[addr % MEM_SIZE];
+    p[0] = data;
+    p[1] = data >> 8;
+}
+
+static void writeb(uint32_t addr, uint8_t data)
+{
+    mem[addr % MEM_SIZE] = data;
+}
+
+static const mipsvm_iface_t iface =
+{
+    .readw = readw,
+    .readh = readh,
+    .readb = readb,
+    .writew = writew,
+    .writeh = writeh,
+    .writeb = writeb,
+};
+
+static bool refill(uint32_t page, mipsvm_tlb_entry_t *e)
+{
+    e->mem = page < MEM_SIZE ? &mem[page] : 0;
+    e->writable = true;
+    return e->mem != 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void load(const workload_t *w)
+{
+    memset(mem, 0, sizeof(mem));
+    for (uint32_t i = 0; i < w->size / 4; i++)
+        writew(CODE_BASE + i * 4, w->code[i]);
+    for (uint32_t i = 0; i < BUF_B - BUF_A; i++)
+        mem[BUF_A + i] = i * 7 + (i >> 8);
+}
+
+static void bench(const workload_t *w, engine_t engine, memory_t memory, double scale, result_t *r)
+{
+    static mipsvm_t vm;
+    static mipsvm_decoded_t dcache[DCACHE_ENTRIES];
+    static mipsvm_block_t blocks[BLOCKS];
+    static mipsvm_tlb_entry_t tlb[TLB_ENTRIES];
+    static mipsvm_icache_t ic;
+    static uint32_t ic_tags[ICACHE_SETS * ICACHE_WAYS];
+    static uint8_t ic_data[ICACHE_SETS * ICACHE_WAYS * ICACHE_LINE];
+    static const mipsvm_region_t regions[] = { { 0, MEM_SIZE, mem, true } };
+
+    memset(r, 0, sizeof(*r));
+    load(w);
+
+    mipsvm_init(&vm, &iface, CODE_BASE);
+    vm.gpr[4] = w->iters * scale > 1 ? w->iters * scale : 1;
+    vm.gpr[5] = BUF_A;
+    vm.gpr[6] = BUF_B;
+    vm.gpr[29] = MEM_SIZE - 16;
+    r->instance_bytes = sizeof(vm);
+
+    if (memory == MEMORY_REGIONS)
+        mipsvm_set_regions(&vm, regions, 1);
+    if (memory == MEMORY_TLB)
+    {
+        mipsvm_set_tlb(&vm, tlb, TLB_ENTRIES, refill);
+        r->instance_bytes += sizeof(tlb);
+    }
+    if (memory == MEMORY_ICACHE)
+    {
+        mipsvm_set_icache(&vm, &ic, ic_tags, ic_data, ICACHE_LINE, ICACHE_SETS, ICACHE_WAYS);
+        r->instance_bytes += sizeof(ic) + sizeof(ic_tags) + sizeof(ic_data);
+    }
+#ifdef MIPSVM_BENCH_SANDBOX
+    static mipsvm_sandbox_t sb;     // reserved once, the address space is large
+    if (memory == MEMORY_SANDBOX)
+    {
+        if (! sb.base && (! mipsvm_sandbox_init(&sb) || ! mipsvm_sandbox_map(&sb, 0, MEM_SIZE, true)))
+            return;
+        memcpy(sb.base, mem, MEM_SIZE);
+        mipsvm_set_sandbox(&vm, &sb);
+    }
+#endif
+
+    if (engine == ENGINE_DCACHE)
+    {
+        mipsvm_set_decode_cache(&vm, dcache, DCACHE_ENTRIES);
+        r->instance_bytes += sizeof(dcache);
+    }
+    if (engine >= ENGINE_BLOCKS)
+    {
+        mipsvm_set_block_cache(&vm, blocks, BLOCKS);
+        r->instance_bytes += sizeof(blocks);
+    }
+#ifdef MIPSVM_BENCH_AOT
+    if (engine == ENGINE_AOT)
+        mipsvm_set_natives(&vm, w->natives, *w->natives_num);
+#endif
+#ifdef MIPSVM_JIT
+    static mipsvm_jit_t jit;
+    if (engine == ENGINE_JIT)
+    {
+        if (! mipsvm_jit_init(&jit, JIT_SIZE))
+            return;
+        mipsvm_set_jit(&vm, &jit);
+    }
+#endif
+
+    double start = now();
+    for (;;)
+    {
+        uint32_t n;
+        mipsvm_rc_t rc;
+
+        if (engine == ENGINE_EXEC)
+        {
+            rc = mipsvm_exec(&vm);
+            n = rc == MIPSVM_RC_OK;
+        }
+        else
+        {
+            rc = mipsvm_run(&vm, 1000000, &n);
+        }
+        r->instrs += n;
+
+        if (rc == MIPSVM_RC_OK)
+            continue;
+        if (rc != MIPSVM_RC_SYSCALL || mipsvm_get_callcode(&vm) != SYSCALL_PING)
+        {
+            r->ok = rc == MIPSVM_RC_SYSCALL && mipsvm_get_callcode(&vm) == SYSCALL_EXIT;
+            break;
+        }
+
+        vm.gpr[2] += vm.gpr[4];
+        r->syscalls++;
+    }
+    r->seconds = now() - start;
+    r->checksum = vm.gpr[2];
+
+#ifdef MIPSVM_JIT
+    if (engine == ENGINE_JIT)
+    {
+        r->instance_bytes += jit.used;
+        mipsvm_jit_free(&jit);
+    }
+#endif
+}
+
+static void print(const workload_t *w, engine_t engine, memory_t memory, const result_t *r)
+{
+    printf("{\"workload\": \"%s\", \"engine\": \"%s\", \"memory\": \"%s\", \"instrs\": %llu, \"seconds\": %.6f, "
+           "\"mips\": %.2f, \"syscalls\": %llu, ", w->name, engine_names[engine], memory_names[memory],
+           (unsigned long long) r->instrs, r->seconds, r->seconds > 0 ? r->instrs / r->seconds / 1e6 : 0,
+           (unsigned long long) r->syscalls);
+
+    if (r->syscalls)
+        printf("\"ns_per_syscall\": %.1f, ", r->seconds * 1e9 / r->syscalls);
+    else
+        printf("\"ns_per_syscall\": null, ");
+
+    printf("\"instance_bytes\": %u, \"checksum\": \"0x%08X\", \"ok\": %s}\n", r->instance_bytes, r->checksum,
+           r->ok ? "true" : "false");
+    fflush(stdout);
+}
+
+// writes the code images for mips2c
+static int dump(void)
+{
+    for (uint32_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        const workload_t *w = &workloads[i];
+        char name[64];
+
+        load(w);
+        snprintf(name, sizeof(name), "%s.bin", w->name);
+        FILE *f = fopen(name, "wb");
+        if (! f || fwrite(&mem[CODE_BASE], 1, w->size, f) != w->size || fclose(f))
+        {
+            fprintf(stderr, "can't write %s\n", name);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && ! strcmp(argv[1], "dump"))
+        return dump();
+
+    double scale = argc > 1 ? strtod(argv[1], 0) : 1;
+    const char *only = argc > 2 ? argv[2] : 0;
+    bool ok = true;
+
+    if (scale <= 0)
+    {
+        fprintf(stderr, "usage: %s [scale] [workload]\n", argv[0]);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        const workload_t *w = &workloads[i];
+        result_t ref = { 0 };
+
+        if (only && strcmp(only, w->name))
+            continue;
+
+        for (int e = 0; e < ENGINES_NUM; e++)
+        {
+            for (int m = 0; m < MEMORIES_NUM; m++)
+            {
+                result_t r;
+                bench(w, e, m, scale, &r);
+
+                // the first run is the reference for the rest
+                if (! e && ! m)
+                    ref = r;
+                r.ok = r.ok && r.instrs == ref.instrs && r.checksum == ref.checksum;
+
+                print(w, e, m, &r);
+                ok = ok && r.ok;
+            }
+        }
+    }
+
+    return ! ok;
+}
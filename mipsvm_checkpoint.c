@@ -0,0 +1,173 @@
+#define __MIPSVM_CHECKPOINT_C__
+
+// Incremental checkpoint. Store paths of the VM mark the written pages in the dirty bitmap (see mipsvm_set_dirty_map),
+// checkpoint streams the registers and the pages marked since the previous one (or all pages of the tracked range),
+// then clears the bitmap. Restore applies the stream, so the full checkpoint followed by the incremental ones in order
+// rebuilds the state.
+//
+// Stream, little-endian words:
+//   magic, version, flags, pc, branch_pc, branch_is_pending, code, lo, hi, gpr[32]
+//   page records: address | PAGE_ZERO (no data) or address followed by MIPSVM_PAGE_SIZE bytes
+//   END
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mipsvm.h"
+#include "mipsvm_checkpoint.h"
+
+#define MAGIC 0x5043564D    // "MVCP"
+#define VERSION 1
+#define FLAG_FULL 1
+#define PAGE_ZERO 2         // page addresses are aligned, low bits are free
+#define END 1
+#define REGS 38
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static bool write32(mipsvm_io_t write, void *user, uint32_t v)
+{
+    uint8_t buf[4];
+    put32(buf, v);
+    return write(user, buf, 4);
+}
+
+static bool read32(mipsvm_io_t read, void *user, uint32_t *v)
+{
+    uint8_t buf[4];
+    if (! read(user, buf, 4))
+        return 0;
+    *v = get32(buf);
+    return 1;
+}
+
+static bool write_page(mipsvm_t *ctx, uint32_t addr, mipsvm_io_t write, void *user)
+{
+    uint8_t data[MIPSVM_PAGE_SIZE];
+    uint32_t any = 0;
+
+    // read-only memory (code) never changes and could not be restored via the store path
+    if (! mipsvm_is_writable(ctx, addr))
+        return 1;
+
+    ctx->exception = 0;
+    for (uint32_t i = 0; i < MIPSVM_PAGE_SIZE; i += 4)
+    {
+        uint32_t w = mipsvm_readw(ctx, addr + i);
+        put32(data + i, w);
+        any |= w;
+    }
+
+    // not accessible, nothing to save
+    if (ctx->exception)
+    {
+        ctx->exception = 0;
+        return 1;
+    }
+
+    if (! any)
+        return write32(write, user, addr | PAGE_ZERO);
+
+    return write32(write, user, addr) && write(user, data, MIPSVM_PAGE_SIZE);
+}
+
+// streams the registers and the dirty pages (all pages of the tracked range if full). Dirty bitmap is cleared once the
+// whole stream is written, so the failed checkpoint is repeated with the same pages
+bool mipsvm_checkpoint(mipsvm_t *ctx, bool full, mipsvm_io_t write, void *user)
+{
+    if (! ctx->dirty)
+        return 0;
+
+    uint8_t hdr[(3 + REGS) * 4];
+    uint32_t words[3 + REGS] = { MAGIC, VERSION, full ? FLAG_FULL : 0, ctx->pc, ctx->branch_pc, ctx->branch_is_pending,
+                                 ctx->code, ctx->lo, ctx->hi };
+    memcpy(&words[9], ctx->gpr, sizeof(ctx->gpr));
+    for (uint32_t i = 0; i < 3 + REGS; i++)
+        put32(hdr + i * 4, words[i]);
+
+    if (! write(user, hdr, sizeof(hdr)))
+        return 0;
+
+    for (uint32_t i = 0; i < (ctx->dirty_pages + 31) / 32; i++)
+    {
+        uint32_t bits = full ? 0xFFFFFFFF : ctx->dirty[i];
+
+        for (uint32_t j = 0; bits && j < 32 && i * 32 + j < ctx->dirty_pages; j++, bits >>= 1)
+        {
+            if ((bits & 1) && ! write_page(ctx, ctx->dirty_base + ((i * 32 + j) << MIPSVM_PAGE_BITS), write, user))
+                return 0;
+        }
+    }
+
+    if (! write32(write, user, END))
+        return 0;
+
+    memset(ctx->dirty, 0, (ctx->dirty_pages + 31) / 32 * 4);
+    return 1;
+}
+
+// applies the checkpoint stream, clears the dirty bitmap
+bool mipsvm_checkpoint_restore(mipsvm_t *ctx, mipsvm_io_t read, void *user)
+{
+    uint8_t hdr[(3 + REGS) * 4];
+    uint32_t words[3 + REGS];
+
+    if (! read(user, hdr, sizeof(hdr)))
+        return 0;
+    for (uint32_t i = 0; i < 3 + REGS; i++)
+        words[i] = get32(hdr + i * 4);
+
+    if (words[0] != MAGIC || words[1] != VERSION)
+        return 0;
+
+    uint8_t data[MIPSVM_PAGE_SIZE];
+    uint32_t addr;
+
+    ctx->exception = 0;
+    while (read32(read, user, &addr) && addr != END)
+    {
+        bool zero = addr & PAGE_ZERO;
+        addr &= -MIPSVM_PAGE_SIZE;
+
+        if (zero)
+            memset(data, 0, sizeof(data));
+        else if (! read(user, data, MIPSVM_PAGE_SIZE))
+            return 0;
+
+        // via the store path, so the cached code of the page is dropped
+        for (uint32_t i = 0; i < MIPSVM_PAGE_SIZE; i += 4)
+            mipsvm_writew(ctx, addr + i, get32(data + i));
+
+        if (ctx->exception)
+        {
+            ctx->exception = 0;
+            return 0;
+        }
+    }
+
+    if (addr != END)
+        return 0;
+
+    ctx->pc = words[3];
+    ctx->branch_pc = words[4];
+    ctx->branch_is_pending = words[5];
+    ctx->code = words[6];
+    ctx->lo = words[7];
+    ctx->hi = words[8];
+    memcpy(ctx->gpr, &words[9], sizeof(ctx->gpr));
+
+    if (ctx->dirty)
+        memset(ctx->dirty, 0, (ctx->dirty_pages + 31) / 32 * 4);
+    return 1;
+}
@@ -0,0 +1,10 @@
+#ifndef __MIPSVM_CHECKPOINT_H__
+#define __MIPSVM_CHECKPOINT_H__
+// public, incremental checkpoint of the VM (mipsvm_checkpoint.c)
+
+#include "mipsvm.h"
+
+bool mipsvm_checkpoint(mipsvm_t *ctx, bool full, mipsvm_io_t write, void *user);
+bool mipsvm_checkpoint_restore(mipsvm_t *ctx, mipsvm_io_t read, void *user);
+
+#endif
@@ -0,0 +1,166 @@
+#define __MIPSVM_CQ_C__
+
+// Async host calls. The runner submits the paused script's syscall and gets the call with the token. Host completes the
+// calls from any thread, single or in batches: the batch is linked privately and published by the single CAS, so the
+// completion list is the lock-free stack. Runner grabs the whole list at once, restores the completion order and resumes
+// the scripts in bulk. Submit and drain are for the runner thread only, nothing is allocated.
+// Token changes every time the call is reused and is claimed by the single CAS, so the stale and duplicate completions
+// are rejected instead of resuming the wrong script.
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mipsvm.h"
+#include "mipsvm_cq.h"
+
+#define NOT_PENDING 0xFFFFFFFF  // never the token
+
+// publishes the chain first..last, returns true if the list was empty (runner may need the wakeup)
+static bool post(mipsvm_cq_t *q, mipsvm_call_t *first, mipsvm_call_t *last, uint32_t n)
+{
+    mipsvm_call_t *head = __atomic_load_n(&q->completed, __ATOMIC_RELAXED);
+
+    do
+        last->next = head;
+    while (! __atomic_compare_exchange_n(&q->completed, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_add_fetch(&q->stats.completed, n, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&q->stats.posts, 1, __ATOMIC_RELAXED);
+    return ! head;
+}
+
+// call of the token if it is pending, it is not anymore then
+static mipsvm_call_t *claim(mipsvm_cq_t *q, uint32_t token)
+{
+    mipsvm_call_t *c = &q->calls[token % q->calls_num];
+    uint32_t expected = token;
+
+    if (__atomic_compare_exchange_n(&c->pending, &expected, NOT_PENDING, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return c;
+
+    __atomic_add_fetch(&q->stats.rejected, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+void mipsvm_cq_init(mipsvm_cq_t *q, mipsvm_call_t *calls, uint32_t n_calls)
+{
+    memset(q, 0, sizeof(*q));
+    memset(calls, 0, sizeof(*calls) * n_calls);
+    q->calls = calls;
+    q->calls_num = n_calls;
+
+    for (uint32_t i = n_calls; i--;)
+    {
+        calls[i].token = i;
+        calls[i].pending = NOT_PENDING;
+        calls[i].next = q->free;
+        q->free = &calls[i];
+    }
+}
+
+// turns the syscall of the paused script into the call. Returns 0 if all calls are in flight
+mipsvm_call_t *mipsvm_cq_submit(mipsvm_cq_t *q, mipsvm_t *vm)
+{
+    mipsvm_call_t *c = q->free;
+
+    if (! c)
+        return 0;
+
+    q->free = c->next;
+    c->next = 0;
+    c->vm = vm;
+    c->code = mipsvm_get_callcode(vm);
+    memcpy(c->args, &vm->gpr[4], sizeof(c->args));
+    c->result[0] = 0;
+    c->result[1] = 0;
+
+    __atomic_store_n(&c->pending, c->token, __ATOMIC_RELEASE);
+
+    q->inflight++;
+    q->stats.submitted++;
+    return c;
+}
+
+// thread-safe. Returns true if the runner was idle, i.e. the completion list was empty. Token not in flight is
+// rejected (counted in stats.rejected)
+bool mipsvm_cq_complete(mipsvm_cq_t *q, uint32_t token, uint32_t v0, uint32_t v1)
+{
+    mipsvm_call_t *c = claim(q, token);
+
+    if (! c)
+        return 0;
+
+    c->result[0] = v0;
+    c->result[1] = v1;
+    return post(q, c, c, 1);
+}
+
+// thread-safe, publishes all completions at once. Tokens not in flight are rejected
+bool mipsvm_cq_complete_batch(mipsvm_cq_t *q, const mipsvm_cqe_t *cqes, uint32_t n)
+{
+    mipsvm_call_t *first = 0;
+    mipsvm_call_t *last = 0;
+    uint32_t posted = 0;
+
+    // linked newest first, same as the list itself
+    for (uint32_t i = 0; i < n; i++)
+    {
+        mipsvm_call_t *c = claim(q, cqes[i].token);
+        if (! c)
+            continue;
+
+        c->result[0] = cqes[i].v0;
+        c->result[1] = cqes[i].v1;
+        c->next = first;
+        first = c;
+        if (! last)
+            last = c;
+        posted++;
+    }
+
+    if (! posted)
+        return 0;
+
+    return post(q, first, last, posted);
+}
+
+// stores up to max_vms completed scripts to vms (results are already in v0/v1) and returns their number.
+// Scripts are returned in the completion order, the rest is kept for the next drain
+uint32_t mipsvm_cq_drain(mipsvm_cq_t *q, mipsvm_t **vms, uint32_t max_vms)
+{
+    if (! q->ready && __atomic_load_n(&q->completed, __ATOMIC_RELAXED))
+    {
+        mipsvm_call_t *c = __atomic_exchange_n(&q->completed, 0, __ATOMIC_ACQUIRE);
+
+        // reverse to the completion order
+        while (c)
+        {
+            mipsvm_call_t *next = c->next;
+            c->next = q->ready;
+            q->ready = c;
+            c = next;
+        }
+        q->stats.drains++;
+    }
+
+    uint32_t n = 0;
+
+    while (n < max_vms && q->ready)
+    {
+        mipsvm_call_t *c = q->ready;
+
+        q->ready = c->next;
+        c->vm->gpr[2] = c->result[0];
+        c->vm->gpr[3] = c->result[1];
+        vms[n++] = c->vm;
+
+        // next generation of the token, wraps before reaching NOT_PENDING
+        c->token = c->token < NOT_PENDING - q->calls_num ? c->token + q->calls_num : (uint32_t) (c - q->calls);
+        c->vm = 0;
+        c->next = q->free;
+        q->free = c;
+        q->inflight--;
+    }
+
+    return n;
+}
@@ -0,0 +1,55 @@
+#ifndef __MIPSVM_CQ_H__
+#define __MIPSVM_CQ_H__
+// public, submission/completion queue of the async host calls
+
+#include "mipsvm.h"
+
+// syscall in flight, memory is provided by the host
+typedef struct mipsvm_call
+{
+    mipsvm_t *vm;
+    uint32_t token;             // identifies the call for the completion: index in the call table + calls_num * reuse
+    uint32_t pending;           // token while the call waits for the completion, completed once only
+    uint32_t code;              // syscall index
+    uint32_t args[4];           // a0-a3 at the time of the syscall
+    uint32_t result[2];         // v0/v1 returned to the script
+    struct mipsvm_call *next;   // completion/free list link
+    void *user;
+} mipsvm_call_t;
+
+// completion posted by the host
+typedef struct
+{
+    uint32_t token;
+    uint32_t v0;
+    uint32_t v1;
+} mipsvm_cqe_t;
+
+typedef struct
+{
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t posts;             // single or batched completions
+    uint64_t drains;            // non-empty grabs of the completion list
+    uint64_t rejected;          // completions of the unknown, stale or already completed tokens
+} mipsvm_cq_stats_t;
+
+typedef struct
+{
+    mipsvm_call_t *calls;
+    uint32_t calls_num;
+    mipsvm_call_t *free;        // runner only
+    mipsvm_call_t *completed;   // posted by any thread, newest first
+    mipsvm_call_t *ready;       // runner only, drained in the completion order
+    uint32_t inflight;
+    mipsvm_cq_stats_t stats;
+    void *user;
+} mipsvm_cq_t;
+
+void mipsvm_cq_init(mipsvm_cq_t *q, mipsvm_call_t *calls, uint32_t n_calls);
+mipsvm_call_t *mipsvm_cq_submit(mipsvm_cq_t *q, mipsvm_t *vm);
+bool mipsvm_cq_complete(mipsvm_cq_t *q, uint32_t token, uint32_t v0, uint32_t v1);
+bool mipsvm_cq_complete_batch(mipsvm_cq_t *q, const mipsvm_cqe_t *cqes, uint32_t n);
+uint32_t mipsvm_cq_drain(mipsvm_cq_t *q, mipsvm_t **vms, uint32_t max_vms);
+
+#endif
@@ -0,0 +1,264 @@
+#define __MIPSVM_ELF_C__
+
+// ELF loader. File is mapped once, the read-only segments (code, constants) become the regions pointing into the mapping,
+// so nothing is read or copied on load. Writable segments are mapped privately over the anonymous zero range, the host
+// kernel copies the data page only when the script writes it, .bss pages are zero-filled when first touched.
+// Accepts the ELF32 little-endian MIPS executables.
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mipsvm.h"
+#include "mipsvm_elf.h"
+
+#define EHDR_SIZE 52
+#define PHDR_SIZE 32
+#define SHDR_SIZE 40
+#define SYM_SIZE 16
+
+#define ET_EXEC 2
+#define EM_MIPS 8
+#define PT_LOAD 1
+#define PF_W 2
+#define SHT_SYMTAB 2
+#define STT_FUNC 2
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t host_page(void)
+{
+    return (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t round_page(uint64_t size)
+{
+    uint64_t page = host_page();
+    return (size + page - 1) / page * page;
+}
+
+static bool in_file(const mipsvm_elf_t *elf, uint64_t offset, uint64_t size)
+{
+    return offset <= elf->file_size && size <= elf->file_size - offset;
+}
+
+// data pages are the private file mapping, the rest up to memsz is the anonymous zero range
+static uint8_t *map_segment(mipsvm_elf_t *elf, int fd, uint32_t offset, uint32_t filesz, uint32_t memsz, bool writable)
+{
+    uint64_t skip = offset % host_page();
+    uint64_t size = round_page(skip + memsz);
+
+    uint8_t *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+
+    elf->maps[elf->maps_num].addr = p;
+    elf->maps[elf->maps_num].size = size;
+    elf->maps_num++;
+
+    if (filesz)
+    {
+        if (mmap(p, skip + filesz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, offset - skip) == MAP_FAILED)
+            return 0;
+
+        // rest of the last data page is the file contents past the segment
+        uint64_t end = skip + filesz;
+        uint64_t page_end = round_page(end);
+        memset(p + end, 0, (page_end < size ? page_end : size) - end);
+    }
+
+    if (! writable && mprotect(p, size, PROT_READ))
+        return 0;
+
+    return p + skip;
+}
+
+static bool load_segments(mipsvm_elf_t *elf, int fd, const uint8_t *eh)
+{
+    uint32_t phoff = get32(eh + 28);
+    uint32_t phnum = get16(eh + 44);
+
+    if (get16(eh + 42) != PHDR_SIZE || ! in_file(elf, phoff, (uint64_t) phnum * PHDR_SIZE))
+        return 0;
+
+    for (uint32_t i = 0; i < phnum; i++)
+    {
+        const uint8_t *ph = elf->file + phoff + i * PHDR_SIZE;
+        uint32_t offset = get32(ph + 4);
+        uint32_t vaddr = get32(ph + 8);
+        uint32_t filesz = get32(ph + 16);
+        uint32_t memsz = get32(ph + 20);
+        bool writable = get32(ph + 24) & PF_W;
+
+        if (get32(ph) != PT_LOAD || ! memsz)
+            continue;
+
+        if (elf->regions_num == MIPSVM_ELF_REGIONS || vaddr % 4 || filesz > memsz || memsz > 0xFFFFFFFC ||
+            vaddr + (uint64_t) memsz > 0x100000000ULL || ! in_file(elf, offset, filesz))
+            return 0;
+
+        mipsvm_region_t *r = &elf->regions[elf->regions_num];
+        r->base = vaddr;
+        r->size = (memsz + 3) & ~3U;
+        r->writable = writable;
+
+        // read-only data is used in place, the tail word past the file end is not readable
+        if (! writable && filesz == memsz && in_file(elf, offset, r->size))
+            r->mem = elf->file + offset;
+        else
+            r->mem = map_segment(elf, fd, offset, filesz, r->size, writable);
+
+        if (! r->mem)
+            return 0;
+        elf->regions_num++;
+    }
+
+    return elf->regions_num;
+}
+
+static void find_symbols(mipsvm_elf_t *elf, const uint8_t *eh)
+{
+    uint32_t shoff = get32(eh + 32);
+    uint32_t shnum = get16(eh + 48);
+
+    if (! shoff || get16(eh + 46) != SHDR_SIZE || ! in_file(elf, shoff, (uint64_t) shnum * SHDR_SIZE))
+        return;
+
+    for (uint32_t i = 0; i < shnum; i++)
+    {
+        const uint8_t *sh = elf->file + shoff + i * SHDR_SIZE;
+        uint32_t link = get32(sh + 24);
+
+        if (get32(sh + 4) != SHT_SYMTAB || link >= shnum)
+            continue;
+
+        const uint8_t *str = elf->file + shoff + link * SHDR_SIZE;
+        uint32_t sym_offset = get32(sh + 16);
+        uint32_t sym_size = get32(sh + 20);
+        uint32_t str_offset = get32(str + 16);
+        uint32_t str_size = get32(str + 20);
+
+        // names are checked once here, the strtab ends with 0 so every name offset inside it is terminated
+        if (! in_file(elf, sym_offset, sym_size) || ! in_file(elf, str_offset, str_size) || ! str_size ||
+            elf->file[str_offset + str_size - 1])
+            return;
+
+        elf->symtab = elf->file + sym_offset;
+        elf->symbols_num = sym_size / SYM_SIZE;
+        elf->strtab = (const char *) elf->file + str_offset;
+        elf->strtab_size = str_size;
+        return;
+    }
+}
+
+// maps the script, sets the VM regions to its segments and pc to the entry point.
+// To add the host regions (stack, etc), append them to elf->regions and call mipsvm_set_regions again
+bool mipsvm_elf_load(mipsvm_elf_t *elf, mipsvm_t *ctx, const char *path)
+{
+    memset(elf, 0, sizeof(*elf));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (! fstat(fd, &st) && (uint64_t) st.st_size >= EHDR_SIZE)
+        map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map == MAP_FAILED)
+    {
+        close(fd);
+        return 0;
+    }
+
+    elf->file = map;
+    elf->file_size = st.st_size;
+
+    const uint8_t *eh = elf->file;
+    bool ok = ! memcmp(eh, "\x7F" "ELF", 4) && eh[4] == 1 && eh[5] == 1 && get16(eh + 16) == ET_EXEC &&
+              get16(eh + 18) == EM_MIPS && load_segments(elf, fd, eh);
+    close(fd);
+
+    if (! ok)
+    {
+        mipsvm_elf_free(elf);
+        return 0;
+    }
+
+    find_symbols(elf, eh);
+
+    elf->entry = get32(eh + 24);
+    mipsvm_set_regions(ctx, elf->regions, elf->regions_num);
+    ctx->pc = elf->entry;
+    return 1;
+}
+
+// unmaps the script. VM must not use the regions anymore
+void mipsvm_elf_free(mipsvm_elf_t *elf)
+{
+    for (uint32_t i = 0; i < elf->maps_num; i++)
+        munmap(elf->maps[i].addr, elf->maps[i].size);
+
+    if (elf->file)
+        munmap(elf->file, elf->file_size);
+
+    memset(elf, 0, sizeof(*elf));
+}
+
+// function containing the address, for the profiler. Offset from its start is stored to offset if not 0.
+// Symbols are scanned linearly, the hosts resolving many samples should resolve the unique addresses only
+const char *mipsvm_elf_symbol(const mipsvm_elf_t *elf, uint32_t addr, uint32_t *offset)
+{
+    const uint8_t *best = 0;
+
+    for (uint32_t i = 0; i < elf->symbols_num; i++)
+    {
+        const uint8_t *s = elf->symtab + i * SYM_SIZE;
+        uint32_t value = get32(s + 4);
+        uint32_t size = get32(s + 8);
+
+        if ((s[12] & 0xF) != STT_FUNC || value > addr || (size && addr - value >= size))
+            continue;
+
+        // sized symbol containing the address wins, otherwise the closest one below it
+        bool sized = size, best_sized = best && get32(best + 8);
+        if (! best || sized > best_sized || (sized == best_sized && value > get32(best + 4)))
+            best = s;
+    }
+
+    if (! best || get32(best) >= elf->strtab_size)
+        return 0;
+
+    if (offset)
+        *offset = addr - get32(best + 4);
+    return elf->strtab + get32(best);
+}
+
+// address of the named symbol
+bool mipsvm_elf_lookup(const mipsvm_elf_t *elf, const char *name, uint32_t *addr)
+{
+    for (uint32_t i = 0; i < elf->symbols_num; i++)
+    {
+        const uint8_t *s = elf->symtab + i * SYM_SIZE;
+        uint32_t n = get32(s);
+
+        if (n && n < elf->strtab_size && ! strcmp(elf->strtab + n, name) && get16(s + 14))
+        {
+            *addr = get32(s + 4);
+            return 1;
+        }
+    }
+    return 0;
+}
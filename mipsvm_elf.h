@@ -0,0 +1,34 @@
+#ifndef __MIPSVM_ELF_H__
+#define __MIPSVM_ELF_H__
+// public, ELF loader of the script (POSIX, mipsvm_elf.c)
+
+#include "mipsvm.h"
+
+// script loaded from the ELF file, segments are mapped from the file
+#define MIPSVM_ELF_REGIONS 16
+
+typedef struct
+{
+    uint8_t *file;              // whole file, read-only
+    uint64_t file_size;
+    uint32_t entry;
+    mipsvm_region_t regions[MIPSVM_ELF_REGIONS];    // segments, free entries may be used by the host (stack, etc)
+    uint32_t regions_num;
+    struct
+    {
+        void *addr;
+        uint64_t size;
+    } maps[MIPSVM_ELF_REGIONS]; // private mappings of the writable segments
+    uint32_t maps_num;
+    const uint8_t *symtab;      // in the file, 0 if stripped
+    uint32_t symbols_num;
+    const char *strtab;
+    uint32_t strtab_size;
+} mipsvm_elf_t;
+
+bool mipsvm_elf_load(mipsvm_elf_t *elf, mipsvm_t *ctx, const char *path);
+void mipsvm_elf_free(mipsvm_elf_t *elf);
+const char *mipsvm_elf_symbol(const mipsvm_elf_t *elf, uint32_t addr, uint32_t *offset);
+bool mipsvm_elf_lookup(const mipsvm_elf_t *elf, const char *name, uint32_t *addr);
+
+#endif
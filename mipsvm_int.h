@@ -0,0 +1,59 @@
+#ifndef __MIPSVM_INT_H__
+#define __MIPSVM_INT_H__
+// private, shared between the vm modules
+
+#include "mipsvm_sandbox.h"
+
+// Every instruction is decoded once to the handler index and the pre-extracted operands (mipsvm_decoded_t).
+// Handlers are listed here in the decoding order.
+#define OPS(X) \
+    X(reserved) \
+    X(mfhi) X(mflo) X(mthi) X(mtlo) X(jr) X(div) X(divu) X(mult) X(multu) \
+    X(movz) X(movn) X(slt) X(sltu) X(add) X(addu) X(and) X(nor) X(or) X(sllv) X(srav) X(srlv) X(sub) X(subu) X(xor) \
+    X(sll) X(srl) X(sra) X(jalr) X(break) X(rotr) X(rotrv) X(syscall) X(teq) X(tge) X(tgeu) X(tlt) X(tltu) X(tne) \
+    X(madd) X(maddu) X(msub) X(msubu) X(mul) X(clz) X(clo) \
+    X(seb) X(seh) X(wsbh) X(ext) X(ins) \
+    X(j) X(jal) \
+    X(bltz) X(bgez) X(bltzal) X(bgezal) X(teqi) X(tgei) X(tgeiu) X(tlti) X(tltiu) X(tnei) \
+    X(bgtz) X(blez) X(addi) X(addiu) X(andi) X(beq) X(bne) X(lb) X(lbu) X(lh) X(lhu) X(lui) X(lw) X(lwl) X(lwr) \
+    X(ori) X(sb) X(slti) X(sltiu) X(sh) X(sw) X(swl) X(swr) X(xori)
+
+#define OP_ENUM(name) OP_##name,
+enum { OPS(OP_ENUM) OPS_NUM };
+
+typedef void (*mipsvm_handler_t)(mipsvm_t *ctx, const mipsvm_decoded_t *d);
+
+extern const mipsvm_handler_t mipsvm_handlers[OPS_NUM];
+
+// VM accesses its memory, sandbox faults meanwhile are the script exceptions. Others are passed on to the host
+static inline void mipsvm_sandbox_enter(mipsvm_t *ctx)
+{
+    if (ctx->sandbox)
+        ctx->sandbox->active++;
+}
+
+static inline void mipsvm_sandbox_leave(mipsvm_t *ctx)
+{
+    if (ctx->sandbox)
+        ctx->sandbox->active--;
+}
+
+void mipsvm_decode(uint32_t instr, mipsvm_decoded_t *d);
+bool mipsvm_is_branch(int op);
+uint8_t mipsvm_fuel_class(int op);
+
+#ifdef MIPSVM_JIT
+#ifndef __x86_64__
+#error "MIPSVM_JIT is supported on x86-64 hosts only"
+#endif
+
+// block is compiled once executed that many times
+#ifndef MIPSVM_JIT_HOT
+#define MIPSVM_JIT_HOT 32
+#endif
+
+void mipsvm_jit_compile(mipsvm_t *ctx, mipsvm_block_t *b);
+void mipsvm_jit_invalidate(mipsvm_t *ctx, uint32_t addr);
+#endif
+
+#endif
@@ -0,0 +1,648 @@
+#define __MIPSVM_JIT_C__
+
+// Block jit for x86-64 (System V ABI).
+// Body of the hot block is compiled to the host code. ALU instructions are emitted natively, up to four most used guest
+// registers of the block are kept in the host registers. In the sandbox, aligned byte/halfword/word loads and stores are
+// emitted natively as well, as the host access at the sandbox base + address (faults are reported by the sandbox handler
+// as for the interpreter). Everything else (memory access of the other modes, lwl/lwr/swl/swr, mult/div, traps, etc)
+// is the call to the interpreter handler, so the memory goes through the regions, TLB or iface callbacks as usual.
+// Branch and delay slot ending the block are executed by the interpreter as usual.
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mipsvm.h"
+#include "mipsvm_int.h"
+#include "mipsvm_jit.h"
+
+#ifdef MIPSVM_JIT
+
+enum { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+#define GPR(r) (offsetof(mipsvm_t, gpr) + (r) * 4)
+#define EXIT_LEN 15     // length of the emit_exit sequence
+#define OP_MAX_LEN 384  // worst case code size of the single instruction, sandbox store with its handler fallback
+#define MAPPED_NUM 4
+
+static const int mapped_hosts[MAPPED_NUM] = { R12, R13, R14, R15 };
+
+typedef struct
+{
+    uint8_t *p;
+    uint8_t *end;
+    int8_t map[32];     // host register holding the guest one, -1 if not mapped
+    uint32_t dirty;     // mapped guest registers modified since the last spill
+} emit_t;
+
+static void emit8(emit_t *e, uint8_t b)
+{
+    *e->p++ = b;
+}
+
+static void emit32(emit_t *e, uint32_t v)
+{
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+static void emit64(emit_t *e, uint64_t v)
+{
+    memcpy(e->p, &v, 8);
+    e->p += 8;
+}
+
+static void emit_rex(emit_t *e, int w, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        emit8(e, rex);
+}
+
+// opc reg, [rbx + disp32] or opc [rbx + disp32], reg
+static void emit_mem(emit_t *e, uint8_t opc, int reg, uint32_t disp)
+{
+    emit_rex(e, 0, reg, EBX);
+    emit8(e, opc);
+    emit8(e, 0x80 | ((reg & 7) << 3) | EBX);
+    emit32(e, disp);
+}
+
+// opc rm, reg, 32 bit
+static void emit_rr(emit_t *e, uint8_t opc, int reg, int rm)
+{
+    emit_rex(e, 0, reg, rm);
+    emit8(e, opc);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// 0F opc reg, rm, 32 bit
+static void emit_rr0f(emit_t *e, uint8_t opc, int reg, int rm)
+{
+    emit_rex(e, 0, reg, rm);
+    emit8(e, 0x0F);
+    emit8(e, opc);
+    emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void emit_load_gpr(emit_t *e, int host, int r)
+{
+    if (r == 0)
+        emit_rr(e, 0x31, host, host);               // xor host, host
+    else if (e->map[r] >= 0)
+        emit_rr(e, 0x89, e->map[r], host);          // mov host, mapped
+    else
+        emit_mem(e, 0x8B, host, GPR(r));            // mov host, [gpr]
+}
+
+static void emit_store_gpr(emit_t *e, int r, int host)
+{
+    if (r == 0)
+        return;
+
+    if (e->map[r] >= 0)
+    {
+        emit_rr(e, 0x89, host, e->map[r]);          // mov mapped, host
+        e->dirty |= 1U << r;
+    }
+    else
+    {
+        emit_mem(e, 0x89, host, GPR(r));            // mov [gpr], host
+    }
+}
+
+static void emit_spill_regs(emit_t *e, uint32_t regs)
+{
+    for (int r = 1; r < 32; r++)
+    {
+        if (regs & (1U << r))
+            emit_mem(e, 0x89, e->map[r], GPR(r));
+    }
+}
+
+static void emit_spill(emit_t *e)
+{
+    emit_spill_regs(e, e->dirty);
+    e->dirty = 0;
+}
+
+static void emit_reload(emit_t *e)
+{
+    for (int r = 1; r < 32; r++)
+    {
+        if (e->map[r] >= 0)
+            emit_mem(e, 0x8B, e->map[r], GPR(r));
+    }
+}
+
+static void emit_prologue(emit_t *e)
+{
+    emit8(e, 0x53);                         // push rbx
+    emit8(e, 0x41); emit8(e, 0x54);         // push r12
+    emit8(e, 0x41); emit8(e, 0x55);         // push r13
+    emit8(e, 0x41); emit8(e, 0x56);         // push r14
+    emit8(e, 0x41); emit8(e, 0x57);         // push r15
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xFB);     // mov rbx, rdi
+    emit_reload(e);
+}
+
+// returns the index of the instruction block stopped at. Length is EXIT_LEN
+static void emit_exit(emit_t *e, uint32_t index)
+{
+    emit8(e, 0xB8);                         // mov eax, index
+    emit32(e, index);
+    emit8(e, 0x41); emit8(e, 0x5F);         // pop r15
+    emit8(e, 0x41); emit8(e, 0x5E);         // pop r14
+    emit8(e, 0x41); emit8(e, 0x5D);         // pop r13
+    emit8(e, 0x41); emit8(e, 0x5C);         // pop r12
+    emit8(e, 0x5B);                         // pop rbx
+    emit8(e, 0xC3);                         // ret
+}
+
+// exits unless the last compare was equal
+static void emit_exit_if_ne(emit_t *e, uint32_t index)
+{
+    emit8(e, 0x74);                         // je over the exit
+    emit8(e, EXIT_LEN);
+    emit_exit(e, index);
+}
+
+// exits with the mapped registers spilled unless the last compare was equal, they stay dirty on the way on
+static void emit_spill_exit_if_ne(emit_t *e, uint32_t index)
+{
+    emit8(e, 0x74);                         // je over the exit
+    uint8_t *over = e->p;
+    emit8(e, 0);
+    emit_spill_regs(e, e->dirty);
+    emit_exit(e, index);
+    *over = e->p - over - 1;
+}
+
+static void emit_handler_call(emit_t *e, mipsvm_block_t *b, int i)
+{
+    const mipsvm_decoded_t *d = &b->ops[i];
+
+    emit_spill(e);
+
+    emit8(e, 0xC7);                                     // mov dword [rbx + gpr0], 0
+    emit8(e, 0x83);
+    emit32(e, GPR(0));
+    emit32(e, 0);
+    if (d->op == OP_syscall)
+    {
+        emit8(e, 0xC7);                                 // mov dword [rbx + pc], pc of the next instruction
+        emit8(e, 0x83);
+        emit32(e, offsetof(mipsvm_t, pc));
+        emit32(e, d->pc + 4);
+    }
+    emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xDF);     // mov rdi, rbx
+    emit8(e, 0x48); emit8(e, 0xBE);                     // mov rsi, d
+    emit64(e, (uintptr_t) d);
+    emit8(e, 0x48); emit8(e, 0xB8);                     // mov rax, handler
+    emit64(e, (uintptr_t) mipsvm_handlers[d->op]);
+    emit8(e, 0xFF); emit8(e, 0xD0);                     // call rax
+
+    emit8(e, 0x83);                                     // cmp dword [rbx + exception], 0
+    emit8(e, 0xBB);
+    emit32(e, offsetof(mipsvm_t, exception));
+    emit8(e, 0);
+    emit_exit_if_ne(e, i);
+
+    // block may be dropped by the handler as in the interpreter: store to its own code, or the host (iface callback,
+    // inline syscall) rewriting the code or flushing the caches
+    emit8(e, 0x48); emit8(e, 0xB8);                     // mov rax, &b->pc
+    emit64(e, (uintptr_t) &b->pc);
+    emit8(e, 0x81); emit8(e, 0x38);                     // cmp dword [rax], pc
+    emit32(e, b->pc);
+    emit_exit_if_ne(e, i);
+
+    emit_reload(e);
+}
+
+// access size of the load/store compiled inline in the sandbox, 0 for the rest
+static int flat_size(const mipsvm_decoded_t *d)
+{
+    switch (d->op)
+    {
+    case OP_lb: case OP_lbu: case OP_sb:
+        return 1;
+    case OP_lh: case OP_lhu: case OP_sh:
+        return 2;
+    case OP_lw: case OP_sw:
+        return 4;
+    }
+    return 0;
+}
+
+// eax = rs + imm, the guest address
+static void emit_address(emit_t *e, const mipsvm_decoded_t *d)
+{
+    emit_load_gpr(e, EAX, d->rs);
+    emit8(e, 0x05);                         // add eax, imm
+    emit32(e, d->imm);
+}
+
+// sandbox load/store at flat + address. Misaligned access is left to the handler raising the address error
+static void emit_flat_access(emit_t *e, mipsvm_block_t *b, int i)
+{
+    const mipsvm_decoded_t *d = &b->ops[i];
+    int size = flat_size(d);
+    bool store = d->op == OP_sb || d->op == OP_sh || d->op == OP_sw;
+    uint32_t dirty = e->dirty;
+    uint8_t *slow = 0;
+
+    emit_address(e, d);
+    if (size > 1)
+    {
+        emit8(e, 0xA8);                     // test al, size - 1
+        emit8(e, size - 1);
+        emit8(e, 0x0F); emit8(e, 0x85);     // jnz slow
+        slow = e->p;
+        emit32(e, 0);
+    }
+
+    if (store)
+    {
+        // cached code of the word is dropped first as in the interpreter. Mapped registers are callee-saved
+        emit8(e, 0x89); emit8(e, 0xC6);                     // mov esi, eax
+        emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xDF);     // mov rdi, rbx
+        emit8(e, 0x48); emit8(e, 0xB8);                     // mov rax, mipsvm_jit_invalidate
+        emit64(e, (uintptr_t) mipsvm_jit_invalidate);
+        emit8(e, 0xFF); emit8(e, 0xD0);                     // call rax
+        emit_address(e, d);
+        emit_load_gpr(e, ECX, d->rt);
+    }
+
+    emit8(e, 0x48); emit8(e, 0x8B); emit8(e, 0x93);         // mov rdx, [rbx + flat]
+    emit32(e, offsetof(mipsvm_t, flat));
+
+    switch (d->op)
+    {
+    case OP_lb: emit8(e, 0x0F); emit8(e, 0xBE); break;      // movsx ecx, byte [rdx + rax]
+    case OP_lbu: emit8(e, 0x0F); emit8(e, 0xB6); break;     // movzx ecx, byte [rdx + rax]
+    case OP_lh: emit8(e, 0x0F); emit8(e, 0xBF); break;      // movsx ecx, word [rdx + rax]
+    case OP_lhu: emit8(e, 0x0F); emit8(e, 0xB7); break;     // movzx ecx, word [rdx + rax]
+    case OP_lw: emit8(e, 0x8B); break;                      // mov ecx, [rdx + rax]
+    case OP_sb: emit8(e, 0x88); break;                      // mov [rdx + rax], cl
+    case OP_sh: emit8(e, 0x66); emit8(e, 0x89); break;      // mov [rdx + rax], cx
+    case OP_sw: emit8(e, 0x89); break;                      // mov [rdx + rax], ecx
+    }
+    emit8(e, 0x0C); emit8(e, 0x02);
+
+    if (! store)
+        emit_store_gpr(e, d->rt, ECX);
+
+    // fault, the access was completed on the page mapped by the sandbox handler
+    emit8(e, 0x83);                                         // cmp dword [rbx + exception], 0
+    emit8(e, 0xBB);
+    emit32(e, offsetof(mipsvm_t, exception));
+    emit8(e, 0);
+    emit_spill_exit_if_ne(e, i);
+
+    if (store)
+    {
+        // store may invalidate the block itself
+        emit8(e, 0x48); emit8(e, 0xB8);                     // mov rax, &b->pc
+        emit64(e, (uintptr_t) &b->pc);
+        emit8(e, 0x81); emit8(e, 0x38);                     // cmp dword [rax], pc
+        emit32(e, b->pc);
+        emit_spill_exit_if_ne(e, i);
+    }
+
+    if (slow)
+    {
+        emit8(e, 0xE9);                                     // jmp done
+        uint8_t *done = e->p;
+        emit32(e, 0);
+
+        uint32_t rel = e->p - slow - 4;
+        memcpy(slow, &rel, 4);
+
+        // handler spills the registers dirty before the access and reloads them all, so the fast path state holds
+        uint32_t fast_dirty = e->dirty;
+        e->dirty = dirty;
+        emit_handler_call(e, b, i);
+        e->dirty = fast_dirty;
+
+        rel = e->p - done - 4;
+        memcpy(done, &rel, 4);
+    }
+}
+
+// rd = rs op rt
+static void emit_alu(emit_t *e, uint8_t opc, const mipsvm_decoded_t *d)
+{
+    emit_load_gpr(e, EAX, d->rs);
+    emit_load_gpr(e, ECX, d->rt);
+    emit_rr(e, opc, ECX, EAX);
+    emit_store_gpr(e, d->rd, EAX);
+}
+
+// rt = rs op imm, eax short forms
+static void emit_alu_imm(emit_t *e, uint8_t opc, const mipsvm_decoded_t *d)
+{
+    emit_load_gpr(e, EAX, d->rs);
+    emit8(e, opc);
+    emit32(e, d->imm);
+    emit_store_gpr(e, d->rt, EAX);
+}
+
+// rd = rt shift sa
+static void emit_shift(emit_t *e, uint8_t ext, const mipsvm_decoded_t *d)
+{
+    emit_load_gpr(e, EAX, d->rt);
+    emit8(e, 0xC1);
+    emit8(e, 0xC0 | (ext << 3));
+    emit8(e, d->sa);
+    emit_store_gpr(e, d->rd, EAX);
+}
+
+// rd = rt shift rs
+static void emit_shiftv(emit_t *e, uint8_t ext, const mipsvm_decoded_t *d)
+{
+    emit_load_gpr(e, ECX, d->rs);
+    emit_load_gpr(e, EAX, d->rt);
+    emit8(e, 0xD3);
+    emit8(e, 0xC0 | (ext << 3));
+    emit_store_gpr(e, d->rd, EAX);
+}
+
+// rd = rs cmp rt
+static void emit_set(emit_t *e, uint8_t setcc, const mipsvm_decoded_t *d)
+{
+    emit_load_gpr(e, EAX, d->rs);
+    emit_load_gpr(e, ECX, d->rt);
+    emit_rr(e, 0x31, EDX, EDX);             // xor edx, edx
+    emit_rr(e, 0x39, ECX, EAX);             // cmp eax, ecx
+    emit_rr0f(e, setcc, 0, EDX);            // setcc dl
+    emit_store_gpr(e, d->rd, EDX);
+}
+
+// rt = rs cmp imm
+static void emit_set_imm(emit_t *e, uint8_t setcc, const mipsvm_decoded_t *d)
+{
+    emit_load_gpr(e, EAX, d->rs);
+    emit_rr(e, 0x31, EDX, EDX);             // xor edx, edx
+    emit8(e, 0x3D);                         // cmp eax, imm
+    emit32(e, d->imm);
+    emit_rr0f(e, setcc, 0, EDX);            // setcc dl
+    emit_store_gpr(e, d->rt, EDX);
+}
+
+static void emit_movc(emit_t *e, uint8_t cmovcc, const mipsvm_decoded_t *d)
+{
+    emit_load_gpr(e, EAX, d->rd);
+    emit_load_gpr(e, ECX, d->rs);
+    emit_load_gpr(e, EDX, d->rt);
+    emit_rr(e, 0x85, EDX, EDX);             // test edx, edx
+    emit_rr0f(e, cmovcc, EAX, ECX);         // cmovcc eax, ecx
+    emit_store_gpr(e, d->rd, EAX);
+}
+
+// guest register written by the natively compiled instruction, -1 if instruction is not compiled natively
+static int native_dst(const mipsvm_decoded_t *d)
+{
+    switch (d->op)
+    {
+    case OP_addu: case OP_subu: case OP_and: case OP_or: case OP_xor: case OP_nor:
+    case OP_slt: case OP_sltu: case OP_sll: case OP_srl: case OP_sra:
+    case OP_sllv: case OP_srlv: case OP_srav: case OP_mul: case OP_movz: case OP_movn:
+    case OP_mfhi: case OP_mflo: case OP_seb: case OP_seh:
+        return d->rd;
+
+    case OP_addiu: case OP_andi: case OP_ori: case OP_xori: case OP_lui: case OP_slti: case OP_sltiu:
+        return d->rt;
+
+    case OP_mthi: case OP_mtlo:
+        return 0;
+    }
+    return -1;
+}
+
+static void emit_native(emit_t *e, const mipsvm_decoded_t *d)
+{
+    if (native_dst(d) == 0 && d->op != OP_mthi && d->op != OP_mtlo)
+        return;     // result is discarded, no side effects
+
+    switch (d->op)
+    {
+    case OP_addu: emit_alu(e, 0x01, d); break;
+    case OP_subu: emit_alu(e, 0x29, d); break;
+    case OP_and: emit_alu(e, 0x21, d); break;
+    case OP_or: emit_alu(e, 0x09, d); break;
+    case OP_xor: emit_alu(e, 0x31, d); break;
+
+    case OP_nor:
+        emit_load_gpr(e, EAX, d->rs);
+        emit_load_gpr(e, ECX, d->rt);
+        emit_rr(e, 0x09, ECX, EAX);         // or eax, ecx
+        emit8(e, 0xF7); emit8(e, 0xD0);     // not eax
+        emit_store_gpr(e, d->rd, EAX);
+        break;
+
+    case OP_slt: emit_set(e, 0x9C, d); break;   // setl
+    case OP_sltu: emit_set(e, 0x92, d); break;  // setb
+
+    case OP_sll: emit_shift(e, 4, d); break;
+    case OP_srl: emit_shift(e, 5, d); break;
+    case OP_sra: emit_shift(e, 7, d); break;
+    case OP_sllv: emit_shiftv(e, 4, d); break;
+    case OP_srlv: emit_shiftv(e, 5, d); break;
+    case OP_srav: emit_shiftv(e, 7, d); break;
+
+    case OP_mul:
+        emit_load_gpr(e, EAX, d->rs);
+        emit_load_gpr(e, ECX, d->rt);
+        emit_rr0f(e, 0xAF, EAX, ECX);       // imul eax, ecx
+        emit_store_gpr(e, d->rd, EAX);
+        break;
+
+    case OP_movz: emit_movc(e, 0x44, d); break;     // cmovz
+    case OP_movn: emit_movc(e, 0x45, d); break;     // cmovnz
+
+    case OP_mfhi:
+        emit_mem(e, 0x8B, EAX, offsetof(mipsvm_t, hi));
+        emit_store_gpr(e, d->rd, EAX);
+        break;
+
+    case OP_mflo:
+        emit_mem(e, 0x8B, EAX, offsetof(mipsvm_t, lo));
+        emit_store_gpr(e, d->rd, EAX);
+        break;
+
+    case OP_mthi:
+        emit_load_gpr(e, EAX, d->rs);
+        emit_mem(e, 0x89, EAX, offsetof(mipsvm_t, hi));
+        break;
+
+    case OP_mtlo:
+        emit_load_gpr(e, EAX, d->rs);
+        emit_mem(e, 0x89, EAX, offsetof(mipsvm_t, lo));
+        break;
+
+    case OP_seb:
+        emit_load_gpr(e, EAX, d->rt);
+        emit_rr0f(e, 0xBE, EAX, EAX);       // movsx eax, al
+        emit_store_gpr(e, d->rd, EAX);
+        break;
+
+    case OP_seh:
+        emit_load_gpr(e, EAX, d->rt);
+        emit_rr0f(e, 0xBF, EAX, EAX);       // movsx eax, ax
+        emit_store_gpr(e, d->rd, EAX);
+        break;
+
+    case OP_addiu: emit_alu_imm(e, 0x05, d); break;
+    case OP_andi: emit_alu_imm(e, 0x25, d); break;
+    case OP_ori: emit_alu_imm(e, 0x0D, d); break;
+    case OP_xori: emit_alu_imm(e, 0x35, d); break;
+
+    case OP_lui:
+        emit8(e, 0xB8);                     // mov eax, imm
+        emit32(e, d->imm);
+        emit_store_gpr(e, d->rt, EAX);
+        break;
+
+    case OP_slti: emit_set_imm(e, 0x9C, d); break;
+    case OP_sltiu: emit_set_imm(e, 0x92, d); break;
+    }
+}
+
+// maps the most used guest registers of the natively compiled instructions to the host registers
+static void map_registers(emit_t *e, const mipsvm_block_t *b, int body_len, bool flat)
+{
+    int uses[32] = { 0 };
+
+    memset(e->map, -1, sizeof(e->map));
+
+    for (int i = 0; i < body_len; i++)
+    {
+        const mipsvm_decoded_t *d = &b->ops[i];
+        if (flat && flat_size(d))
+        {
+            uses[d->rs]++;
+            uses[d->rt]++;
+            continue;
+        }
+        if (native_dst(d) < 0)
+            continue;
+        uses[d->rs]++;
+        uses[d->rt]++;
+        uses[d->rd]++;
+    }
+
+    uses[0] = 0;    // r0 is the constant
+    for (int m = 0; m < MAPPED_NUM; m++)
+    {
+        int best = 0;
+        for (int r = 1; r < 32; r++)
+        {
+            if (e->map[r] < 0 && uses[r] > uses[best])
+                best = r;
+        }
+        if (uses[best] < 2)
+            break;
+        e->map[best] = mapped_hosts[m];
+        uses[best] = 0;
+    }
+}
+
+// buffer is never writable and executable at once: the pages being emitted to are switched to RW and back to RX
+static bool jit_protect(mipsvm_jit_t *jit, uint32_t from, uint32_t to, int prot)
+{
+    from &= -(uint32_t) sysconf(_SC_PAGESIZE);     // length is rounded up to pages by mprotect
+    return mprotect(jit->code + from, to - from, prot) == 0;
+}
+
+static void jit_flush(mipsvm_t *ctx)
+{
+    for (uint32_t i = 0; i <= ctx->blocks_mask; i++)
+        ctx->blocks[i].native = 0;
+
+    ctx->jit->used = 0;
+    ctx->jit->flushes++;
+}
+
+void mipsvm_jit_compile(mipsvm_t *ctx, mipsvm_block_t *b)
+{
+    mipsvm_jit_t *jit = ctx->jit;
+    int body_len = b->len - (b->has_branch ? 2 : 0);
+    int n_native = 0;
+
+    for (int i = 0; i < body_len; i++)
+        n_native += native_dst(&b->ops[i]) >= 0 || (ctx->flat && flat_size(&b->ops[i]));
+
+    if (! n_native)     // nothing to gain
+        return;
+
+    uint32_t max_len = (body_len + 2) * OP_MAX_LEN;
+    if (max_len > jit->size)
+        return;
+    if (jit->size - jit->used < max_len)
+        jit_flush(ctx);
+
+    uint32_t from = jit->used;
+    if (! jit_protect(jit, from, from + max_len, PROT_READ | PROT_WRITE))
+        return;
+
+    emit_t e;
+    e.p = jit->code + jit->used;
+    e.end = e.p + max_len;
+    e.dirty = 0;
+    map_registers(&e, b, body_len, ctx->flat != 0);
+
+    uint8_t *start = e.p;
+    emit_prologue(&e);
+
+    for (int i = 0; i < body_len; i++)
+    {
+        if (native_dst(&b->ops[i]) >= 0)
+            emit_native(&e, &b->ops[i]);
+        else if (ctx->flat && flat_size(&b->ops[i]))
+            emit_flat_access(&e, b, i);
+        else
+            emit_handler_call(&e, b, i);
+    }
+
+    emit_spill(&e);
+    emit_exit(&e, body_len);
+
+    if (! jit_protect(jit, from, from + max_len, PROT_READ | PROT_EXEC))
+    {
+        jit_flush(ctx);     // blocks sharing the pages can't run anymore
+        return;
+    }
+
+    jit->used += e.p - start;
+    jit->compiled++;
+    b->native = (uint32_t (*)(mipsvm_t *)) start;
+}
+
+bool mipsvm_jit_init(mipsvm_jit_t *jit, uint32_t size)
+{
+    memset(jit, 0, sizeof(*jit));
+
+    void *p = mmap(0, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+
+    jit->code = p;
+    jit->size = size;
+    return 1;
+}
+
+void mipsvm_jit_free(mipsvm_jit_t *jit)
+{
+    if (jit->code)
+        munmap(jit->code, jit->size);
+    memset(jit, 0, sizeof(*jit));
+}
+
+void mipsvm_set_jit(mipsvm_t *ctx, mipsvm_jit_t *jit)
+{
+    ctx->jit = jit;
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef __MIPSVM_JIT_H__
+#define __MIPSVM_JIT_H__
+// public, block JIT (x86-64, mipsvm_jit.c compiled with MIPSVM_JIT)
+
+#include "mipsvm.h"
+
+// jit code buffer
+typedef struct mipsvm_jit
+{
+    uint8_t *code;
+    uint32_t size;
+    uint32_t used;
+    uint32_t compiled;          // blocks compiled
+    uint32_t flushes;           // buffer overflows, all compiled blocks are dropped
+} mipsvm_jit_t;
+
+bool mipsvm_jit_init(mipsvm_jit_t *jit, uint32_t size);
+void mipsvm_jit_free(mipsvm_jit_t *jit);
+void mipsvm_set_jit(mipsvm_t *ctx, mipsvm_jit_t *jit);
+
+#endif
@@ -0,0 +1,219 @@
+#define __MIPSVM_PCACHE_C__
+
+// Persistent translation cache. Decode and block caches of the VM are saved as is, with the host pointers cleared, and
+// mapped back by the restarted host: the mapping becomes the cache, nothing is parsed or copied. Blocks keep their
+// hit counts, so the hot ones get compiled by the JIT once executed again.
+// File is keyed by the hash of the code image, and rejected on the mismatch of the hash, format version, handler table or
+// structure layout. Contents are range-checked on load, so the damaged file never makes the VM index out of its tables.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mipsvm.h"
+#include "mipsvm_int.h"
+#include "mipsvm_pcache.h"
+
+#define MAGIC 0x4342564D    // "MVBC", byte order check as well
+#define VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;              // code image
+    uint64_t ops_hash;          // handler table the ops are indexed by
+    uint32_t block_size;        // structure layout
+    uint32_t decoded_size;
+    uint32_t block_len;
+    uint32_t blocks_num;        // power of 2 or 0
+    uint32_t decoded_num;
+    uint32_t reserved;
+    uint64_t blocks_offset;
+    uint64_t decoded_offset;
+} header_t;
+
+#define OP_NAME(name) #name " "
+static const char ops_names[] = OPS(OP_NAME);
+
+static uint64_t fnv1a(const uint8_t *p, uint32_t size)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    while (size--)
+    {
+        h ^= *p++;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+static void fill_header(header_t *h, const mipsvm_t *ctx, uint64_t hash)
+{
+    memset(h, 0, sizeof(*h));
+    h->magic = MAGIC;
+    h->version = VERSION;
+    h->hash = hash;
+    h->ops_hash = fnv1a((const uint8_t *) ops_names, sizeof(ops_names));
+    h->block_size = sizeof(mipsvm_block_t);
+    h->decoded_size = sizeof(mipsvm_decoded_t);
+    h->block_len = MIPSVM_BLOCK_LEN;
+
+    if (ctx)
+    {
+        h->blocks_num = ctx->blocks ? ctx->blocks_mask + 1 : 0;
+        h->decoded_num = ctx->dcache ? ctx->dcache_mask + 1 : 0;
+        h->blocks_offset = sizeof(header_t);
+        h->decoded_offset = h->blocks_offset + (uint64_t) h->blocks_num * sizeof(mipsvm_block_t);
+    }
+}
+
+static bool valid_decoded(const mipsvm_decoded_t *d)
+{
+    return d->op < OPS_NUM && d->rs < 32 && d->rt < 32 && d->rd < 32 && d->sa < 32;
+}
+
+static bool valid_block(const mipsvm_block_t *b)
+{
+    if (b->pc == MIPSVM_DECODED_FREE)
+        return 1;
+
+    if (b->pc % 4 || ! b->len || b->len > MIPSVM_BLOCK_LEN || b->has_branch > 1 || (b->has_branch && b->len < 2))
+        return 0;
+
+    for (uint32_t i = 0; i < b->len; i++)
+        if (! valid_decoded(&b->ops[i]) || b->ops[i].pc != b->pc + i * 4)
+            return 0;
+
+    return 1;
+}
+
+static bool is_pow2(uint32_t n)
+{
+    return ! (n & (n - 1));
+}
+
+// key of the cache file, image is the script code as loaded to the VM
+uint64_t mipsvm_pcache_hash(const void *image, uint32_t size)
+{
+    return fnv1a(image, size);
+}
+
+// writes the decode and block caches of the VM, the file is replaced atomically
+bool mipsvm_pcache_save(const mipsvm_t *ctx, const char *path, uint64_t hash)
+{
+    char tmp[4096];
+    header_t h;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp))
+        return 0;
+
+    FILE *f = fopen(tmp, "wb");
+    if (! f)
+        return 0;
+
+    fill_header(&h, ctx, hash);
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+
+    for (uint32_t i = 0; ok && i < h.blocks_num; i++)
+    {
+        mipsvm_block_t b = ctx->blocks[i];
+
+        b.link[0] = 0;
+        b.link[1] = 0;
+        b.native = 0;
+        b.aot = 0;
+        ok = fwrite(&b, sizeof(b), 1, f) == 1;
+    }
+
+    if (ok && h.decoded_num)
+        ok = fwrite(ctx->dcache, sizeof(mipsvm_decoded_t), h.decoded_num, f) == h.decoded_num;
+
+    ok = ! fclose(f) && ok;
+    if (ok)
+        ok = ! rename(tmp, path);
+    if (! ok)
+        remove(tmp);
+    return ok;
+}
+
+// maps the file and sets its caches for the VM. Returns false if there is no file for this image, format or build
+bool mipsvm_pcache_load(mipsvm_pcache_t *pc, mipsvm_t *ctx, const char *path, uint64_t hash)
+{
+    memset(pc, 0, sizeof(*pc));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (! fstat(fd, &st) && (uint64_t) st.st_size >= sizeof(header_t))
+        map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return 0;
+
+    pc->map = map;
+    pc->map_size = st.st_size;
+
+    const header_t *h = map;
+    header_t expected;
+    fill_header(&expected, 0, hash);
+
+    bool ok = h->magic == expected.magic && h->version == expected.version && h->hash == expected.hash &&
+              h->ops_hash == expected.ops_hash && h->block_size == expected.block_size &&
+              h->decoded_size == expected.decoded_size && h->block_len == expected.block_len &&
+              is_pow2(h->blocks_num) && is_pow2(h->decoded_num) &&
+              h->blocks_offset == sizeof(header_t) &&
+              h->decoded_offset == h->blocks_offset + (uint64_t) h->blocks_num * sizeof(mipsvm_block_t) &&
+              h->decoded_offset + (uint64_t) h->decoded_num * sizeof(mipsvm_decoded_t) == pc->map_size;
+
+    mipsvm_block_t *blocks = (mipsvm_block_t *) ((uint8_t *) map + h->blocks_offset);
+    mipsvm_decoded_t *decoded = (mipsvm_decoded_t *) ((uint8_t *) map + h->decoded_offset);
+
+    for (uint32_t i = 0; ok && i < h->blocks_num; i++)
+        ok = valid_block(&blocks[i]);
+
+    for (uint32_t i = 0; ok && i < h->decoded_num; i++)
+        ok = decoded[i].pc == MIPSVM_DECODED_FREE || (decoded[i].pc % 4 == 0 && valid_decoded(&decoded[i]));
+
+    if (! ok)
+    {
+        mipsvm_pcache_unload(pc, 0);
+        return 0;
+    }
+
+    if (h->decoded_num)
+    {
+        ctx->dcache = decoded;
+        ctx->dcache_mask = h->decoded_num - 1;
+    }
+    if (h->blocks_num)
+        mipsvm_attach_block_cache(ctx, blocks, h->blocks_num);
+
+    return 1;
+}
+
+// detaches the mapped caches from the VM and unmaps the file
+void mipsvm_pcache_unload(mipsvm_pcache_t *pc, mipsvm_t *ctx)
+{
+    if (! pc->map)
+        return;
+
+    uint8_t *lo = pc->map;
+    uint8_t *hi = lo + pc->map_size;
+
+    if (ctx && (uint8_t *) ctx->blocks >= lo && (uint8_t *) ctx->blocks < hi)
+        mipsvm_set_block_cache(ctx, 0, 0);
+    if (ctx && (uint8_t *) ctx->dcache >= lo && (uint8_t *) ctx->dcache < hi)
+        mipsvm_set_decode_cache(ctx, 0, 0);
+
+    munmap(pc->map, pc->map_size);
+    memset(pc, 0, sizeof(*pc));
+}
@@ -0,0 +1,19 @@
+#ifndef __MIPSVM_PCACHE_H__
+#define __MIPSVM_PCACHE_H__
+// public, persistent translation cache (POSIX, mipsvm_pcache.c)
+
+#include "mipsvm.h"
+
+// persistent translation cache, mapped from the file
+typedef struct
+{
+    void *map;
+    uint64_t map_size;
+} mipsvm_pcache_t;
+
+uint64_t mipsvm_pcache_hash(const void *image, uint32_t size);
+bool mipsvm_pcache_save(const mipsvm_t *ctx, const char *path, uint64_t hash);
+bool mipsvm_pcache_load(mipsvm_pcache_t *pc, mipsvm_t *ctx, const char *path, uint64_t hash);
+void mipsvm_pcache_unload(mipsvm_pcache_t *pc, mipsvm_t *ctx);
+
+#endif
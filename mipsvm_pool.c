@@ -0,0 +1,301 @@
+#define __MIPSVM_POOL_C__
+
+// Executor pool. Every worker thread owns the deque of the ready tasks: it runs the newest task for its quantum and
+// puts it back behind the other ready tasks of the worker, so they take turns and the task stays on the same worker
+// (and core) while it has the work. Idle worker steals the oldest task of the other one. Workers with nothing to run or steal sleep until the task is queued.
+// Wake may come from any thread, including the one racing with the handler which is blocking the task.
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "mipsvm.h"
+#include "mipsvm_sched.h"
+#include "mipsvm_pool.h"
+
+#define MASK (MIPSVM_POOL_DEQUE - 1)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// new and woken tasks go to the newest end, run ones to the oldest end so they do not starve the rest
+static void push(mipsvm_pool_t *p, uint32_t worker, mipsvm_pool_task_t *t, bool oldest)
+{
+    mipsvm_pool_worker_t *w = &p->workers[worker];
+
+    t->worker = worker;
+    __atomic_store_n(&t->task.state, MIPSVM_TASK_READY, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&w->lock);
+    if (oldest)
+        w->slots[--w->top & MASK] = t;
+    else
+        w->slots[w->bottom++ & MASK] = t;
+    pthread_mutex_unlock(&w->lock);
+
+    __atomic_add_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->sleepers, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&p->idle_lock);
+        pthread_cond_broadcast(&p->idle_cond);
+        pthread_mutex_unlock(&p->idle_lock);
+    }
+}
+
+static mipsvm_pool_task_t *pop(mipsvm_pool_t *p, mipsvm_pool_worker_t *w)
+{
+    mipsvm_pool_task_t *t = 0;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom != w->top)
+        t = w->slots[--w->bottom & MASK];
+    pthread_mutex_unlock(&w->lock);
+
+    if (t)
+        __atomic_sub_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+    return t;
+}
+
+static mipsvm_pool_task_t *steal(mipsvm_pool_t *p, mipsvm_pool_worker_t *thief)
+{
+    for (uint32_t i = 1; i < p->workers_num; i++)
+    {
+        mipsvm_pool_worker_t *w = &p->workers[(thief->id + i) % p->workers_num];
+        mipsvm_pool_task_t *t = 0;
+
+        if (__atomic_load_n(&w->bottom, __ATOMIC_RELAXED) == __atomic_load_n(&w->top, __ATOMIC_RELAXED))
+            continue;
+
+        pthread_mutex_lock(&w->lock);
+        if (w->bottom != w->top)
+        {
+            t = w->slots[w->top++ & MASK];
+            w->stats.stolen++;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        if (t)
+        {
+            __atomic_sub_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+            thief->stats.steals++;
+            return t;
+        }
+    }
+
+    return 0;
+}
+
+static void sleep_idle(mipsvm_pool_t *p)
+{
+    pthread_mutex_lock(&p->idle_lock);
+    __atomic_add_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+    while (! p->stop && ! __atomic_load_n(&p->queued, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&p->idle_cond, &p->idle_lock);
+    __atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&p->idle_lock);
+}
+
+static void finish(mipsvm_pool_t *p, mipsvm_pool_task_t *t)
+{
+    __atomic_store_n(&t->task.state, MIPSVM_TASK_FINISHED, __ATOMIC_SEQ_CST);
+
+    if (__atomic_sub_fetch(&p->live, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        pthread_mutex_lock(&p->idle_lock);
+        pthread_cond_broadcast(&p->idle_cond);
+        pthread_mutex_unlock(&p->idle_lock);
+    }
+}
+
+// requeues the woken task, results are passed in v0/v1
+static void resume(mipsvm_pool_t *p, mipsvm_pool_task_t *t)
+{
+    t->wake_pending = 0;
+    t->task.vm->gpr[2] = t->wake[0];
+    t->task.vm->gpr[3] = t->wake[1];
+    push(p, t->worker, t, 0);
+}
+
+static void block(mipsvm_pool_t *p, mipsvm_pool_task_t *t)
+{
+    mipsvm_task_state_t blocked = MIPSVM_TASK_BLOCKED;
+
+    __atomic_store_n(&t->task.state, MIPSVM_TASK_BLOCKED, __ATOMIC_SEQ_CST);
+
+    // wake came while the task was still running
+    if (__atomic_load_n(&t->wake_pending, __ATOMIC_SEQ_CST) &&
+        __atomic_compare_exchange_n(&t->task.state, &blocked, MIPSVM_TASK_RUNNING, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        resume(p, t);
+}
+
+static void run_slice(mipsvm_pool_t *p, mipsvm_pool_worker_t *w, mipsvm_pool_task_t *t)
+{
+    uint32_t n;
+
+    __atomic_store_n(&t->task.state, MIPSVM_TASK_RUNNING, __ATOMIC_SEQ_CST);
+    mipsvm_rc_t rc = mipsvm_run(t->task.vm, t->task.quantum, &n);
+
+    t->task.retired += n;
+    t->task.slices++;
+    w->stats.slices++;
+
+    if (rc == MIPSVM_RC_OK)
+    {
+        push(p, w->id, t, 1);
+        return;
+    }
+
+    t->task.rc = rc;
+    mipsvm_task_state_t state = p->handler ? p->handler(p, t, rc) : MIPSVM_TASK_FINISHED;
+
+    if (state == MIPSVM_TASK_READY)
+        push(p, w->id, t, 1);
+    else if (state == MIPSVM_TASK_BLOCKED)
+        block(p, t);
+    else
+        finish(p, t);
+}
+
+static void *worker_main(void *arg)
+{
+    mipsvm_pool_worker_t *w = arg;
+    mipsvm_pool_t *p = w->pool;
+    uint64_t t0 = now_ns();
+
+    while (! __atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+    {
+        mipsvm_pool_task_t *t = pop(p, w);
+        if (! t)
+            t = steal(p, w);
+
+        uint64_t t1 = now_ns();
+        w->stats.idle_ns += t1 - t0;
+        t0 = t1;
+
+        if (! t)
+        {
+            sleep_idle(p);
+            continue;
+        }
+
+        run_slice(p, w, t);
+
+        t1 = now_ns();
+        w->stats.busy_ns += t1 - t0;
+        t0 = t1;
+    }
+
+    return 0;
+}
+
+bool mipsvm_pool_start(mipsvm_pool_t *p, mipsvm_pool_worker_t *workers, uint32_t n_workers, mipsvm_pool_handler_t handler)
+{
+    memset(p, 0, sizeof(*p));
+    p->workers = workers;
+    p->workers_num = n_workers;
+    p->handler = handler;
+    pthread_mutex_init(&p->idle_lock, 0);
+    pthread_cond_init(&p->idle_cond, 0);
+
+    for (uint32_t i = 0; i < n_workers; i++)
+    {
+        memset(&workers[i], 0, sizeof(workers[i]));
+        workers[i].id = i;
+        workers[i].pool = p;
+        pthread_mutex_init(&workers[i].lock, 0);
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (uint32_t i = 0; i < n_workers; i++)
+    {
+        if (pthread_create(&workers[i].thread, 0, worker_main, &workers[i]))
+        {
+            p->workers_num = i;
+            mipsvm_pool_stop(p);
+            return 0;
+        }
+
+#ifdef __linux__
+        // worker keeps its tasks, so keep the worker on its core
+        if (cpus > 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(i % cpus, &set);
+            pthread_setaffinity_np(workers[i].thread, sizeof(set), &set);
+        }
+#else
+        (void) cpus;
+#endif
+    }
+
+    return 1;
+}
+
+// thread-safe. Returns false if the pool is full
+bool mipsvm_pool_add(mipsvm_pool_t *p, mipsvm_pool_task_t *t, mipsvm_t *vm, uint32_t quantum)
+{
+    if (__atomic_add_fetch(&p->live, 1, __ATOMIC_SEQ_CST) > MIPSVM_POOL_DEQUE)
+    {
+        __atomic_sub_fetch(&p->live, 1, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+
+    void *user = t->task.user;
+    memset(t, 0, sizeof(*t));
+    t->task.vm = vm;
+    t->task.quantum = quantum;
+    t->task.user = user;
+
+    push(p, __atomic_fetch_add(&p->next_worker, 1, __ATOMIC_RELAXED) % p->workers_num, t, 0);
+    return 1;
+}
+
+// thread-safe, may be called before the handler blocking the task has returned
+void mipsvm_pool_wake(mipsvm_pool_t *p, mipsvm_pool_task_t *t, uint32_t v0, uint32_t v1)
+{
+    mipsvm_task_state_t blocked = MIPSVM_TASK_BLOCKED;
+
+    t->wake[0] = v0;
+    t->wake[1] = v1;
+    __atomic_store_n(&t->wake_pending, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_compare_exchange_n(&t->task.state, &blocked, MIPSVM_TASK_RUNNING, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        resume(p, t);
+}
+
+// waits until all tasks are finished
+void mipsvm_pool_wait(mipsvm_pool_t *p)
+{
+    pthread_mutex_lock(&p->idle_lock);
+    while (__atomic_load_n(&p->live, __ATOMIC_SEQ_CST))
+        pthread_cond_wait(&p->idle_cond, &p->idle_lock);
+    pthread_mutex_unlock(&p->idle_lock);
+}
+
+void mipsvm_pool_stop(mipsvm_pool_t *p)
+{
+    pthread_mutex_lock(&p->idle_lock);
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&p->idle_cond);
+    pthread_mutex_unlock(&p->idle_lock);
+
+    for (uint32_t i = 0; i < p->workers_num; i++)
+        pthread_join(p->workers[i].thread, 0);
+}
+
+// ready tasks queued on the worker
+uint32_t mipsvm_pool_depth(mipsvm_pool_t *p, uint32_t worker)
+{
+    mipsvm_pool_worker_t *w = &p->workers[worker];
+    return __atomic_load_n(&w->bottom, __ATOMIC_RELAXED) - __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+}
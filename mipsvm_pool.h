@@ -0,0 +1,71 @@
+#ifndef __MIPSVM_POOL_H__
+#define __MIPSVM_POOL_H__
+// public, multithreaded executor of the VM instances (pthreads)
+
+#include <pthread.h>
+#include "mipsvm.h"
+#include "mipsvm_sched.h"
+
+// capacity of the worker deque, max tasks in the pool
+#ifndef MIPSVM_POOL_DEQUE
+#define MIPSVM_POOL_DEQUE 4096
+#endif
+
+typedef struct
+{
+    uint64_t busy_ns;       // running the scripts and the handler
+    uint64_t idle_ns;       // looking for the work or sleeping
+    uint64_t slices;
+    uint64_t steals;        // tasks taken from the other workers
+    uint64_t stolen;        // tasks taken by the other workers
+} mipsvm_pool_stats_t;
+
+struct mipsvm_pool;
+
+// task of the pool, memory is provided by the host
+typedef struct
+{
+    mipsvm_task_t task;         // vm, quantum, state and the counters as for the scheduler
+    uint32_t worker;            // last worker, the task returns there
+    uint32_t wake[2];           // v0/v1 passed to the wake racing with the handler
+    int wake_pending;
+} mipsvm_pool_task_t;
+
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    mipsvm_pool_task_t *slots[MIPSVM_POOL_DEQUE];
+    uint32_t top;           // thieves take the oldest task here, preempted tasks are put back here
+    uint32_t bottom;        // owner pushes the new tasks and pops here
+    uint32_t id;
+    struct mipsvm_pool *pool;
+    mipsvm_pool_stats_t stats;
+} mipsvm_pool_worker_t;
+
+// called on the script exception in the worker thread, returns the next state of the task
+typedef mipsvm_task_state_t (*mipsvm_pool_handler_t)(struct mipsvm_pool *p, mipsvm_pool_task_t *t, mipsvm_rc_t rc);
+
+typedef struct mipsvm_pool
+{
+    mipsvm_pool_worker_t *workers;
+    uint32_t workers_num;
+    mipsvm_pool_handler_t handler;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;       // sleeping workers, also waiters for the finished tasks
+    uint32_t queued;                // tasks in the deques
+    uint32_t sleepers;
+    uint32_t live;                  // tasks not finished
+    uint32_t next_worker;           // round-robin placement of the new tasks
+    bool stop;
+    void *user;
+} mipsvm_pool_t;
+
+bool mipsvm_pool_start(mipsvm_pool_t *p, mipsvm_pool_worker_t *workers, uint32_t n_workers, mipsvm_pool_handler_t handler);
+bool mipsvm_pool_add(mipsvm_pool_t *p, mipsvm_pool_task_t *t, mipsvm_t *vm, uint32_t quantum);
+void mipsvm_pool_wake(mipsvm_pool_t *p, mipsvm_pool_task_t *t, uint32_t v0, uint32_t v1);
+void mipsvm_pool_wait(mipsvm_pool_t *p);
+void mipsvm_pool_stop(mipsvm_pool_t *p);
+uint32_t mipsvm_pool_depth(mipsvm_pool_t *p, uint32_t worker);
+
+#endif
@@ -0,0 +1,144 @@
+#define __MIPSVM_PROF_C__
+
+// Sampling profiler. Script runs in chunks of the sampling period, pc and the call stack are taken between them, so the
+// engines run at full speed in the meantime. Call stack is tracked by the VM (mipsvm_set_callstack) from jal/jalr/bal
+// and jr ra. Samples are aggregated in the host-provided table by the unique stack and written as folded stacks, names
+// are resolved from the ELF symbol table if the script was loaded by mipsvm_elf.c.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mipsvm.h"
+#include "mipsvm_prof.h"
+
+static uint32_t hash_stack(uint32_t pc, const uint32_t *ret, uint32_t depth)
+{
+    uint32_t h = 0x811C9DC5;
+
+    h = (h ^ pc) * 0x01000193;
+    for (uint32_t i = 0; i < depth; i++)
+        h = (h ^ ret[i]) * 0x01000193;
+    return h ^ h >> 16;
+}
+
+static void sample(mipsvm_prof_t *p, const mipsvm_t *ctx)
+{
+    // stack is already updated by the call or return in the delay slot, so the sample goes to the branch target
+    uint32_t pc = ctx->branch_is_pending ? ctx->branch_pc : ctx->pc;
+    uint32_t depth = p->stack.depth;
+    uint32_t frames = depth < MIPSVM_PROF_DEPTH ? depth : MIPSVM_PROF_DEPTH;
+    uint32_t i = hash_stack(pc, p->ret, frames) & p->mask;
+
+    p->samples++;
+
+    for (uint32_t probe = 0; probe <= p->mask; probe++, i = (i + 1) & p->mask)
+    {
+        mipsvm_prof_entry_t *e = &p->entries[i];
+
+        if (! e->count)
+        {
+            e->count = 1;
+            e->pc = pc;
+            e->depth = depth;
+            memcpy(e->ret, p->ret, frames * 4);
+            p->used++;
+            return;
+        }
+
+        if (e->pc == pc && e->depth == depth && ! memcmp(e->ret, p->ret, frames * 4))
+        {
+            e->count++;
+            return;
+        }
+    }
+
+    p->dropped++;
+}
+
+// number of entries must be a power of 2, period is in the retired instructions
+void mipsvm_prof_init(mipsvm_prof_t *p, mipsvm_prof_entry_t *entries, uint32_t n_entries, uint32_t period)
+{
+    memset(p, 0, sizeof(*p));
+    memset(entries, 0, n_entries * sizeof(*entries));
+    p->entries = entries;
+    p->mask = n_entries - 1;
+    p->period = period ? period : MIPSVM_PROF_PERIOD;
+    p->left = p->period;
+    p->stack.ret = p->ret;
+    p->stack.size = MIPSVM_PROF_DEPTH;
+}
+
+// starts tracking the calls of the VM. Stack is empty, so attach before the script starts
+void mipsvm_prof_attach(mipsvm_prof_t *p, mipsvm_t *ctx)
+{
+    p->stack.depth = 0;
+    mipsvm_set_callstack(ctx, &p->stack);
+}
+
+// mipsvm_run taking the samples
+mipsvm_rc_t mipsvm_prof_run(mipsvm_prof_t *p, mipsvm_t *ctx, uint32_t max_instr, uint32_t *retired)
+{
+    mipsvm_rc_t rc = MIPSVM_RC_OK;
+    uint32_t n = 0;
+
+    while (n < max_instr)
+    {
+        uint32_t chunk = max_instr - n < p->left ? max_instr - n : p->left;
+        uint32_t r;
+
+        rc = mipsvm_run(ctx, chunk, &r);
+        n += r;
+        p->left -= r;
+
+        if (! p->left)
+        {
+            sample(p, ctx);
+            p->left = p->period;
+        }
+
+        if (rc != MIPSVM_RC_OK)
+            break;
+    }
+
+    if (retired)
+        *retired = n;
+    return rc;
+}
+
+static void write_name(FILE *f, const mipsvm_elf_t *elf, uint32_t addr)
+{
+    const char *name = elf ? mipsvm_elf_symbol(elf, addr, 0) : 0;
+
+    if (name)
+        fputs(name, f);
+    else
+        fprintf(f, "0x%08X", addr);
+}
+
+// writes the folded stacks, "caller;callee;...;leaf count" per line (flamegraph.pl, inferno, speedscope).
+// Frames are named by the functions of the call sites, leaf by the function of pc, elf may be 0.
+// Samples are kept per pc, so the same stack may take several lines, the tools sum them
+bool mipsvm_prof_write(const mipsvm_prof_t *p, const mipsvm_elf_t *elf, FILE *f)
+{
+    for (uint32_t i = 0; i <= p->mask; i++)
+    {
+        const mipsvm_prof_entry_t *e = &p->entries[i];
+
+        if (! e->count)
+            continue;
+
+        for (uint32_t j = 0; j < e->depth && j < MIPSVM_PROF_DEPTH; j++)
+        {
+            write_name(f, elf, e->ret[j] - 8);     // call and its delay slot
+            fputc(';', f);
+        }
+        if (e->depth > MIPSVM_PROF_DEPTH)
+            fputs("[truncated];", f);
+
+        write_name(f, elf, e->pc);
+        fprintf(f, " %u\n", e->count);
+    }
+
+    return ! ferror(f);
+}
@@ -0,0 +1,44 @@
+#ifndef __MIPSVM_PROF_H__
+#define __MIPSVM_PROF_H__
+// public, sampling profiler of the script
+
+#include <stdio.h>
+#include "mipsvm.h"
+#include "mipsvm_elf.h"
+
+// call stack frames kept per sample, outer ones
+#ifndef MIPSVM_PROF_DEPTH
+#define MIPSVM_PROF_DEPTH 32
+#endif
+
+// retired instructions between the samples by default
+#define MIPSVM_PROF_PERIOD 10000
+
+// unique stack, memory is provided by the host
+typedef struct
+{
+    uint32_t count;             // samples, 0 for the free entry
+    uint32_t pc;
+    uint32_t depth;             // frames recorded
+    uint32_t ret[MIPSVM_PROF_DEPTH];    // return addresses, outermost first
+} mipsvm_prof_entry_t;
+
+typedef struct
+{
+    mipsvm_prof_entry_t *entries;   // open-addressed table
+    uint32_t mask;
+    uint32_t used;
+    uint32_t period;
+    uint32_t left;              // instructions till the next sample
+    uint64_t samples;
+    uint64_t dropped;           // table was full
+    uint32_t ret[MIPSVM_PROF_DEPTH];
+    mipsvm_callstack_t stack;
+} mipsvm_prof_t;
+
+void mipsvm_prof_init(mipsvm_prof_t *p, mipsvm_prof_entry_t *entries, uint32_t n_entries, uint32_t period);
+void mipsvm_prof_attach(mipsvm_prof_t *p, mipsvm_t *ctx);
+mipsvm_rc_t mipsvm_prof_run(mipsvm_prof_t *p, mipsvm_t *ctx, uint32_t max_instr, uint32_t *retired);
+bool mipsvm_prof_write(const mipsvm_prof_t *p, const mipsvm_elf_t *elf, FILE *f);
+
+#endif
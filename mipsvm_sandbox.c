@@ -0,0 +1,184 @@
+#define __MIPSVM_SANDBOX_C__
+
+// Guard-page sandbox for Linux x86-64.
+// The whole 32-bit guest address space is the single PROT_NONE reservation, segments populated by the host are made
+// accessible. Guest access is the plain load/store at base + addr, out-of-segment accesses fault.
+// SIGSEGV handler makes the faulting page accessible (zero page, or the writable copy of the read-only page), sets the
+// READ/WRITE address error and returns, so the access completes and the engine leaves on the exception as usual.
+// The page is dropped again once the VM returns (see sandbox_release in mipsvm.c). Faults are handled only while the VM
+// accesses the memory (sb->active), the host's own faulting accesses to the sandbox are passed to the previous handler.
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "mipsvm.h"
+#include "mipsvm_sandbox.h"
+
+#if defined(__linux__) && defined(__x86_64__)
+
+#define SPACE_SIZE (1ULL << 32)
+#define MAX_SANDBOXES 64
+#define PF_WRITE 2      // page fault error code bit
+
+static mipsvm_sandbox_t *sandboxes[MAX_SANDBOXES];
+static struct sigaction prev_action;
+static bool installed;
+
+static int page_prot(bool writable)
+{
+    return writable ? PROT_READ | PROT_WRITE : PROT_READ;
+}
+
+// page belongs to the read-only segment, the latest mapping wins
+static bool is_readonly(const mipsvm_sandbox_t *sb, uint32_t addr)
+{
+    for (uint32_t i = sb->segments_num; i-- > 0; )
+        if (addr - sb->segments[i].addr < sb->segments[i].size)
+            return ! sb->segments[i].writable;
+    return 0;
+}
+
+static void release(mipsvm_sandbox_t *sb)
+{
+    uint8_t *page = sb->base + sb->scratch.addr;
+
+    if (sb->scratch.readonly)
+    {
+        memcpy(page, sb->scratch.data, MIPSVM_PAGE_SIZE);
+        mprotect(page, MIPSVM_PAGE_SIZE, PROT_READ);
+    }
+    else
+    {
+        madvise(page, MIPSVM_PAGE_SIZE, MADV_DONTNEED);
+        mprotect(page, MIPSVM_PAGE_SIZE, PROT_NONE);
+    }
+
+    sb->scratch.used = 0;
+}
+
+static void on_fault(int sig, siginfo_t *info, void *uctx)
+{
+    uint8_t *addr = info->si_addr;
+    bool write = ((ucontext_t *) uctx)->uc_mcontext.gregs[REG_ERR] & PF_WRITE;
+
+    for (int i = 0; i < MAX_SANDBOXES; i++)
+    {
+        mipsvm_sandbox_t *sb = __atomic_load_n(&sandboxes[i], __ATOMIC_ACQUIRE);
+        if (! sb || (uint64_t) (addr - sb->base) >= SPACE_SIZE)
+            continue;
+        if (! sb->active || ! sb->ctx)  // the host's own access
+            break;
+
+        if (sb->scratch.used)   // left by mipsvm_readw and the like outside of the VM run
+            release(sb);
+
+        uint32_t page = (uint32_t) (addr - sb->base) & -MIPSVM_PAGE_SIZE;
+        sb->scratch.addr = page;
+        sb->scratch.readonly = is_readonly(sb, page);
+        if (sb->scratch.readonly)
+            memcpy(sb->scratch.data, sb->base + page, MIPSVM_PAGE_SIZE);
+        sb->scratch.used = 1;
+        mprotect(sb->base + page, MIPSVM_PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+        sb->ctx->exception = write ? MIPSVM_RC_WRITE_ADDRESS_ERROR : MIPSVM_RC_READ_ADDRESS_ERROR;
+        return;
+    }
+
+    // not ours
+    if (prev_action.sa_flags & SA_SIGINFO)
+        prev_action.sa_sigaction(sig, info, uctx);
+    else if (prev_action.sa_handler != SIG_IGN && prev_action.sa_handler != SIG_DFL)
+        prev_action.sa_handler(sig);
+    else
+        signal(sig, SIG_DFL);   // fault again and die
+}
+
+bool mipsvm_sandbox_init(mipsvm_sandbox_t *sb)
+{
+    memset(sb, 0, sizeof(*sb));
+
+    void *p = mmap(0, SPACE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return 0;
+
+    sb->base = p;
+    sb->release = release;
+
+    int i;
+    for (i = 0; i < MAX_SANDBOXES; i++)
+    {
+        mipsvm_sandbox_t *expected = 0;
+        if (__atomic_compare_exchange_n(&sandboxes[i], &expected, sb, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (i == MAX_SANDBOXES)
+    {
+        munmap(p, SPACE_SIZE);
+        return 0;
+    }
+
+    if (! __atomic_exchange_n(&installed, 1, __ATOMIC_ACQ_REL))
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = on_fault;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGSEGV, &sa, &prev_action);
+    }
+
+    return 1;
+}
+
+// makes the guest range accessible, host fills it via sb->base + addr. Range must not run past the guest address space
+bool mipsvm_sandbox_map(mipsvm_sandbox_t *sb, uint32_t addr, uint32_t size, bool writable)
+{
+    if (addr % MIPSVM_PAGE_SIZE || size % MIPSVM_PAGE_SIZE || sb->segments_num == MIPSVM_SANDBOX_SEGMENTS)
+        return 0;
+    if ((uint64_t) addr + size > SPACE_SIZE)   // host memory past the reservation
+        return 0;
+
+    if (mprotect(sb->base + addr, size, page_prot(writable)))
+        return 0;
+
+    sb->segments[sb->segments_num].addr = addr;
+    sb->segments[sb->segments_num].size = size;
+    sb->segments[sb->segments_num].writable = writable;
+    sb->segments_num++;
+    return 1;
+}
+
+void mipsvm_sandbox_free(mipsvm_sandbox_t *sb)
+{
+    for (int i = 0; i < MAX_SANDBOXES; i++)
+    {
+        mipsvm_sandbox_t *expected = sb;
+        __atomic_compare_exchange_n(&sandboxes[i], &expected, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+
+    if (sb->base)
+        munmap(sb->base, SPACE_SIZE);
+    memset(sb, 0, sizeof(*sb));
+}
+
+void mipsvm_set_sandbox(mipsvm_t *ctx, mipsvm_sandbox_t *sb)
+{
+    if (ctx->sandbox)
+        ctx->sandbox->ctx = 0;
+
+    ctx->sandbox = sb;
+    ctx->flat = sb ? sb->base : 0;
+    if (sb)
+        sb->ctx = ctx;
+
+    // code is read from the other memory now
+    mipsvm_flush_decode_cache(ctx);
+    mipsvm_flush_block_cache(ctx);
+}
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef __MIPSVM_SANDBOX_H__
+#define __MIPSVM_SANDBOX_H__
+// public, guard-page sandbox of the script memory (Linux x86-64, mipsvm_sandbox.c)
+
+#include "mipsvm.h"
+
+// guard-page sandbox, the whole guest address space is the single reserved host region
+#define MIPSVM_SANDBOX_SEGMENTS 16
+
+typedef struct mipsvm_sandbox
+{
+    uint8_t *base;          // host address of the guest address 0
+    struct mipsvm *ctx;     // VM faults are reported to
+    volatile uint32_t active;   // VM memory accesses in progress, faults outside of them are the host's own
+    struct
+    {
+        uint32_t addr;
+        uint32_t size;
+        bool writable;
+    } segments[MIPSVM_SANDBOX_SEGMENTS];
+    uint32_t segments_num;
+    struct
+    {
+        volatile bool used;     // page is made accessible by the fault handler until the VM returns
+        bool readonly;          // page of the read-only segment, data is restored
+        uint32_t addr;
+        uint8_t data[MIPSVM_PAGE_SIZE];
+    } scratch;
+    void (*release)(struct mipsvm_sandbox *sb);
+} mipsvm_sandbox_t;
+
+bool mipsvm_sandbox_init(mipsvm_sandbox_t *sb);
+bool mipsvm_sandbox_map(mipsvm_sandbox_t *sb, uint32_t addr, uint32_t size, bool writable);
+void mipsvm_sandbox_free(mipsvm_sandbox_t *sb);
+void mipsvm_set_sandbox(mipsvm_t *ctx, mipsvm_sandbox_t *sb);
+
+#endif
@@ -0,0 +1,116 @@
+#define __MIPSVM_SCHED_C__
+
+// Cooperative round-robin scheduler. Ready tasks form the intrusive FIFO, each one runs for its quantum via mipsvm_run
+// and goes to the tail. Exceptions are passed to the host handler, which decides if the task continues, blocks or finishes.
+// Nothing is allocated, switching is the couple of pointer updates.
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mipsvm.h"
+#include "mipsvm_sched.h"
+
+static void enqueue(mipsvm_sched_t *s, mipsvm_task_t *t)
+{
+    t->state = MIPSVM_TASK_READY;
+    t->next = 0;
+
+    if (s->tail)
+        s->tail->next = t;
+    else
+        s->head = t;
+    s->tail = t;
+    s->ready++;
+}
+
+static mipsvm_task_t *dequeue(mipsvm_sched_t *s)
+{
+    mipsvm_task_t *t = s->head;
+
+    s->head = t->next;
+    if (! s->head)
+        s->tail = 0;
+    s->ready--;
+    return t;
+}
+
+void mipsvm_sched_init(mipsvm_sched_t *s, mipsvm_sched_handler_t handler)
+{
+    memset(s, 0, sizeof(*s));
+    s->handler = handler;
+}
+
+void mipsvm_sched_add(mipsvm_sched_t *s, mipsvm_task_t *t, mipsvm_t *vm, uint32_t quantum)
+{
+    void *user = t->user;
+
+    memset(t, 0, sizeof(*t));
+    t->vm = vm;
+    t->quantum = quantum;
+    t->user = user;
+    enqueue(s, t);
+}
+
+// completes the blocking call, result is returned to the script in v0/v1
+void mipsvm_sched_wake(mipsvm_sched_t *s, mipsvm_task_t *t, uint32_t v0, uint32_t v1)
+{
+    if (t->state != MIPSVM_TASK_BLOCKED)
+        return;
+
+    t->vm->gpr[2] = v0;
+    t->vm->gpr[3] = v1;
+    s->blocked--;
+    enqueue(s, t);
+}
+
+// runs the single time slice of the next ready task, returns false if there is none
+bool mipsvm_sched_step(mipsvm_sched_t *s)
+{
+    if (! s->head)
+        return 0;
+
+    mipsvm_task_t *t = dequeue(s);
+    uint32_t n;
+
+    t->state = MIPSVM_TASK_RUNNING;
+    mipsvm_rc_t rc = mipsvm_run(t->vm, t->quantum, &n);
+
+    t->retired += n;
+    t->slices++;
+
+    if (rc == MIPSVM_RC_OK)
+    {
+        enqueue(s, t);
+        return 1;
+    }
+
+    t->rc = rc;
+    mipsvm_task_state_t state = s->handler ? s->handler(s, t, rc) : MIPSVM_TASK_FINISHED;
+
+    if (state == MIPSVM_TASK_READY)
+    {
+        enqueue(s, t);
+    }
+    else if (state == MIPSVM_TASK_BLOCKED)
+    {
+        t->state = MIPSVM_TASK_BLOCKED;
+        s->blocked++;
+    }
+    else
+    {
+        t->state = MIPSVM_TASK_FINISHED;
+    }
+
+    return 1;
+}
+
+// runs up to max_slices time slices (0 - until no task is ready), returns the number of slices executed
+uint32_t mipsvm_sched_run(mipsvm_sched_t *s, uint32_t max_slices)
+{
+    uint32_t n = 0;
+
+    while ((! max_slices || n < max_slices) && mipsvm_sched_step(s))
+        n++;
+
+    return n;
+}
@@ -0,0 +1,49 @@
+#ifndef __MIPSVM_SCHED_H__
+#define __MIPSVM_SCHED_H__
+// public, cooperative round-robin scheduler of the VM instances
+
+#include "mipsvm.h"
+
+typedef enum
+{
+    MIPSVM_TASK_READY,      // in the run queue
+    MIPSVM_TASK_RUNNING,
+    MIPSVM_TASK_BLOCKED,    // waits for mipsvm_sched_wake, e.g. the async syscall
+    MIPSVM_TASK_FINISHED,   // removed from the scheduler
+} mipsvm_task_state_t;
+
+// scheduled instance, memory is provided by the host
+typedef struct mipsvm_task
+{
+    mipsvm_t *vm;
+    uint32_t quantum;           // instructions per time slice
+    mipsvm_task_state_t state;
+    mipsvm_rc_t rc;             // last exception
+    uint64_t retired;
+    uint64_t slices;
+    struct mipsvm_task *next;   // run queue link
+    void *user;
+} mipsvm_task_t;
+
+struct mipsvm_sched;
+
+// called on the script exception (syscall, break, etc), returns the next state of the task
+typedef mipsvm_task_state_t (*mipsvm_sched_handler_t)(struct mipsvm_sched *s, mipsvm_task_t *t, mipsvm_rc_t rc);
+
+typedef struct mipsvm_sched
+{
+    mipsvm_task_t *head;        // run queue
+    mipsvm_task_t *tail;
+    uint32_t ready;
+    uint32_t blocked;
+    mipsvm_sched_handler_t handler;
+    void *user;
+} mipsvm_sched_t;
+
+void mipsvm_sched_init(mipsvm_sched_t *s, mipsvm_sched_handler_t handler);
+void mipsvm_sched_add(mipsvm_sched_t *s, mipsvm_task_t *t, mipsvm_t *vm, uint32_t quantum);
+void mipsvm_sched_wake(mipsvm_sched_t *s, mipsvm_task_t *t, uint32_t v0, uint32_t v1);
+bool mipsvm_sched_step(mipsvm_sched_t *s);
+uint32_t mipsvm_sched_run(mipsvm_sched_t *s, uint32_t max_slices);
+
+#endif
@@ -0,0 +1,364 @@
+#define __MIPSVM_SIMT_C__
+
+// SIMT engine. The group of lanes runs the same code, registers are stored as the structure of arrays, so the single
+// vector operation executes the instruction for all lanes. Every lane has its own pc: each step runs the instruction at
+// the lowest pc of the active lanes, masked to the lanes being there. Lanes diverged by the branch run in turns and
+// re-converge once they reach the same pc again (loop exit, end of the if/else).
+// ALU and branch instructions are vectorized. Rest of them (memory access, mult/div, etc) are executed lane by lane by
+// the scalar handlers with the lane's own VM, so all memory modes of the VM work as usual.
+// Lane raised the exception drops out: its state is stored to its VM as it was before the instruction, so mipsvm_exec
+// executes the instruction again and reports the exception via the usual scalar path. Syscalls always drop the lanes,
+// the handlers (mipsvm_set_syscalls) see the whole lane state that way.
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mipsvm.h"
+#include "mipsvm_int.h"
+#include "mipsvm_simt.h"
+
+#define LANES MIPSVM_SIMT_LANES
+
+typedef uint32_t vec_t __attribute__((vector_size(LANES * 4), aligned(4)));
+typedef int32_t svec_t __attribute__((vector_size(LANES * 4), aligned(4)));
+
+#define V(arr) (*(vec_t *) (arr))
+#define GPR(r) V(s->gpr[r])
+#define SGPR(r) ((svec_t) GPR(r))
+
+// comparison result (0 or -1 per lane) to 0/1
+#define BOOL(v) ((vec_t) (v) & 1)
+
+// stores v to the lanes selected by the mask m
+#define PUT(dst, v, m) \
+    do \
+    { \
+        vec_t m_ = (m); \
+        (dst) = ((v) & m_) | ((dst) & ~m_); \
+    } while (0)
+
+// state of the lanes before the instruction, restored on dropout
+typedef struct
+{
+    uint32_t pc;
+    vec_t branch_pc;
+    vec_t branch_is_pending;
+} rollback_t;
+
+static void load(mipsvm_simt_t *s, uint32_t l)
+{
+    const mipsvm_t *vm = &s->vms[l];
+
+    for (int i = 0; i < 32; i++)
+        s->gpr[i][l] = vm->gpr[i];
+    s->hi[l] = vm->hi;
+    s->lo[l] = vm->lo;
+    s->pc[l] = vm->pc;
+    s->branch_pc[l] = vm->branch_pc;
+    s->branch_is_pending[l] = vm->branch_is_pending ? ~0U : 0;
+}
+
+static void store(mipsvm_simt_t *s, uint32_t l)
+{
+    mipsvm_t *vm = &s->vms[l];
+
+    for (int i = 0; i < 32; i++)
+        vm->gpr[i] = s->gpr[i][l];
+    vm->hi = s->hi[l];
+    vm->lo = s->lo[l];
+    vm->pc = s->pc[l];
+    vm->branch_pc = s->branch_pc[l];
+    vm->branch_is_pending = s->branch_is_pending[l] != 0;
+}
+
+static void drop(mipsvm_simt_t *s, uint32_t l, const rollback_t *rb)
+{
+    s->pc[l] = rb->pc;
+    s->branch_pc[l] = rb->branch_pc[l];
+    s->branch_is_pending[l] = rb->branch_is_pending[l];
+    store(s, l);
+
+    s->vms[l].exception = 0;
+    s->active &= ~(1U << l);
+    s->stats.dropouts++;
+}
+
+static const mipsvm_decoded_t *fetch(mipsvm_simt_t *s, mipsvm_t *vm, uint32_t pc)
+{
+    mipsvm_decoded_t *d = &s->dcache[(pc >> 2) & (MIPSVM_SIMT_DCACHE - 1)];
+
+    if (d->pc == pc && d->pc != MIPSVM_DECODED_FREE)
+        return d;
+
+    vm->exception = 0;
+    uint32_t instr = mipsvm_readw(vm, pc);
+    if (vm->exception)
+        return 0;
+
+    mipsvm_decode(instr, d);
+    d->pc = pc;
+    return d;
+}
+
+// drops the decoding of the word written by the lane, code stored by the script is fetched again
+static void invalidate(mipsvm_simt_t *s, uint32_t addr)
+{
+    mipsvm_decoded_t *d = &s->dcache[(addr >> 2) & (MIPSVM_SIMT_DCACHE - 1)];
+
+    if (d->pc == (addr & -4U))
+        d->pc = MIPSVM_DECODED_FREE;
+}
+
+static bool is_store(int op)
+{
+    return op == OP_sb || op == OP_sh || op == OP_sw || op == OP_swl || op == OP_swr;
+}
+
+// executes the instruction lane by lane via the scalar handler
+static uint32_t exec_lanes(mipsvm_simt_t *s, const mipsvm_decoded_t *d, uint32_t bits, const rollback_t *rb)
+{
+    uint32_t retired = 0;
+
+    for (uint32_t l = 0; bits; l++, bits >>= 1)
+    {
+        if (! (bits & 1))
+            continue;
+
+        mipsvm_t *vm = &s->vms[l];
+
+        vm->gpr[0] = 0;
+        vm->gpr[d->rs] = s->gpr[d->rs][l];
+        vm->gpr[d->rt] = s->gpr[d->rt][l];
+        vm->gpr[d->rd] = s->gpr[d->rd][l];
+        vm->hi = s->hi[l];
+        vm->lo = s->lo[l];
+        vm->pc = s->pc[l];
+        vm->branch_is_pending = 0;
+        vm->exception = 0;
+
+        mipsvm_handlers[d->op](vm, d);
+
+        if (vm->exception)
+        {
+            drop(s, l, rb);
+            continue;
+        }
+
+        if (is_store(d->op))
+            invalidate(s, vm->gpr[d->rs] + d->imm);
+
+        s->gpr[d->rt][l] = vm->gpr[d->rt];
+        s->gpr[d->rd][l] = vm->gpr[d->rd];
+        s->hi[l] = vm->hi;
+        s->lo[l] = vm->lo;
+        retired++;
+    }
+
+    s->stats.scalar += retired;
+    return retired;
+}
+
+#define BRANCH(taken, target) \
+    do \
+    { \
+        vec_t t_ = (taken); \
+        PUT(V(s->branch_pc), (target), t_); \
+        V(s->branch_is_pending) |= t_; \
+    } while (0)
+
+static void step(mipsvm_simt_t *s)
+{
+    static const vec_t lane_bit = {
+        1U << 0, 1U << 1, 1U << 2, 1U << 3,
+#if LANES > 4
+        1U << 4, 1U << 5, 1U << 6, 1U << 7,
+#endif
+#if LANES > 8
+        1U << 8, 1U << 9, 1U << 10, 1U << 11, 1U << 12, 1U << 13, 1U << 14, 1U << 15,
+#endif
+#if LANES > 16
+        1U << 16, 1U << 17, 1U << 18, 1U << 19, 1U << 20, 1U << 21, 1U << 22, 1U << 23,
+        1U << 24, 1U << 25, 1U << 26, 1U << 27, 1U << 28, 1U << 29, 1U << 30, 1U << 31,
+#endif
+    };
+
+    // lowest pc goes first, so the lanes behind catch up with the others
+    uint32_t pc = 0xFFFFFFFF;
+    uint32_t first = 0;
+    for (uint32_t l = 0; l < LANES; l++)
+    {
+        if ((s->active >> l & 1) && s->pc[l] < pc)
+        {
+            pc = s->pc[l];
+            first = l;
+        }
+    }
+
+    vec_t m = (vec_t) ((lane_bit & s->active) != 0) & (vec_t) (V(s->pc) == pc);
+    uint32_t bits = 0;
+    for (uint32_t l = 0; l < LANES; l++)
+        bits |= m[l] & (1U << l);
+
+    rollback_t rb = { pc, V(s->branch_pc), V(s->branch_is_pending) };
+
+    s->stats.steps++;
+    if (bits != s->active)
+        s->stats.divergent++;
+
+    // code is the same for all lanes, fetched via the memory of the first one
+    const mipsvm_decoded_t *d = fetch(s, &s->vms[first], pc);
+    if (! d)
+    {
+        for (uint32_t l = 0; l < LANES; l++)
+            if (bits >> l & 1)
+                drop(s, l, &rb);
+        return;
+    }
+
+    // move to the next instruction, taking the pending branch if any
+    vec_t pend = V(s->branch_is_pending);
+    PUT(V(s->pc), (V(s->branch_pc) & pend) | ((pc + 4) & ~pend), m);
+    V(s->branch_is_pending) &= ~m;
+
+    GPR(0) = (vec_t) {0};     // r0 always == 0
+
+    vec_t npc = V(s->pc);
+    int32_t imm = d->imm;
+    uint32_t retired = __builtin_popcount(bits);
+
+#define SET(r, v) PUT(GPR(r), (v), m)
+
+    switch (d->op)
+    {
+    case OP_addu:   SET(d->rd, GPR(d->rs) + GPR(d->rt)); break;
+    case OP_subu:   SET(d->rd, GPR(d->rs) - GPR(d->rt)); break;
+    case OP_and:    SET(d->rd, GPR(d->rs) & GPR(d->rt)); break;
+    case OP_or:     SET(d->rd, GPR(d->rs) | GPR(d->rt)); break;
+    case OP_xor:    SET(d->rd, GPR(d->rs) ^ GPR(d->rt)); break;
+    case OP_nor:    SET(d->rd, ~(GPR(d->rs) | GPR(d->rt))); break;
+    case OP_mul:    SET(d->rd, GPR(d->rs) * GPR(d->rt)); break;
+    case OP_slt:    SET(d->rd, BOOL(SGPR(d->rs) < SGPR(d->rt))); break;
+    case OP_sltu:   SET(d->rd, BOOL(GPR(d->rs) < GPR(d->rt))); break;
+    case OP_sll:    SET(d->rd, GPR(d->rt) << d->sa); break;
+    case OP_srl:    SET(d->rd, GPR(d->rt) >> d->sa); break;
+    case OP_sra:    SET(d->rd, (vec_t) (SGPR(d->rt) >> d->sa)); break;
+    case OP_sllv:   SET(d->rd, GPR(d->rt) << (GPR(d->rs) & 0x1F)); break;
+    case OP_srlv:   SET(d->rd, GPR(d->rt) >> (GPR(d->rs) & 0x1F)); break;
+    case OP_srav:   SET(d->rd, (vec_t) (SGPR(d->rt) >> (SGPR(d->rs) & 0x1F))); break;
+    case OP_rotr:   SET(d->rd, d->sa ? (GPR(d->rt) >> d->sa) | (GPR(d->rt) << (32 - d->sa)) : GPR(d->rt)); break;
+    case OP_seb:    SET(d->rd, (vec_t) ((SGPR(d->rt) << 24) >> 24)); break;
+    case OP_seh:    SET(d->rd, (vec_t) ((SGPR(d->rt) << 16) >> 16)); break;
+    case OP_movz:   PUT(GPR(d->rd), GPR(d->rs), m & (vec_t) (GPR(d->rt) == 0)); break;
+    case OP_movn:   PUT(GPR(d->rd), GPR(d->rs), m & (vec_t) (GPR(d->rt) != 0)); break;
+    case OP_mfhi:   SET(d->rd, V(s->hi)); break;
+    case OP_mflo:   SET(d->rd, V(s->lo)); break;
+    case OP_mthi:   PUT(V(s->hi), GPR(d->rs), m); break;
+    case OP_mtlo:   PUT(V(s->lo), GPR(d->rs), m); break;
+
+    case OP_addiu:  SET(d->rt, GPR(d->rs) + (uint32_t) imm); break;
+    case OP_andi:   SET(d->rt, GPR(d->rs) & (uint32_t) imm); break;
+    case OP_ori:    SET(d->rt, GPR(d->rs) | (uint32_t) imm); break;
+    case OP_xori:   SET(d->rt, GPR(d->rs) ^ (uint32_t) imm); break;
+    case OP_slti:   SET(d->rt, BOOL(SGPR(d->rs) < imm)); break;
+    case OP_sltiu:  SET(d->rt, BOOL(GPR(d->rs) < (uint32_t) imm)); break;
+    case OP_lui:    SET(d->rt, (vec_t) {0} + (uint32_t) imm); break;
+
+    // branch target is relative to the delay slot, i.e. to the pc just moved
+    case OP_beq:    BRANCH(m & (vec_t) (GPR(d->rs) == GPR(d->rt)), npc + imm); break;
+    case OP_bne:    BRANCH(m & (vec_t) (GPR(d->rs) != GPR(d->rt)), npc + imm); break;
+    case OP_blez:   BRANCH(m & (vec_t) (SGPR(d->rs) <= 0), npc + imm); break;
+    case OP_bgtz:   BRANCH(m & (vec_t) (SGPR(d->rs) > 0), npc + imm); break;
+    case OP_bltz:   BRANCH(m & (vec_t) (SGPR(d->rs) < 0), npc + imm); break;
+    case OP_bgez:   BRANCH(m & (vec_t) (SGPR(d->rs) >= 0), npc + imm); break;
+
+    case OP_bltzal:
+    case OP_bgezal:
+    {
+        vec_t taken = m & (vec_t) (d->op == OP_bltzal ? SGPR(d->rs) < 0 : SGPR(d->rs) >= 0);
+        PUT(GPR(31), npc + 4, taken);
+        BRANCH(taken, npc + imm);
+        break;
+    }
+
+    case OP_j:
+        BRANCH(m, (npc & 0xF0000000) | (uint32_t) imm);
+        break;
+
+    case OP_jal:
+        SET(31, npc + 4);
+        BRANCH(m, (npc & 0xF0000000) | (uint32_t) imm);
+        break;
+
+    case OP_jr:
+        BRANCH(m, GPR(d->rs));
+        break;
+
+    case OP_jalr:
+        SET(d->rd, npc + 4);
+        BRANCH(m, d->rs ? GPR(d->rs) : (vec_t) {0});
+        break;
+
+    case OP_syscall:    // even if handled inside the VM, the handler reads and writes any register
+        for (uint32_t l = 0; l < LANES; l++)
+            if (bits >> l & 1)
+                drop(s, l, &rb);
+        retired = 0;
+        break;
+
+    default:
+        retired = exec_lanes(s, d, bits, &rb);
+        break;
+    }
+
+#undef SET
+
+    s->stats.instrs += retired;
+}
+
+// lanes are loaded from the VM instances and start active. Fails if n_lanes > MIPSVM_SIMT_LANES
+bool mipsvm_simt_init(mipsvm_simt_t *s, mipsvm_t *vms, uint32_t n_lanes)
+{
+    if (n_lanes > LANES)
+        return 0;
+
+    memset(s, 0, sizeof(*s));
+    s->vms = vms;
+    s->lanes_num = n_lanes;
+
+    for (uint32_t i = 0; i < MIPSVM_SIMT_DCACHE; i++)
+        s->dcache[i].pc = MIPSVM_DECODED_FREE;
+
+    for (uint32_t l = 0; l < n_lanes; l++)
+        mipsvm_simt_join(s, l);
+    return 1;
+}
+
+// (re)loads the lane from its VM, e.g. once its exception is handled via the scalar path
+void mipsvm_simt_join(mipsvm_simt_t *s, uint32_t lane)
+{
+    load(s, lane);
+    s->active |= 1U << lane;
+}
+
+// stores the state of the active lanes to their VMs
+void mipsvm_simt_sync(mipsvm_simt_t *s)
+{
+    for (uint32_t l = 0; l < s->lanes_num; l++)
+        if (s->active >> l & 1)
+            store(s, l);
+}
+
+// runs up to max_steps group instructions, returns the bitmask of the lanes still active
+uint32_t mipsvm_simt_run(mipsvm_simt_t *s, uint32_t max_steps)
+{
+    for (uint32_t l = 0; l < s->lanes_num; l++)
+        mipsvm_sandbox_enter(&s->vms[l]);
+
+    for (uint32_t n = 0; s->active && n < max_steps; n++)
+        step(s);
+
+    for (uint32_t l = 0; l < s->lanes_num; l++)
+        mipsvm_sandbox_leave(&s->vms[l]);
+
+    return s->active;
+}
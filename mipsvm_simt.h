@@ -0,0 +1,47 @@
+#ifndef __MIPSVM_SIMT_H__
+#define __MIPSVM_SIMT_H__
+// public, lockstep execution of the same script by several VM instances (GCC/Clang vector extensions)
+
+#include "mipsvm.h"
+
+// lanes of the group, power of 2 from 4 to 32. 8 lanes is the single AVX2 register
+#ifndef MIPSVM_SIMT_LANES
+#define MIPSVM_SIMT_LANES 8
+#endif
+
+// entries of the group decode cache, power of 2
+#ifndef MIPSVM_SIMT_DCACHE
+#define MIPSVM_SIMT_DCACHE 256
+#endif
+
+typedef struct
+{
+    uint64_t steps;             // instructions fetched by the group
+    uint64_t instrs;            // instructions retired by the lanes
+    uint64_t divergent;         // steps run by the part of the active lanes
+    uint64_t scalar;            // lane instructions executed by the scalar handlers (memory access, etc)
+    uint64_t dropouts;          // lanes left the group on exception
+} mipsvm_simt_stats_t;
+
+// lanes state, structure of arrays
+typedef struct
+{
+    uint32_t gpr[32][MIPSVM_SIMT_LANES];
+    uint32_t hi[MIPSVM_SIMT_LANES];
+    uint32_t lo[MIPSVM_SIMT_LANES];
+    uint32_t pc[MIPSVM_SIMT_LANES];
+    uint32_t branch_pc[MIPSVM_SIMT_LANES];
+    uint32_t branch_is_pending[MIPSVM_SIMT_LANES];  // 0 or ~0
+    uint32_t active;            // lanes bitmask
+    mipsvm_t *vms;              // lane instances, provide the memory and receive the state on dropout
+    uint32_t lanes_num;
+    mipsvm_decoded_t dcache[MIPSVM_SIMT_DCACHE];
+    mipsvm_simt_stats_t stats;
+} mipsvm_simt_t;
+
+bool mipsvm_simt_init(mipsvm_simt_t *s, mipsvm_t *vms, uint32_t n_lanes);
+void mipsvm_simt_join(mipsvm_simt_t *s, uint32_t lane);
+void mipsvm_simt_sync(mipsvm_simt_t *s);
+uint32_t mipsvm_simt_run(mipsvm_simt_t *s, uint32_t max_steps);
+
+#endif
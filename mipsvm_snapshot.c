@@ -0,0 +1,237 @@
+#define __MIPSVM_SNAPSHOT_C__
+
+// Snapshot and fork.
+// Snapshot keeps the registers and the memory of the writable regions in the anonymous host file, one page-aligned
+// range per region. Read-only regions (code, constants) are not copied, forks share them as is.
+// Fork maps the image privately, so the forked instance starts without copying anything: pages are shared with the
+// image until the instance writes them and the host kernel makes the private copy (copy-on-write).
+
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mipsvm.h"
+#include "mipsvm_snapshot.h"
+
+static uint64_t host_page(void)
+{
+    return (uint64_t) sysconf(_SC_PAGESIZE);
+}
+
+static uint64_t round_page(uint64_t size)
+{
+    uint64_t page = host_page();
+    return (size + page - 1) / page * page;
+}
+
+// unlinked file, not backed by the disk where possible
+static int image_file(void)
+{
+#ifdef __linux__
+    return memfd_create("mipsvm-snapshot", 0);
+#else
+    char name[] = "/tmp/mipsvm-snapshot-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd >= 0)
+        unlink(name);
+    return fd;
+#endif
+}
+
+static bool write_all(int fd, const uint8_t *data, uint32_t size, uint64_t offset)
+{
+    while (size)
+    {
+        ssize_t n = pwrite(fd, data, size, offset);
+        if (n <= 0)
+            return 0;
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return 1;
+}
+
+static bool read_all(int fd, uint8_t *data, uint32_t size, uint64_t offset)
+{
+    while (size)
+    {
+        ssize_t n = pread(fd, data, size, offset);
+        if (n <= 0)
+            return 0;
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return 1;
+}
+
+static void save_regs(mipsvm_snapshot_t *snap, const mipsvm_t *ctx)
+{
+    snap->iface = ctx->iface;
+    snap->pc = ctx->pc;
+    snap->branch_pc = ctx->branch_pc;
+    snap->code = ctx->code;
+    snap->branch_is_pending = ctx->branch_is_pending;
+    snap->acc = ctx->acc;
+    memcpy(snap->gpr, ctx->gpr, sizeof(snap->gpr));
+}
+
+static void load_regs(mipsvm_t *ctx, const mipsvm_snapshot_t *snap)
+{
+    ctx->pc = snap->pc;
+    ctx->branch_pc = snap->branch_pc;
+    ctx->code = snap->code;
+    ctx->branch_is_pending = snap->branch_is_pending;
+    ctx->acc = snap->acc;
+    memcpy(ctx->gpr, snap->gpr, sizeof(ctx->gpr));
+    ctx->exception = 0;
+}
+
+// takes the registers and the memory of the regions. Memory of the TLB, sandbox and callbacks is not saved
+bool mipsvm_snapshot(mipsvm_snapshot_t *snap, const mipsvm_t *ctx)
+{
+    memset(snap, 0, sizeof(*snap));
+    snap->fd = -1;
+
+    if (ctx->regions_num > MIPSVM_SNAPSHOT_REGIONS)
+        return 0;
+
+    save_regs(snap, ctx);
+
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < ctx->regions_num; i++)
+    {
+        const mipsvm_region_t *r = &ctx->regions[i];
+
+        snap->regions[i].base = r->base;
+        snap->regions[i].size = r->size;
+        snap->regions[i].writable = r->writable;
+        if (r->writable)
+        {
+            snap->regions[i].offset = offset;
+            offset += round_page(r->size);
+        }
+        else
+        {
+            snap->regions[i].mem = r->mem;
+        }
+    }
+    snap->regions_num = ctx->regions_num;
+
+    if (! offset)
+        return 1;
+
+    snap->fd = image_file();
+    if (snap->fd < 0 || ftruncate(snap->fd, offset))
+    {
+        mipsvm_snapshot_free(snap);
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < ctx->regions_num; i++)
+    {
+        const mipsvm_region_t *r = &ctx->regions[i];
+
+        if (r->writable && ! write_all(snap->fd, r->mem, r->size, snap->regions[i].offset))
+        {
+            mipsvm_snapshot_free(snap);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+void mipsvm_snapshot_free(mipsvm_snapshot_t *snap)
+{
+    if (snap->fd >= 0)
+        close(snap->fd);
+    snap->fd = -1;
+}
+
+// rolls the instance back to the snapshot. Regions must be the same as when the snapshot was taken
+bool mipsvm_restore(mipsvm_t *ctx, const mipsvm_snapshot_t *snap)
+{
+    if (ctx->regions_num != snap->regions_num)
+        return 0;
+
+    for (uint32_t i = 0; i < snap->regions_num; i++)
+    {
+        const mipsvm_region_t *r = &ctx->regions[i];
+
+        if (r->base != snap->regions[i].base || r->size != snap->regions[i].size || r->writable != snap->regions[i].writable)
+            return 0;
+    }
+
+    for (uint32_t i = 0; i < snap->regions_num; i++)
+    {
+        const mipsvm_region_t *r = &ctx->regions[i];
+
+        if (! r->writable)
+            continue;
+        if (! read_all(snap->fd, r->mem, r->size, snap->regions[i].offset))
+            return 0;
+
+        // rewritten by the host, so the next incremental checkpoint saves it and its code is decoded again
+        mipsvm_invalidate_range(ctx, r->base, r->size);
+    }
+
+    load_regs(ctx, snap);
+
+    // code may be different now
+    mipsvm_flush_decode_cache(ctx);
+    mipsvm_flush_block_cache(ctx);
+    mipsvm_flush_icache(ctx);
+    mipsvm_flush_tlb(ctx);
+    return 1;
+}
+
+// initializes the new instance from the snapshot, writable regions are mapped copy-on-write.
+// Regions array (snap->regions_num entries) is provided by the host and must stay valid until mipsvm_fork_free
+bool mipsvm_fork(mipsvm_t *ctx, const mipsvm_snapshot_t *snap, mipsvm_region_t *regions)
+{
+    mipsvm_init(ctx, &snap->iface, snap->pc);
+    load_regs(ctx, snap);
+
+    for (uint32_t i = 0; i < snap->regions_num; i++)
+    {
+        regions[i].base = snap->regions[i].base;
+        regions[i].size = snap->regions[i].size;
+        regions[i].writable = snap->regions[i].writable;
+        regions[i].mem = snap->regions[i].mem;
+
+        if (! snap->regions[i].writable)
+            continue;
+
+        void *p = mmap(0, round_page(snap->regions[i].size), PROT_READ | PROT_WRITE, MAP_PRIVATE, snap->fd,
+                       snap->regions[i].offset);
+        if (p == MAP_FAILED)
+        {
+            mipsvm_set_regions(ctx, regions, i);
+            mipsvm_fork_free(ctx);
+            return 0;
+        }
+        regions[i].mem = p;
+    }
+
+    mipsvm_set_regions(ctx, regions, snap->regions_num);
+    return 1;
+}
+
+// unmaps the memory of the forked instance
+void mipsvm_fork_free(mipsvm_t *ctx)
+{
+    for (uint32_t i = 0; i < ctx->regions_num; i++)
+    {
+        const mipsvm_region_t *r = &ctx->regions[i];
+
+        if (r->writable && r->mem)
+            munmap(r->mem, round_page(r->size));
+    }
+
+    mipsvm_set_regions(ctx, 0, 0);
+}
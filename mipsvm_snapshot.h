@@ -0,0 +1,37 @@
+#ifndef __MIPSVM_SNAPSHOT_H__
+#define __MIPSVM_SNAPSHOT_H__
+// public, snapshot and copy-on-write fork of the VM (POSIX, mipsvm_snapshot.c)
+
+#include "mipsvm.h"
+
+// saved VM state, memory of the writable regions is kept in the anonymous host file
+#define MIPSVM_SNAPSHOT_REGIONS 16
+
+typedef struct
+{
+    mipsvm_iface_t iface;
+    uint32_t pc;
+    uint32_t branch_pc;
+    uint32_t code;
+    int branch_is_pending;
+    uint64_t acc;
+    uint32_t gpr[32];
+    int fd;                     // memory image, -1 if not taken
+    struct
+    {
+        uint32_t base;
+        uint32_t size;
+        bool writable;
+        uint8_t *mem;           // read-only region, shared by the forks as is
+        uint64_t offset;        // writable region, in the image
+    } regions[MIPSVM_SNAPSHOT_REGIONS];
+    uint32_t regions_num;
+} mipsvm_snapshot_t;
+
+bool mipsvm_snapshot(mipsvm_snapshot_t *snap, const mipsvm_t *ctx);
+void mipsvm_snapshot_free(mipsvm_snapshot_t *snap);
+bool mipsvm_restore(mipsvm_t *ctx, const mipsvm_snapshot_t *snap);
+bool mipsvm_fork(mipsvm_t *ctx, const mipsvm_snapshot_t *snap, mipsvm_region_t *regions);
+void mipsvm_fork_free(mipsvm_t *ctx);
+
+#endif
@@ -0,0 +1,733 @@
+#define __MIPSVM_TEST_C__
+
+// Behaviour tests. Guest code is embedded pre-assembled (MIPS32r2, little-endian) as in mipsvm_bench.c, every test
+// prints "ok <name>" or "FAIL <name>", the exit code is 1 if any failed.
+//
+// Build: cc -O2 -pthread -o mipsvm_test mipsvm_test.c mipsvm.c <modules>, the modules being mipsvm_pool.c mipsvm_cq.c
+//        mipsvm_simt.c mipsvm_snapshot.c mipsvm_checkpoint.c. Add -DMIPSVM_TEST_SANDBOX mipsvm_sandbox.c for the
+//        sandbox tests, -DMIPSVM_JIT mipsvm_jit.c for the jit engine.
+// Usage: mipsvm_test [test]
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "mipsvm.h"
+#include "mipsvm_pool.h"
+#include "mipsvm_cq.h"
+#include "mipsvm_simt.h"
+#include "mipsvm_snapshot.h"
+#include "mipsvm_checkpoint.h"
+#ifdef MIPSVM_JIT
+#include "mipsvm_jit.h"
+#endif
+#ifdef MIPSVM_TEST_SANDBOX
+#include <sys/mman.h>
+#include "mipsvm_sandbox.h"
+#endif
+
+#define MEM_SIZE 0x10000
+#define BLOCKS 64
+#define JIT_SIZE (1 << 16)
+
+typedef struct
+{
+    const char *name;
+    bool (*run)(void);
+} test_t;
+
+typedef enum
+{
+    ENGINE_EXEC,        // mipsvm_exec
+    ENGINE_RUN,         // mipsvm_run, no caches
+    ENGINE_BLOCKS,      // mipsvm_run with the block cache
+#ifdef MIPSVM_JIT
+    ENGINE_JIT,         // block cache and jit
+#endif
+    ENGINES_NUM
+} engine_t;
+
+static uint8_t mem[MEM_SIZE];
+
+static uint32_t readw(uint32_t addr)
+{
+    const uint8_t *p = &mem[addr % MEM_SIZE];
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint16_t readh(uint32_t addr)
+{
+    const uint8_t *p = &mem[addr % MEM_SIZE];
+    return p[0] | p[1] << 8;
+}
+
+static uint8_t readb(uint32_t addr)
+{
+    return mem[addr % MEM_SIZE];
+}
+
+static void writew(uint32_t addr, uint32_t data)
+{
+    uint8_t *p = &mem[addr % MEM_SIZE];
+    p[0] = data;
+    p[1] = data >> 8;
+    p[2] = data >> 16;
+    p[3] = data >> 24;
+}
+
+static void writeh(uint32_t addr, uint16_t data)
+{
+    uint8_t *p = &mem[addr % MEM_SIZE];
+    p[0] = data;
+    p[1] = data >> 8;
+}
+
+static void writeb(uint32_t addr, uint8_t data)
+{
+    mem[addr % MEM_SIZE] = data;
+}
+
+static const mipsvm_iface_t iface =
+{
+    .readw = readw,
+    .readh = readh,
+    .readb = readb,
+    .writew = writew,
+    .writeh = writeh,
+    .writeb = writeb,
+};
+
+static void load(uint32_t addr, const uint32_t *code, uint32_t size)
+{
+    for (uint32_t i = 0; i < size / 4; i++)
+        writew(addr + i * 4, code[i]);
+}
+
+static void sleep_ms(uint32_t ms)
+{
+    struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+    nanosleep(&ts, 0);
+}
+
+// runs the script loaded at 0 until the exception other than the fuel, with the engine set up
+static mipsvm_rc_t run(mipsvm_t *vm, engine_t engine)
+{
+    static mipsvm_block_t blocks[BLOCKS];
+    mipsvm_rc_t rc;
+
+    if (engine >= ENGINE_BLOCKS)
+        mipsvm_set_block_cache(vm, blocks, BLOCKS);
+#ifdef MIPSVM_JIT
+    static mipsvm_jit_t jit;
+    if (engine == ENGINE_JIT)
+    {
+        if (! mipsvm_jit_init(&jit, JIT_SIZE))
+            return MIPSVM_RC_RESERVED_INSTR;
+        mipsvm_set_jit(vm, &jit);
+    }
+#endif
+
+    do
+    {
+        uint32_t n;
+        rc = engine == ENGINE_EXEC ? mipsvm_exec(vm) : mipsvm_run(vm, 100000, &n);
+    } while (rc == MIPSVM_RC_OK || rc == MIPSVM_RC_OUT_OF_FUEL);
+
+#ifdef MIPSVM_JIT
+    if (engine == ENGINE_JIT)
+    {
+        mipsvm_set_jit(vm, 0);
+        mipsvm_jit_free(&jit);
+    }
+#endif
+    return rc;
+}
+
+static const uint32_t spin_code[] =
+{
+    0x24420001,     // 1: addiu v0, v0, 1
+    0x1000FFFE,     //    b 1b
+    0x00000000,     //    nop
+};
+
+// string copied from the callbacks memory, cut by the buffer size
+static bool copy_string(void)
+{
+    mipsvm_t vm;
+    char buf[8];
+    uint32_t len;
+
+    memset(mem, 0, sizeof(mem));
+    strcpy((char *) &mem[0x100], "hello");
+    strcpy((char *) &mem[0x200], "hello world");
+    mipsvm_init(&vm, &iface, 0);
+
+    if (! mipsvm_copy_string(&vm, 0x100, buf, sizeof(buf), &len) || strcmp(buf, "hello") || len != 5)
+        return 0;
+    return ! mipsvm_copy_string(&vm, 0x200, buf, sizeof(buf), &len) && ! strcmp(buf, "hello w") && len == 7;
+}
+
+static uint32_t syscall_pc_bad;
+
+// rewrites the next instruction of its block halfway through the loop
+static bool patch_syscall(mipsvm_t *ctx, void *user)
+{
+    (void) user;
+
+    syscall_pc_bad += ctx->pc != 0x8;
+    if (ctx->gpr[4] == 500)
+        mipsvm_writew(ctx, 0x8, 0x24420002);     // addiu v0, v0, 2
+    return 1;
+}
+
+// inline syscall handler sees the same pc and its code changes take effect at once in every engine
+static bool syscall_inline(void)
+{
+    static const uint32_t code[] =
+    {
+        0x2484FFFF,     // 1: addiu a0, a0, -1
+        0x0000008C,     //    syscall 2
+        0x24420001,     //    addiu v0, v0, 1
+        0x00621821,     //    addu v1, v1, v0
+        0x1480FFFB,     //    bnez a0, 1b
+        0x00000000,     //    nop
+        0x0000004C,     //    syscall 1
+    };
+    static const mipsvm_syscall_t syscalls[] = { 0, 0, patch_syscall };
+    bool ok = true;
+
+    for (int e = 0; e < ENGINES_NUM; e++)
+    {
+        mipsvm_t vm;
+
+        memset(mem, 0, sizeof(mem));
+        load(0, code, sizeof(code));
+        mipsvm_init(&vm, &iface, 0);
+        mipsvm_set_syscalls(&vm, syscalls, 3, 0);
+        vm.gpr[4] = 1000;
+        syscall_pc_bad = 0;
+
+        // iterations down to a0 == 500 add 1, the rest add 2
+        mipsvm_rc_t rc = run(&vm, e);
+        ok = ok && rc == MIPSVM_RC_SYSCALL && mipsvm_get_callcode(&vm) == 1 && vm.gpr[2] == 499 + 501 * 2;
+        ok = ok && ! syscall_pc_bad;
+    }
+
+    return ok;
+}
+
+// unlimited fuel is not charged by any engine, so it is still reported as unlimited after the run
+static bool fuel_unlimited(void)
+{
+    static const uint32_t code[] =
+    {
+        0x2484FFFF,     // 1: addiu a0, a0, -1
+        0x1480FFFE,     //    bnez a0, 1b
+        0x24420001,     //    addiu v0, v0, 1
+        0x0000004C,     //    syscall 1
+    };
+    bool ok = true;
+
+    for (int e = 0; e < ENGINES_NUM; e++)
+    {
+        mipsvm_t vm;
+
+        memset(mem, 0, sizeof(mem));
+        load(0, code, sizeof(code));
+        mipsvm_init(&vm, &iface, 0);
+        vm.gpr[4] = 1000;
+
+        ok = ok && run(&vm, e) == MIPSVM_RC_SYSCALL && vm.gpr[2] == 1000;
+        ok = ok && mipsvm_get_fuel(&vm) == MIPSVM_FUEL_UNLIMITED;
+    }
+
+    return ok;
+}
+
+// store into the middle of the cached block drops it, the store right past its end does not
+static bool block_invalidation(void)
+{
+    static const uint32_t code[] =
+    {
+        0x24420001, 0x24420001, 0x24420001, 0x24420001,     // addiu v0, v0, 1 (x8)
+        0x24420001, 0x24420001, 0x24420001, 0x24420001,
+        0x0000004C,     // syscall 1
+        0x0000000D,     // break
+    };
+    static mipsvm_block_t blocks[BLOCKS];
+    mipsvm_t vm;
+    uint32_t n;
+
+    memset(mem, 0, sizeof(mem));
+    load(0x100, code, sizeof(code));
+    mipsvm_init(&vm, &iface, 0x100);
+    mipsvm_set_block_cache(&vm, blocks, BLOCKS);
+
+    bool ok = mipsvm_run(&vm, 100, &n) == MIPSVM_RC_SYSCALL && vm.gpr[2] == 8;
+
+    mipsvm_writew(&vm, 0x128, 0);
+    ok = ok && vm.bstats.invalidations == 0;
+    mipsvm_writew(&vm, 0x114, 0x24420002);     // addiu v0, v0, 2
+    ok = ok && vm.bstats.invalidations == 1;
+
+    vm.pc = 0x100;
+    vm.gpr[2] = 0;
+    ok = ok && mipsvm_run(&vm, 100, &n) == MIPSVM_RC_SYSCALL && vm.gpr[2] == 9;
+
+    // host write of the range, as after loading the code
+    writew(0x11C, 0x24420003);     // addiu v0, v0, 3
+    mipsvm_invalidate_range(&vm, 0x11C, 4);
+    vm.pc = 0x100;
+    vm.gpr[2] = 0;
+    ok = ok && mipsvm_run(&vm, 100, &n) == MIPSVM_RC_SYSCALL && vm.gpr[2] == 11;
+
+    return ok && vm.bstats.invalidations == 2;
+}
+
+// preempted task must not keep the single worker from the other ready ones
+static bool pool_turns(void)
+{
+    static mipsvm_pool_t pool;
+    static mipsvm_pool_worker_t workers[1];
+    static mipsvm_pool_task_t tasks[2];
+    static mipsvm_t vms[2];
+    uint64_t slices[2] = { 0 };
+
+    memset(mem, 0, sizeof(mem));
+    load(0, spin_code, sizeof(spin_code));
+
+    if (! mipsvm_pool_start(&pool, workers, 1, 0))
+        return 0;
+    for (int i = 0; i < 2; i++)
+    {
+        mipsvm_init(&vms[i], &iface, 0);
+        mipsvm_pool_add(&pool, &tasks[i], &vms[i], 1000);
+    }
+
+    for (int ms = 0; ms < 2000 && (slices[0] < 100 || slices[1] < 100); ms += 10)
+    {
+        sleep_ms(10);
+        for (int i = 0; i < 2; i++)
+            slices[i] = __atomic_load_n(&tasks[i].task.slices, __ATOMIC_RELAXED);
+    }
+    mipsvm_pool_stop(&pool);
+
+    return slices[0] >= 100 && slices[1] >= 100;
+}
+
+// completions of the stale, unknown and already completed tokens never resume the script
+static bool cq_tokens(void)
+{
+    static mipsvm_call_t calls[2];
+    static mipsvm_cq_t cq;
+    mipsvm_t a, b, *vms[4];
+
+    mipsvm_init(&a, &iface, 0);
+    mipsvm_init(&b, &iface, 0);
+    mipsvm_cq_init(&cq, calls, 2);
+
+    uint32_t t1 = mipsvm_cq_submit(&cq, &a)->token;
+    mipsvm_cq_complete(&cq, t1, 5, 0);
+    mipsvm_cq_complete(&cq, t1, 6, 0);          // duplicate
+    mipsvm_cq_complete(&cq, 12345, 7, 0);       // unknown
+    bool ok = mipsvm_cq_drain(&cq, vms, 4) == 1 && vms[0] == &a && a.gpr[2] == 5;
+
+    // call is reused with the new token, the old one is stale
+    uint32_t t2 = mipsvm_cq_submit(&cq, &b)->token;
+    mipsvm_cqe_t cqes[] = { { t1, 8, 0 }, { t2, 9, 0 }, { t2, 10, 0 } };
+    mipsvm_cq_complete_batch(&cq, cqes, 3);
+    ok = ok && t2 != t1 && mipsvm_cq_drain(&cq, vms, 4) == 1 && vms[0] == &b && b.gpr[2] == 9 && a.gpr[2] == 5;
+
+    // all calls in flight
+    ok = ok && mipsvm_cq_submit(&cq, &a) && mipsvm_cq_submit(&cq, &b) && ! mipsvm_cq_submit(&cq, &a);
+
+    return ok && cq.stats.rejected == 4 && cq.inflight == 2;
+}
+
+// group larger than MIPSVM_SIMT_LANES is refused, diverged lanes end with the same results as run one by one
+static bool simt_lanes(void)
+{
+    static const uint32_t code[] =
+    {
+        0x00441021,     // 1: addu v0, v0, a0
+        0x2484FFFF,     //    addiu a0, a0, -1
+        0x1480FFFD,     //    bnez a0, 1b
+        0x00000000,     //    nop
+        0xAC020800,     //    sw v0, 0x800(zero)
+        0x0000004C,     //    syscall 1
+    };
+    static uint8_t lane_mem[MIPSVM_SIMT_LANES][0x1000];
+    static mipsvm_region_t regions[MIPSVM_SIMT_LANES];
+    static mipsvm_t vms[MIPSVM_SIMT_LANES + 1];
+    static mipsvm_simt_t simt;
+
+    if (mipsvm_simt_init(&simt, vms, MIPSVM_SIMT_LANES + 1))
+        return 0;
+
+    for (uint32_t l = 0; l < MIPSVM_SIMT_LANES; l++)
+    {
+        memset(lane_mem[l], 0, sizeof(lane_mem[l]));
+        memcpy(lane_mem[l], code, sizeof(code));
+        regions[l] = (mipsvm_region_t) { 0, sizeof(lane_mem[l]), lane_mem[l], true };
+        mipsvm_init(&vms[l], &iface, 0);
+        mipsvm_set_regions(&vms[l], &regions[l], 1);
+        vms[l].gpr[4] = 10 + l * 3;     // loops diverge
+    }
+
+    bool ok = mipsvm_simt_init(&simt, vms, MIPSVM_SIMT_LANES) && ! mipsvm_simt_run(&simt, 10000);
+    ok = ok && simt.stats.divergent && simt.stats.dropouts == MIPSVM_SIMT_LANES;
+
+    for (uint32_t l = 0; l < MIPSVM_SIMT_LANES; l++)
+    {
+        uint32_t n = 10 + l * 3;
+        uint32_t sum;
+
+        memcpy(&sum, &lane_mem[l][0x800], 4);
+        ok = ok && mipsvm_exec(&vms[l]) == MIPSVM_RC_SYSCALL && vms[l].gpr[2] == n * (n + 1) / 2 && sum == vms[l].gpr[2];
+    }
+
+    return ok;
+}
+
+// adds a0 to the word at a1 on every syscall
+static const uint32_t add_code[] =
+{
+    0x8CA80000,     // 1: lw t0, 0(a1)
+    0x01044021,     //    addu t0, t0, a0
+    0xACA80000,     //    sw t0, 0(a1)
+    0x0000004C,     //    syscall 1
+    0x1000FFFB,     //    b 1b
+    0x00000000,     //    nop
+};
+
+// forks start from the snapshot and never see the writes of each other or of the template, restore rolls them back
+static bool snapshot_fork(void)
+{
+    static uint8_t data[0x4000] __attribute__((aligned(MIPSVM_PAGE_SIZE)));
+    static mipsvm_snapshot_t snap;
+    mipsvm_region_t regions[] =
+    {
+        { 0x1000, sizeof(add_code), (uint8_t *) add_code, false },
+        { 0x100000, sizeof(data), data, true },
+    };
+    mipsvm_region_t fork_regions[2][MIPSVM_SNAPSHOT_REGIONS];
+    mipsvm_t template, forks[2];
+    uint32_t n, w;
+
+    memset(data, 0, sizeof(data));
+    mipsvm_init(&template, &iface, 0x1000);
+    mipsvm_set_regions(&template, regions, 2);
+    template.gpr[4] = 7;
+    template.gpr[5] = 0x100000;
+
+    if (mipsvm_run(&template, 100, &n) != MIPSVM_RC_SYSCALL || ! mipsvm_snapshot(&snap, &template))
+        return 0;
+
+    // template goes on after the snapshot
+    template.gpr[4] = 100;
+    bool ok = mipsvm_run(&template, 100, &n) == MIPSVM_RC_SYSCALL;
+
+    for (int i = 0; i < 2; i++)
+    {
+        ok = ok && mipsvm_fork(&forks[i], &snap, fork_regions[i]);
+        ok = ok && forks[i].pc == 0x1010 && forks[i].gpr[4] == 7;
+        forks[i].gpr[4] = i + 1;
+        ok = ok && mipsvm_run(&forks[i], 100, &n) == MIPSVM_RC_SYSCALL;
+    }
+
+    memcpy(&w, data, 4);
+    ok = ok && w == 107 && mipsvm_readw(&forks[0], 0x100000) == 8 && mipsvm_readw(&forks[1], 0x100000) == 9;
+
+    ok = ok && mipsvm_restore(&template, &snap) && template.pc == 0x1010 && template.gpr[4] == 7;
+    memcpy(&w, data, 4);
+    ok = ok && w == 7 && mipsvm_restore(&forks[0], &snap) && mipsvm_readw(&forks[0], 0x100000) == 7;
+    ok = ok && mipsvm_readw(&forks[1], 0x100000) == 9;
+
+    for (int i = 0; i < 2; i++)
+        mipsvm_fork_free(&forks[i]);
+    mipsvm_snapshot_free(&snap);
+    return ok;
+}
+
+typedef struct
+{
+    uint8_t data[0x8000];
+    uint32_t size;
+    uint32_t pos;
+} stream_t;
+
+static bool stream_write(void *user, void *data, uint32_t size)
+{
+    stream_t *st = user;
+
+    if (size > sizeof(st->data) - st->size)
+        return 0;
+    memcpy(st->data + st->size, data, size);
+    st->size += size;
+    return 1;
+}
+
+static bool stream_read(void *user, void *data, uint32_t size)
+{
+    stream_t *st = user;
+
+    if (size > st->size - st->pos)
+        return 0;
+    memcpy(data, st->data + st->pos, size);
+    st->pos += size;
+    return 1;
+}
+
+// full checkpoint followed by the incremental one restores the other VM, the incremental one saves the written page only
+static bool checkpoint_restore(void)
+{
+    static uint8_t data[2][0x4000];
+    static uint32_t dirty[2][1];
+    static stream_t st;
+    mipsvm_region_t regions[2][2];
+    mipsvm_t vms[2];
+    uint32_t n;
+
+    for (int i = 0; i < 2; i++)
+    {
+        regions[i][0] = (mipsvm_region_t) { 0x1000, sizeof(add_code), (uint8_t *) add_code, false };
+        regions[i][1] = (mipsvm_region_t) { 0x100000, sizeof(data[i]), data[i], true };
+        mipsvm_init(&vms[i], &iface, 0x1000);
+        mipsvm_set_regions(&vms[i], regions[i], 2);
+        mipsvm_set_dirty_map(&vms[i], dirty[i], 0x100000, sizeof(data[i]));
+    }
+
+    mipsvm_t *vm = &vms[0];
+    for (uint32_t i = 0; i < sizeof(data[0]); i++)
+        data[0][i] = i * 7;
+    memset(data[1], 0xAB, sizeof(data[1]));
+    st.size = 0;
+    st.pos = 0;
+
+    bool ok = mipsvm_checkpoint(vm, true, stream_write, &st);
+    uint32_t full = st.size;
+
+    vm->gpr[4] = 5;
+    vm->gpr[5] = 0x102000;
+    ok = ok && mipsvm_run(vm, 100, &n) == MIPSVM_RC_SYSCALL && mipsvm_checkpoint(vm, false, stream_write, &st);
+    ok = ok && full > 4 * MIPSVM_PAGE_SIZE && st.size - full > MIPSVM_PAGE_SIZE && st.size - full < 2 * MIPSVM_PAGE_SIZE;
+
+    ok = ok && mipsvm_checkpoint_restore(&vms[1], stream_read, &st);
+    ok = ok && mipsvm_checkpoint_restore(&vms[1], stream_read, &st) && st.pos == st.size;
+
+    return ok && ! memcmp(data[0], data[1], sizeof(data[0])) && ! memcmp(vms[0].gpr, vms[1].gpr, sizeof(vms[0].gpr)) &&
+           vms[0].pc == vms[1].pc;
+}
+
+#ifdef MIPSVM_TEST_SANDBOX
+static bool copy_string_syscall(mipsvm_t *ctx, void *user)
+{
+    char buf[16];
+
+    *(bool *) user = mipsvm_copy_string(ctx, ctx->gpr[4], buf, sizeof(buf), 0);
+    return 1;
+}
+
+// unmapped script pointer is the address error of the script, not the host crash
+static bool sandbox_copy_string(void)
+{
+    static const uint32_t code[] =
+    {
+        0x24045000,     // li a0, 0x5000
+        0x0000008C,     // syscall 2
+        0x0000004C,     // syscall 1
+    };
+    static const mipsvm_syscall_t syscalls[] = { 0, 0, copy_string_syscall };
+    static mipsvm_sandbox_t sb;
+    mipsvm_t vm;
+    char buf[16];
+    bool copied = 1;
+    uint32_t n;
+
+    if (! mipsvm_sandbox_init(&sb))
+        return 0;
+    mipsvm_sandbox_map(&sb, 0, 0x1000, true);
+    memcpy(sb.base, code, sizeof(code));
+    strcpy((char *) sb.base + 0x800, "hello");
+    mipsvm_init(&vm, &iface, 0);
+    mipsvm_set_sandbox(&vm, &sb);
+
+    // host call outside of the run
+    bool ok = mipsvm_copy_string(&vm, 0x800, buf, sizeof(buf), 0) && ! strcmp(buf, "hello");
+    ok = ok && ! mipsvm_copy_string(&vm, 0x5000, buf, sizeof(buf), 0);
+    ok = ok && vm.exception == MIPSVM_RC_READ_ADDRESS_ERROR && ! sb.scratch.used;
+
+    // inline syscall during the run
+    mipsvm_set_syscalls(&vm, syscalls, 3, &copied);
+    ok = ok && mipsvm_run(&vm, 100, &n) == MIPSVM_RC_READ_ADDRESS_ERROR && ! copied && ! sb.scratch.used;
+
+    mipsvm_sandbox_free(&sb);
+    return ok;
+}
+
+// loads and stores of the hot loops, ended by the fault, the misaligned access and the store to the own block
+static const uint32_t sandbox_code[] =
+{
+    // 0x000, copy loop, a3 runs into the unmapped page
+    0x8CA80000,     // 1: lw t0, 0(a1)
+    0x90A90001,     //    lbu t1, 1(a1)
+    0x84EA0000,     //    lh t2, 0(a3)
+    0x01094021,     //    addu t0, t0, t1
+    0x010A4021,     //    addu t0, t0, t2
+    0xACC80000,     //    sw t0, 0(a2)
+    0xA0C80004,     //    sb t0, 4(a2)
+    0xA4C80006,     //    sh t0, 6(a2)
+    0x00481021,     //    addu v0, v0, t0
+    0x24A50004,     //    addiu a1, a1, 4
+    0x24E70002,     //    addiu a3, a3, 2
+    0x2484FFFF,     //    addiu a0, a0, -1
+    0x1480FFF3,     //    bnez a0, 1b
+    0x24C60008,     //    addiu a2, a2, 8
+    0x0000004C,     //    syscall 1
+};
+
+static const uint32_t misaligned_code[] =
+{
+    // 0x100, the last load is misaligned
+    0x2C8E0002,     // 1: sltiu t6, a0, 2
+    0x00AE7821,     //    addu t7, a1, t6
+    0x8DEC0000,     //    lw t4, 0(t7)
+    0x006C1821,     //    addu v1, v1, t4
+    0x2484FFFF,     //    addiu a0, a0, -1
+    0x1480FFFA,     //    bnez a0, 1b
+    0x00000000,     //    nop
+    0x0000004C,     //    syscall 1
+};
+
+static const uint32_t patch_code[] =
+{
+    // 0x200, the store rewrites the delay slot of its own block once a0 == 50, elsewhere it goes to s2
+    0x388F0032,     // 1: xori t7, a0, 50
+    0x0240C021,     //    move t8, s2
+    0x020FC00A,     //    movz t8, s0, t7
+    0xAF110020,     //    sw s1, 0x20(t8)
+    0x2484FFFF,     //    addiu a0, a0, -1
+    0x00781821,     //    addu v1, v1, t8
+    0x00621821,     //    addu v1, v1, v0
+    0x1480FFF8,     //    bnez a0, 1b
+    0x24420001,     //    addiu v0, v0, 1
+    0x0000004C,     //    syscall 1
+};
+
+static mipsvm_rc_t sandbox_run(mipsvm_sandbox_t *sb, engine_t engine, uint32_t pc, mipsvm_t *vm)
+{
+    memset(sb->base, 0, 0x4000);
+    memcpy(sb->base, sandbox_code, sizeof(sandbox_code));
+    memcpy(sb->base + 0x100, misaligned_code, sizeof(misaligned_code));
+    memcpy(sb->base + 0x200, patch_code, sizeof(patch_code));
+    for (uint32_t i = 0; i < 0x1000; i++)
+        sb->base[0x2000 + i] = i * 7 + (i >> 8);
+
+    mipsvm_init(vm, &iface, pc);
+    mipsvm_set_sandbox(vm, sb);
+    vm->gpr[4] = 100;
+    vm->gpr[5] = 0x2000;
+    vm->gpr[6] = 0x3000;
+    vm->gpr[7] = 0x3F80;
+    vm->gpr[16] = 0x200;
+    vm->gpr[17] = 0x24420002;   // addiu v0, v0, 2
+    vm->gpr[18] = 0x3800;
+
+    mipsvm_rc_t rc = run(vm, engine);
+    mipsvm_set_sandbox(vm, 0);
+    return rc;
+}
+
+// every engine ends the sandbox scripts in the same state as the single-step one
+static bool sandbox_engines(void)
+{
+    static const uint32_t entries[] = { 0x000, 0x100, 0x200 };
+    static const mipsvm_rc_t rcs[] = { MIPSVM_RC_READ_ADDRESS_ERROR, MIPSVM_RC_READ_ADDRESS_ERROR, MIPSVM_RC_SYSCALL };
+    static mipsvm_sandbox_t sb;
+    bool ok = true;
+
+    if (! mipsvm_sandbox_init(&sb) || ! mipsvm_sandbox_map(&sb, 0, 0x4000, true))
+        return 0;
+
+    for (int i = 0; i < 3; i++)
+    {
+        mipsvm_t ref;
+        uint8_t ref_mem[0x1000];
+
+        ok = ok && sandbox_run(&sb, ENGINE_EXEC, entries[i], &ref) == rcs[i];
+        memcpy(ref_mem, sb.base + 0x3000, sizeof(ref_mem));
+
+        for (int e = ENGINE_RUN; e < ENGINES_NUM; e++)
+        {
+            mipsvm_t vm;
+            ok = ok && sandbox_run(&sb, e, entries[i], &vm) == rcs[i] && vm.pc == ref.pc;
+            ok = ok && ! memcmp(vm.gpr, ref.gpr, sizeof(vm.gpr)) && ! memcmp(sb.base + 0x3000, ref_mem, sizeof(ref_mem));
+        }
+    }
+
+    mipsvm_sandbox_free(&sb);
+    return ok;
+}
+
+// segments stay within the guest address space, the host memory past the reservation is never touched
+static bool sandbox_map_range(void)
+{
+    static mipsvm_sandbox_t sb;
+
+    if (! mipsvm_sandbox_init(&sb))
+        return 0;
+
+    // host page right after the reservation, so the oversized range is not refused by mprotect alone
+    uint8_t *after = mmap(sb.base + (1ULL << 32), MIPSVM_PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    bool ok = ! mipsvm_sandbox_map(&sb, 0xFFFFF000, 0x2000, true);
+    ok = ok && ! mipsvm_sandbox_map(&sb, 0x2000, 0xFFFFF000, false);
+    ok = ok && mipsvm_sandbox_map(&sb, 0xFFFFF000, 0x1000, true) && sb.segments[0].addr == 0xFFFFF000;
+    ok = ok && sb.segments_num == 1;
+
+    if (after != MAP_FAILED)
+        munmap(after, MIPSVM_PAGE_SIZE);
+
+    mipsvm_sandbox_free(&sb);
+    return ok;
+}
+#endif
+
+static const test_t tests[] =
+{
+    { "copy_string", copy_string },
+    { "syscall_inline", syscall_inline },
+    { "fuel_unlimited", fuel_unlimited },
+    { "block_invalidation", block_invalidation },
+    { "pool_turns", pool_turns },
+    { "cq_tokens", cq_tokens },
+    { "simt_lanes", simt_lanes },
+    { "snapshot_fork", snapshot_fork },
+    { "checkpoint_restore", checkpoint_restore },
+#ifdef MIPSVM_TEST_SANDBOX
+    { "sandbox_copy_string", sandbox_copy_string },
+    { "sandbox_map_range", sandbox_map_range },
+    { "sandbox_engines", sandbox_engines },
+#endif
+};
+
+int main(int argc, char **argv)
+{
+    const char *only = argc > 1 ? argv[1] : 0;
+    bool ok = true;
+
+    for (uint32_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++)
+    {
+        if (only && strcmp(only, tests[i].name))
+            continue;
+
+        bool passed = tests[i].run();
+        printf("%s %s\n", passed ? "ok" : "FAIL", tests[i].name);
+        ok = ok && passed;
+    }
+
+    return ! ok;
+}
@@ -0,0 +1,427 @@
+#define __MIPSVM_TRACE_C__
+
+// Record/replay. Given the same code and the initial state, the script run depends only on what the host gives it:
+// results of the iface reads, the registers changed between the runs (syscall results, etc) and by the syscalls handled
+// inside the VM. Record streams them as they happen, replay feeds them back without calling the host or the handlers, so
+// the run is repeated exactly.
+// Host writes the stream in chunks of the trace buffer size, the recording never blocks or allocates in between.
+//
+// Stream:
+//   magic, version, fetch setup words (see fetch_setup), then chunks: length word, data. Zero length chunk ends the trace
+//   run record: changed registers mask, varint. Zigzag delta varint per changed register. Zigzag delta varint of the
+//               instruction budget. Reads done by the run follow, then the result byte (mipsvm_rc_t)
+//   read:       zigzag varint of the delta to the previous read value
+//   syscall:    handled byte, then the registers the handler changed as in the run record
+// Memory written by the host directly (regions, TLB pages) is not traced, replay host has to do the same writes.
+// Code fetched via the callbacks is read via the hook as well, how often depends on the caches. They are flushed when the
+// trace is attached, and the replay VM must have the same caches as the recording one (checked by the header).
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mipsvm.h"
+#include "mipsvm_trace.h"
+
+#define MAGIC 0x5254564D    // "MVTR"
+#define VERSION 2
+#define REGS 35
+#define VARINT_MAX 10
+#define HDR_WORDS 8
+#define RECORD_MAX ((REGS + 2) * VARINT_MAX)    // largest run record, buffer is flushed to keep space for it
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint32_t zigzag(uint32_t delta)
+{
+    return delta << 1 ^ -(delta >> 31);
+}
+
+static uint32_t unzigzag(uint32_t v)
+{
+    return v >> 1 ^ -(v & 1);
+}
+
+static void get_regs(const mipsvm_t *ctx, uint32_t *regs)
+{
+    memcpy(regs, ctx->gpr, sizeof(ctx->gpr));
+    regs[32] = ctx->hi;
+    regs[33] = ctx->lo;
+    regs[34] = ctx->pc;
+}
+
+static uint32_t get_reg(const mipsvm_t *ctx, uint32_t i)
+{
+    return i < 32 ? ctx->gpr[i] : i == 32 ? ctx->hi : i == 33 ? ctx->lo : ctx->pc;
+}
+
+static void set_regs(mipsvm_t *ctx, const uint32_t *regs)
+{
+    memcpy(&ctx->gpr[1], &regs[1], sizeof(ctx->gpr) - 4);
+    ctx->hi = regs[32];
+    ctx->lo = regs[33];
+    ctx->pc = regs[34];
+}
+
+// registers changed since the last run, bit per regs entry. Usually only the few set by the host did, so the unchanged
+// ones are skipped by the groups
+static uint64_t changed_regs(const mipsvm_t *ctx, const uint32_t *regs)
+{
+    uint64_t mask = (uint64_t) (ctx->hi != regs[32]) << 32 | (uint64_t) (ctx->lo != regs[33]) << 33 |
+                    (uint64_t) (ctx->pc != regs[34]) << 34;
+
+    for (uint32_t i = 0; i < 32; i += 4)
+    {
+        if (! memcmp(&ctx->gpr[i], &regs[i], 16))
+            continue;
+
+        for (uint32_t j = i; j < i + 4; j++)
+        {
+            if (ctx->gpr[j] != regs[j])
+                mask |= 1U << j;
+        }
+    }
+    return mask;
+}
+
+static uint8_t *put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = v | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+// registers changed against regs: the mask, then the delta of each
+static uint8_t *put_changes(uint8_t *p, const mipsvm_t *ctx, const uint32_t *regs)
+{
+    uint64_t mask = changed_regs(ctx, regs);
+
+    p = put_varint(p, mask);
+    for (uint32_t i = 1; mask >> i; i++)
+    {
+        if (mask >> i & 1)
+            p = put_varint(p, zigzag(get_reg(ctx, i) - regs[i]));
+    }
+    return p;
+}
+
+// caches deciding which code fetches reach the callbacks
+static void fetch_setup(const mipsvm_t *ctx, uint32_t *words)
+{
+    const mipsvm_icache_t *ic = ctx->icache;
+
+    words[0] = ctx->dcache ? ctx->dcache_mask + 1 : 0;
+    words[1] = ctx->blocks ? ctx->blocks_mask + 1 : 0;
+    words[2] = ic ? 1U << ic->line_bits : 0;
+    words[3] = ic ? ic->sets_mask + 1 : 0;
+    words[4] = ic ? ic->ways : 0;
+    words[5] = ctx->natives_num;
+}
+
+// record
+
+static bool flush(mipsvm_trace_t *t)
+{
+    uint8_t len[4];
+
+    put32(len, t->pos);
+    if (! t->failed && ! (t->io(t->user, len, 4) && (! t->pos || t->io(t->user, t->buf, t->pos))))
+        t->failed = 1;
+
+    t->bytes += 4 + t->pos;
+    t->pos = 0;
+    return ! t->failed;
+}
+
+static uint32_t record_read(mipsvm_iface_hook_t *hook, uint32_t addr, uint32_t size)
+{
+    mipsvm_trace_t *t = (mipsvm_trace_t *) hook;
+    const mipsvm_iface_t *iface = &t->vm->iface;
+    uint32_t v = size == 1 ? iface->readb(addr) : size == 2 ? iface->readh(addr) : iface->readw(addr);
+
+    if (t->size - t->pos < VARINT_MAX)
+        flush(t);
+    t->pos = put_varint(t->buf + t->pos, zigzag(v - t->last_read)) - t->buf;
+    t->last_read = v;
+    t->reads++;
+    return v;
+}
+
+static void record_write(mipsvm_iface_hook_t *hook, uint32_t addr, uint32_t data, uint32_t size)
+{
+    const mipsvm_iface_t *iface = &((mipsvm_trace_t *) hook)->vm->iface;
+
+    if (size == 1)
+        iface->writeb(addr, data);
+    else if (size == 2)
+        iface->writeh(addr, data);
+    else
+        iface->writew(addr, data);
+}
+
+// inline syscall is recorded with the registers its handler changed
+static bool record_syscall(mipsvm_iface_hook_t *hook, uint32_t code)
+{
+    mipsvm_trace_t *t = (mipsvm_trace_t *) hook;
+    mipsvm_t *ctx = t->vm;
+    uint32_t regs[REGS];
+
+    get_regs(ctx, regs);
+    bool handled = code < ctx->syscalls_num && ctx->syscalls[code] && ctx->syscalls[code](ctx, ctx->syscalls_user);
+
+    if (t->size - t->pos < RECORD_MAX)
+        flush(t);
+
+    uint8_t *p = t->buf + t->pos;
+    *p++ = handled;
+    p = put_changes(p, ctx, regs);
+    t->pos = p - t->buf;
+    t->syscalls++;
+    return handled;
+}
+
+// replay
+
+static bool next_chunk(mipsvm_trace_t *t)
+{
+    uint8_t len[4];
+
+    t->pos = 0;
+    t->len = 0;
+    if (t->end || t->failed)
+        return 0;
+
+    if (! t->io(t->user, len, 4) || get32(len) > t->size || ! t->io(t->user, t->buf, get32(len)))
+    {
+        t->failed = 1;
+        return 0;
+    }
+
+    t->len = get32(len);
+    t->bytes += 4 + t->len;
+    t->end = ! t->len;
+    return t->len;
+}
+
+static bool get_varint(mipsvm_trace_t *t, uint64_t *v)
+{
+    *v = 0;
+    for (uint32_t shift = 0; shift < 7 * VARINT_MAX; shift += 7)
+    {
+        if (t->pos == t->len && ! next_chunk(t))
+            return 0;
+
+        uint8_t b = t->buf[t->pos++];
+        *v |= (uint64_t) (b & 0x7F) << shift;
+        if (! (b & 0x80))
+            return 1;
+    }
+
+    t->failed = 1;
+    return 0;
+}
+
+// script reads past the recorded ones when the replay diverged, they get 0
+static uint32_t replay_read(mipsvm_iface_hook_t *hook, uint32_t addr, uint32_t size)
+{
+    mipsvm_trace_t *t = (mipsvm_trace_t *) hook;
+    uint64_t v;
+
+    (void) addr;
+    if (! get_varint(t, &v))
+    {
+        t->failed = 1;
+        return 0;
+    }
+
+    t->last_read += unzigzag(v);
+    t->reads++;
+    return size == 4 ? t->last_read : t->last_read & ((1U << size * 8) - 1);
+}
+
+// end of the trace or the damaged one, the host stops the replay
+static mipsvm_rc_t trace_over(mipsvm_trace_t *t)
+{
+    t->end = 1;
+    return MIPSVM_RC_OK;
+}
+
+// registers changed by the record, applied to regs
+static bool get_changes(mipsvm_trace_t *t, uint32_t *regs)
+{
+    uint64_t mask, v;
+
+    if (! get_varint(t, &mask))
+        return 0;
+
+    for (uint32_t i = 1; i < REGS; i++)
+    {
+        if (mask >> i & 1)
+        {
+            if (! get_varint(t, &v))
+                return 0;
+            regs[i] += unzigzag(v);
+        }
+    }
+    return 1;
+}
+
+// handler is not called, the registers it changed are restored from the trace
+static bool replay_syscall(mipsvm_iface_hook_t *hook, uint32_t code)
+{
+    mipsvm_trace_t *t = (mipsvm_trace_t *) hook;
+    uint32_t regs[REGS];
+    uint64_t handled;
+
+    (void) code;
+    get_regs(t->vm, regs);
+    if (! get_varint(t, &handled) || handled > 1 || ! get_changes(t, regs))
+    {
+        t->failed = 1;
+        return 0;
+    }
+
+    set_regs(t->vm, regs);
+    t->syscalls++;
+    return handled;
+}
+
+static void replay_write(mipsvm_iface_hook_t *hook, uint32_t addr, uint32_t data, uint32_t size)
+{
+    (void) hook;
+    (void) addr;
+    (void) data;
+    (void) size;
+}
+
+// attaches the trace to the VM. Record writes the stream via io, replay reads it. The VM state and caches must be the
+// same as when the recording started. Buffer is used for the chunks, replay buffer must not be smaller than the record one
+bool mipsvm_trace_init(mipsvm_trace_t *t, mipsvm_t *vm, mipsvm_trace_mode_t mode, uint8_t *buf, uint32_t size,
+                       mipsvm_io_t io, void *user)
+{
+    uint8_t hdr[HDR_WORDS * 4];
+    uint32_t words[HDR_WORDS] = { MAGIC, VERSION };
+
+    memset(t, 0, sizeof(*t));
+    if (size < RECORD_MAX)
+        return 0;
+
+    t->vm = vm;
+    t->mode = mode;
+    t->buf = buf;
+    t->size = size;
+    t->io = io;
+    t->user = user;
+    get_regs(vm, t->regs);
+    fetch_setup(vm, &words[2]);
+
+    // code fetches start from the same cold caches in both modes
+    mipsvm_flush_decode_cache(vm);
+    mipsvm_flush_block_cache(vm);
+    mipsvm_flush_icache(vm);
+
+    if (mode == MIPSVM_TRACE_RECORD)
+    {
+        t->hook.read = record_read;
+        t->hook.write = record_write;
+        t->hook.syscall = record_syscall;
+        for (uint32_t i = 0; i < HDR_WORDS; i++)
+            put32(hdr + i * 4, words[i]);
+        if (! io(user, hdr, sizeof(hdr)))
+            return 0;
+    }
+    else
+    {
+        t->hook.read = replay_read;
+        t->hook.write = replay_write;
+        t->hook.syscall = replay_syscall;
+        if (! io(user, hdr, sizeof(hdr)))
+            return 0;
+        for (uint32_t i = 0; i < HDR_WORDS; i++)
+        {
+            if (get32(hdr + i * 4) != words[i])
+                return 0;
+        }
+    }
+
+    t->bytes = sizeof(hdr);
+    mipsvm_set_iface_hook(vm, &t->hook);
+    return 1;
+}
+
+// mipsvm_run, recorded or replayed. Registers the host changed since the previous run are recorded, so the host
+// handles the syscalls etc as usual when recording, and does nothing when replaying: the registers are restored here.
+// Replay returns MIPSVM_RC_OK and 0 retired once the trace is over or the replay failed, t->end is set then
+mipsvm_rc_t mipsvm_trace_run(mipsvm_trace_t *t, uint32_t max_instr, uint32_t *retired)
+{
+    mipsvm_t *ctx = t->vm;
+    mipsvm_rc_t rc;
+
+    *retired = 0;
+
+    if (t->mode == MIPSVM_TRACE_RECORD)
+    {
+        if (t->size - t->pos < RECORD_MAX)
+            flush(t);
+
+        uint8_t *p = put_changes(t->buf + t->pos, ctx, t->regs);
+        p = put_varint(p, zigzag(max_instr - t->budget));
+        t->pos = p - t->buf;
+
+        rc = mipsvm_run(ctx, max_instr, retired);
+
+        if (t->size - t->pos < VARINT_MAX)
+            flush(t);
+        t->buf[t->pos++] = rc;
+    }
+    else
+    {
+        uint32_t regs[REGS];
+        uint64_t v;
+
+        memcpy(regs, t->regs, sizeof(regs));
+        if (t->failed || ! get_changes(t, regs) || ! get_varint(t, &v))
+            return trace_over(t);
+        max_instr = t->budget + unzigzag(v);
+
+        set_regs(ctx, regs);
+        rc = mipsvm_run(ctx, max_instr, retired);
+
+        if (! get_varint(t, &v) || v != rc)
+            t->failed = 1;
+    }
+
+    t->budget = max_instr;
+    t->runs++;
+    get_regs(ctx, t->regs);
+    return rc;
+}
+
+// ends the recording (writes the rest of the stream) and detaches the trace. Returns false if the stream could not
+// be written, or the replay diverged from the recording
+bool mipsvm_trace_finish(mipsvm_trace_t *t)
+{
+    if (t->mode == MIPSVM_TRACE_RECORD)
+    {
+        if (t->pos)
+            flush(t);
+        flush(t);   // end chunk
+    }
+
+    mipsvm_set_iface_hook(t->vm, 0);
+    return ! t->failed;
+}
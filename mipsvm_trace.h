@@ -0,0 +1,41 @@
+#ifndef __MIPSVM_TRACE_H__
+#define __MIPSVM_TRACE_H__
+// public, deterministic record/replay of the script run
+
+#include "mipsvm.h"
+
+typedef enum
+{
+    MIPSVM_TRACE_RECORD,
+    MIPSVM_TRACE_REPLAY,
+} mipsvm_trace_mode_t;
+
+// trace of the single VM, buffer is provided by the host
+typedef struct
+{
+    mipsvm_iface_hook_t hook;   // first, the hook is the trace
+    mipsvm_t *vm;
+    mipsvm_trace_mode_t mode;
+    mipsvm_io_t io;             // record: writes the chunk, replay: reads it
+    void *user;
+    uint8_t *buf;
+    uint32_t size;
+    uint32_t pos;
+    uint32_t len;               // replay: bytes of the current chunk
+    uint32_t regs[35];          // gpr, hi, lo, pc as left by the last run
+    uint32_t budget;            // of the last run
+    uint32_t last_read;
+    bool end;                   // replay: trace is over or the replay failed
+    bool failed;                // io error, bad trace or the replay diverged
+    uint64_t runs;
+    uint64_t reads;
+    uint64_t syscalls;          // handled inside the VM or offered to the handlers
+    uint64_t bytes;             // stream size
+} mipsvm_trace_t;
+
+bool mipsvm_trace_init(mipsvm_trace_t *t, mipsvm_t *vm, mipsvm_trace_mode_t mode, uint8_t *buf, uint32_t size,
+                       mipsvm_io_t io, void *user);
+mipsvm_rc_t mipsvm_trace_run(mipsvm_trace_t *t, uint32_t max_instr, uint32_t *retired);
+bool mipsvm_trace_finish(mipsvm_trace_t *t);
+
+#endif